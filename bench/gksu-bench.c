@@ -0,0 +1,653 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of Gksu PolicyKit.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <gtk/gtk.h>
+#include <gio/gio.h>
+#include <gksu-process.h>
+#include <gksu-dbus.h>
+
+/*
+ * Drives gksu-server the way its clients do and reports how long it
+ * takes, as JSON. It expects the server, and a PolicyKit that says
+ * yes, to be reachable on the system bus; run-bench.sh sets up a
+ * private bus with both.
+ *
+ * Spawn latency, the time to the first byte of output and the spawn
+ * rate with several clients at once are measured through libgksu.
+ * The library gets the child's pipes passed to it whenever it can, so
+ * the server's own relaying of input and output is measured through
+ * org.gnome.Gksu directly, with streamed output and WriteInput.
+ */
+
+static gint iterations = 200;
+static gint clients = 4;
+static gint spawns_per_client = 50;
+static gint relay_mib = 64;
+static gchar *output_file = NULL;
+
+static GOptionEntry entries[] =
+{
+  { "iterations", 0, 0, G_OPTION_ARG_INT, &iterations,
+    "How many spawns to time for latency and first byte (default: 200)", "N" },
+  { "clients", 0, 0, G_OPTION_ARG_INT, &clients,
+    "How many clients spawn at the same time for the spawn rate (default: 4)", "N" },
+  { "spawns-per-client", 0, 0, G_OPTION_ARG_INT, &spawns_per_client,
+    "How many processes each of those clients spawns (default: 50)", "N" },
+  { "relay-mib", 0, 0, G_OPTION_ARG_INT, &relay_mib,
+    "How much data to relay each way, in MiB (default: 64)", "MIB" },
+  { "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file,
+    "Where to write the results (default: standard output)", "FILE" },
+  { NULL }
+};
+
+#define BENCH_BUFFER_SIZE 65536
+
+typedef struct {
+  guint n_samples;
+  gdouble mean;
+  gdouble p50;
+  gdouble p99;
+  gdouble max;
+} BenchStats;
+
+typedef struct {
+  guint64 bytes;
+  gdouble seconds;
+} BenchThroughput;
+
+typedef struct {
+  guint spawns;
+  guint failures;
+  gdouble seconds;
+} BenchRate;
+
+static gint bench_compare_doubles(gconstpointer a, gconstpointer b)
+{
+  gdouble x = *(const gdouble*)a;
+  gdouble y = *(const gdouble*)b;
+
+  return (x > y) - (x < y);
+}
+
+/* nearest rank percentiles of @samples, which get sorted */
+static void bench_compute_stats(GArray *samples, BenchStats *stats)
+{
+  gdouble total = 0;
+  guint i;
+
+  memset(stats, 0, sizeof(BenchStats));
+  if(samples->len == 0)
+    return;
+
+  g_array_sort(samples, bench_compare_doubles);
+  for(i = 0; i < samples->len; i++)
+    total += g_array_index(samples, gdouble, i);
+
+  stats->n_samples = samples->len;
+  stats->mean = total / samples->len;
+  stats->p50 = g_array_index(samples, gdouble, (samples->len - 1) * 50 / 100);
+  stats->p99 = g_array_index(samples, gdouble, (samples->len - 1) * 99 / 100);
+  stats->max = g_array_index(samples, gdouble, samples->len - 1);
+}
+
+static gdouble bench_elapsed_ms(gint64 start)
+{
+  return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+/* libgksu */
+
+typedef struct {
+  gboolean exited;
+  gint status;
+} BenchExit;
+
+static void bench_exited_cb(GksuProcess *process, gint status, BenchExit *exit_data)
+{
+  exit_data->exited = TRUE;
+  exit_data->status = status;
+}
+
+static void bench_wait_for(gboolean *flag)
+{
+  while(!*flag)
+    g_main_context_iteration(NULL, TRUE);
+}
+
+typedef struct {
+  gint fd;
+  gint64 first_byte;
+  guint64 bytes;
+  gboolean done;
+  gchar *buffer;
+} BenchReader;
+
+/* the output may be relayed by libgksu from the main loop, so it is
+ * read from there too */
+static gboolean bench_reader_cb(GIOChannel *channel, GIOCondition condition,
+                                BenchReader *reader)
+{
+  gssize count = read(reader->fd, reader->buffer, BENCH_BUFFER_SIZE);
+
+  if(count > 0)
+    {
+      if(reader->first_byte == 0)
+        reader->first_byte = g_get_monotonic_time();
+      reader->bytes += count;
+      return TRUE;
+    }
+
+  if((count == -1) && ((errno == EAGAIN) || (errno == EINTR)))
+    return TRUE;
+
+  reader->done = TRUE;
+  return FALSE;
+}
+
+/*
+ * Runs @arguments through libgksu, and gives how long the spawn call
+ * took and, if @first_byte isn't %NULL, how long until the first byte
+ * of output was read; both in milliseconds. Returns %FALSE if the
+ * spawn failed.
+ */
+static gboolean bench_run_process(const gchar **arguments, gdouble *latency,
+                                  gdouble *first_byte)
+{
+  GksuProcess *process;
+  BenchExit exit_data = { FALSE, 0 };
+  BenchReader reader;
+  GError *error = NULL;
+  gint64 start;
+  gint stdout_fd = -1;
+
+  process = gksu_process_new("/", arguments);
+  g_signal_connect(process, "exited", G_CALLBACK(bench_exited_cb), &exit_data);
+
+  start = g_get_monotonic_time();
+  if(first_byte)
+    gksu_process_spawn_async_with_pipes(process, NULL, &stdout_fd, NULL, &error);
+  else
+    gksu_process_spawn_async(process, &error);
+  if(latency)
+    *latency = bench_elapsed_ms(start);
+
+  if(error)
+    {
+      g_warning("Unable to spawn %s: %s", arguments[0], error->message);
+      g_error_free(error);
+      g_object_unref(process);
+      return FALSE;
+    }
+
+  if(first_byte)
+    {
+      GIOChannel *channel;
+
+      memset(&reader, 0, sizeof(reader));
+      reader.fd = stdout_fd;
+      reader.buffer = g_malloc(BENCH_BUFFER_SIZE);
+      fcntl(stdout_fd, F_SETFL, fcntl(stdout_fd, F_GETFL) | O_NONBLOCK);
+
+      channel = g_io_channel_unix_new(stdout_fd);
+      g_io_add_watch(channel, G_IO_IN|G_IO_HUP|G_IO_ERR,
+                     (GIOFunc)bench_reader_cb, &reader);
+      g_io_channel_unref(channel);
+
+      bench_wait_for(&reader.done);
+      close(stdout_fd);
+      g_free(reader.buffer);
+
+      *first_byte = reader.first_byte ? (reader.first_byte - start) / 1000.0 : 0;
+    }
+
+  bench_wait_for(&exit_data.exited);
+  g_object_unref(process);
+
+  return TRUE;
+}
+
+static void bench_spawn_latency(BenchStats *latency, BenchStats *first_byte)
+{
+  const gchar *true_arguments[] = { "/bin/true", NULL };
+  const gchar *echo_arguments[] = { "/bin/echo", "gksu", NULL };
+  GArray *latencies = g_array_new(FALSE, FALSE, sizeof(gdouble));
+  GArray *first_bytes = g_array_new(FALSE, FALSE, sizeof(gdouble));
+  gint i;
+
+  for(i = 0; i < iterations; i++)
+    {
+      gdouble sample;
+
+      if(bench_run_process(true_arguments, &sample, NULL))
+        g_array_append_val(latencies, sample);
+    }
+
+  for(i = 0; i < iterations; i++)
+    {
+      gdouble sample;
+
+      if(bench_run_process(echo_arguments, NULL, &sample) && (sample > 0))
+        g_array_append_val(first_bytes, sample);
+    }
+
+  bench_compute_stats(latencies, latency);
+  bench_compute_stats(first_bytes, first_byte);
+
+  g_array_free(latencies, TRUE);
+  g_array_free(first_bytes, TRUE);
+}
+
+/* org.gnome.Gksu */
+
+typedef struct {
+  gint pid;
+  guint64 bytes;
+  gboolean exited;
+} BenchRelay;
+
+static void bench_relay_signal_cb(GDBusConnection *connection, const gchar *sender,
+                                  const gchar *object_path, const gchar *interface_name,
+                                  const gchar *signal_name, GVariant *parameters,
+                                  BenchRelay *relay)
+{
+  gint pid;
+
+  if(!strcmp(signal_name, "OutputData"))
+    {
+      GVariant *data;
+      gint fd;
+
+      g_variant_get(parameters, "(ii@ay)", &pid, &fd, &data);
+      if(pid == relay->pid)
+        relay->bytes += g_variant_get_size(data);
+      g_variant_unref(data);
+    }
+  else if(!strcmp(signal_name, "ProcessExited"))
+    {
+      g_variant_get(parameters, "(i)", &pid);
+      if(pid == relay->pid)
+        relay->exited = TRUE;
+    }
+}
+
+static gboolean bench_relay_spawn(GksuDBusGksu *server, const gchar *command,
+                                  gboolean using_stdin, gboolean using_stdout,
+                                  gint *pid, guint32 *cookie)
+{
+  const gchar *arguments[] = { "/bin/sh", "-c", command, NULL };
+  GError *error = NULL;
+
+  gksu_dbus_gksu_call_spawn_sync(server, "/", "", arguments,
+                                 g_variant_new_array(G_VARIANT_TYPE("{ss}"), NULL, 0),
+                                 using_stdin, using_stdout, FALSE,
+                                 pid, cookie, NULL, &error);
+  if(error)
+    {
+      g_warning("Unable to spawn %s: %s", command, error->message);
+      g_error_free(error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void bench_relay_finish(GksuDBusGksu *server, GksuDBusGksu2 *server2,
+                               guint32 cookie, BenchRelay *relay)
+{
+  GVariant *data;
+
+  bench_wait_for(&relay->exited);
+
+  /* whatever was not streamed before the exit is kept by the server
+   * until we Wait */
+  if(gksu_dbus_gksu2_call_read_output_sync(server2, cookie, 1, &data, NULL, NULL))
+    {
+      relay->bytes += g_variant_get_size(data);
+      g_variant_unref(data);
+    }
+
+  gksu_dbus_gksu_call_wait_sync(server, cookie, NULL, NULL, NULL);
+}
+
+static void bench_stdout_relay(GksuDBusGksu *server, GksuDBusGksu2 *server2,
+                               BenchRelay *relay, BenchThroughput *result)
+{
+  gchar *command;
+  guint32 cookie;
+  gint64 start;
+
+  memset(result, 0, sizeof(BenchThroughput));
+
+  command = g_strdup_printf("exec head -c %" G_GUINT64_FORMAT " /dev/zero",
+                            (guint64)relay_mib * 1024 * 1024);
+
+  start = g_get_monotonic_time();
+  if(!bench_relay_spawn(server, command, FALSE, TRUE, &relay->pid, &cookie))
+    {
+      g_free(command);
+      return;
+    }
+  g_free(command);
+
+  gksu_dbus_gksu_call_start_streaming_sync(server, cookie, NULL, NULL);
+  bench_relay_finish(server, server2, cookie, relay);
+
+  result->bytes = relay->bytes;
+  result->seconds = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+}
+
+static void bench_stdin_relay(GksuDBusGksu *server, GksuDBusGksu2 *server2,
+                              BenchRelay *relay, BenchThroughput *result)
+{
+  static gchar chunk[BENCH_BUFFER_SIZE];
+  guint64 total = (guint64)relay_mib * 1024 * 1024;
+  guint64 written = 0;
+  guint32 cookie;
+  gint64 start;
+  GError *error = NULL;
+
+  memset(result, 0, sizeof(BenchThroughput));
+
+  start = g_get_monotonic_time();
+  if(!bench_relay_spawn(server, "exec cat > /dev/null", TRUE, FALSE, &relay->pid, &cookie))
+    return;
+
+  /* the server holds the reply back while the child's input is full,
+   * which is all the flow control there is to it */
+  while(written < total)
+    {
+      gsize length = MIN(sizeof(chunk), total - written);
+
+      gksu_dbus_gksu2_call_write_input_sync(server2, cookie,
+                                            g_variant_new_from_data(G_VARIANT_TYPE_BYTESTRING,
+                                                                    chunk, length, TRUE,
+                                                                    NULL, NULL),
+                                            NULL, &error);
+      if(error)
+        {
+          g_warning("Unable to write input: %s", error->message);
+          g_error_free(error);
+          break;
+        }
+      written += length;
+    }
+
+  gksu_dbus_gksu_call_close_fd_sync(server, cookie, 0, NULL, NULL);
+  bench_relay_finish(server, server2, cookie, relay);
+
+  result->bytes = written;
+  result->seconds = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+}
+
+static void bench_relay(BenchThroughput *stdout_result, BenchThroughput *stdin_result)
+{
+  GDBusConnection *connection;
+  GksuDBusGksu *server;
+  GksuDBusGksu2 *server2;
+  BenchRelay relay;
+  GError *error = NULL;
+  guint subscription;
+
+  connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  if(error)
+    {
+      g_warning("%s", error->message);
+      exit(1);
+    }
+
+  server = gksu_dbus_gksu_proxy_new_sync(connection,
+                                         G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES|
+                                         G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                         "org.gnome.Gksu", "/org/gnome/Gksu",
+                                         NULL, &error);
+  if(error == NULL)
+    server2 = gksu_dbus_gksu2_proxy_new_sync(connection,
+                                             G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES|
+                                             G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                             "org.gnome.Gksu", "/org/gnome/Gksu",
+                                             NULL, &error);
+  if(error)
+    {
+      g_warning("%s", error->message);
+      exit(1);
+    }
+
+  g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(server), G_MAXINT);
+  g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(server2), G_MAXINT);
+
+  subscription =
+    g_dbus_connection_signal_subscribe(connection, "org.gnome.Gksu", "org.gnome.Gksu",
+                                       NULL, "/org/gnome/Gksu", NULL,
+                                       G_DBUS_SIGNAL_FLAGS_NONE,
+                                       (GDBusSignalCallback)bench_relay_signal_cb,
+                                       &relay, NULL);
+
+  memset(&relay, 0, sizeof(relay));
+  bench_stdout_relay(server, server2, &relay, stdout_result);
+
+  memset(&relay, 0, sizeof(relay));
+  bench_stdin_relay(server, server2, &relay, stdin_result);
+
+  g_dbus_connection_signal_unsubscribe(connection, subscription);
+  g_object_unref(server2);
+  g_object_unref(server);
+  g_object_unref(connection);
+}
+
+/* clients spawning at the same time */
+
+/*
+ * Each client is a process of its own, with its own bus connection;
+ * they are forked before anything talks to X or D-Bus, and wait on
+ * @go until all of them have been started.
+ */
+static void bench_client_main(gint go, gint results, gint *argc, gchar ***argv)
+{
+  const gchar *arguments[] = { "/bin/true", NULL };
+  guint spawns = 0;
+  guint failures = 0;
+  gchar byte;
+  gchar *line;
+  gint i;
+
+  if(read(go, &byte, 1) != 1)
+    _exit(1);
+
+  gtk_init(argc, argv);
+
+  for(i = 0; i < spawns_per_client; i++)
+    {
+      if(bench_run_process(arguments, NULL, NULL))
+        spawns++;
+      else
+        failures++;
+    }
+
+  line = g_strdup_printf("%u %u\n", spawns, failures);
+  if(write(results, line, strlen(line)) < 0)
+    _exit(1);
+  g_free(line);
+
+  _exit(0);
+}
+
+static GPid* bench_fork_clients(gint *go, gint *results, gint *argc, gchar ***argv)
+{
+  GPid *pids = g_new0(GPid, clients);
+  gint go_pipe[2];
+  gint results_pipe[2];
+  gint i;
+
+  if(pipe(go_pipe) || pipe(results_pipe))
+    {
+      g_warning("Unable to start the clients: %s", g_strerror(errno));
+      exit(1);
+    }
+
+  for(i = 0; i < clients; i++)
+    {
+      pids[i] = fork();
+      if(pids[i] == -1)
+        {
+          g_warning("Unable to start the clients: %s", g_strerror(errno));
+          exit(1);
+        }
+
+      if(pids[i] == 0)
+        {
+          close(go_pipe[1]);
+          close(results_pipe[0]);
+          bench_client_main(go_pipe[0], results_pipe[1], argc, argv);
+        }
+    }
+
+  close(go_pipe[0]);
+  close(results_pipe[1]);
+
+  *go = go_pipe[1];
+  *results = results_pipe[0];
+
+  return pids;
+}
+
+static void bench_spawn_rate(GPid *pids, gint go, gint results, BenchRate *rate)
+{
+  FILE *stream;
+  guint spawns;
+  guint failures;
+  gint64 start;
+  gint i;
+
+  memset(rate, 0, sizeof(BenchRate));
+
+  start = g_get_monotonic_time();
+  for(i = 0; i < clients; i++)
+    if(write(go, "x", 1) != 1)
+      break;
+  close(go);
+
+  stream = fdopen(results, "r");
+  while(fscanf(stream, "%u %u", &spawns, &failures) == 2)
+    {
+      rate->spawns += spawns;
+      rate->failures += failures;
+    }
+  fclose(stream);
+
+  rate->seconds = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+  for(i = 0; i < clients; i++)
+    waitpid(pids[i], NULL, 0);
+}
+
+/* results */
+
+static void bench_write_stats(FILE *file, const gchar *name, BenchStats *stats)
+{
+  fprintf(file,
+          "  \"%s\": {\"samples\": %u, \"mean\": %.3f, \"p50\": %.3f, "
+          "\"p99\": %.3f, \"max\": %.3f},\n",
+          name, stats->n_samples, stats->mean, stats->p50, stats->p99, stats->max);
+}
+
+static void bench_write_throughput(FILE *file, const gchar *name, BenchThroughput *result)
+{
+  fprintf(file,
+          "  \"%s\": {\"bytes\": %" G_GUINT64_FORMAT ", \"seconds\": %.3f, "
+          "\"mib_per_second\": %.2f},\n",
+          name, result->bytes, result->seconds,
+          result->seconds > 0 ? result->bytes / (1024.0 * 1024.0) / result->seconds : 0);
+}
+
+int main(int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  BenchStats latency;
+  BenchStats first_byte;
+  BenchThroughput stdout_relay;
+  BenchThroughput stdin_relay;
+  BenchRate rate;
+  GPid *pids = NULL;
+  gint go = -1;
+  gint results = -1;
+  FILE *file = stdout;
+
+  context = g_option_context_new("- measure gksu-server");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+      g_warning("%s", error->message);
+      g_error_free(error);
+      return 1;
+    }
+  g_option_context_free(context);
+
+  if(clients > 0)
+    pids = bench_fork_clients(&go, &results, &argc, &argv);
+
+  gtk_init(&argc, &argv);
+
+  bench_spawn_latency(&latency, &first_byte);
+  bench_relay(&stdout_relay, &stdin_relay);
+
+  memset(&rate, 0, sizeof(rate));
+  if(clients > 0)
+    bench_spawn_rate(pids, go, results, &rate);
+
+  if(output_file)
+    {
+      file = fopen(output_file, "w");
+      if(file == NULL)
+        {
+          g_warning("Unable to write %s: %s", output_file, g_strerror(errno));
+          return 1;
+        }
+    }
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"iterations\": %d,\n", iterations);
+  bench_write_stats(file, "spawn_latency_ms", &latency);
+  bench_write_stats(file, "first_byte_ms", &first_byte);
+  bench_write_throughput(file, "stdout_relay", &stdout_relay);
+  bench_write_throughput(file, "stdin_relay", &stdin_relay);
+  fprintf(file,
+          "  \"concurrent_spawns\": {\"clients\": %d, \"spawns\": %u, \"failures\": %u, "
+          "\"seconds\": %.3f, \"spawns_per_second\": %.1f}\n",
+          clients, rate.spawns, rate.failures, rate.seconds,
+          rate.seconds > 0 ? rate.spawns / rate.seconds : 0);
+  fprintf(file, "}\n");
+
+  if(file != stdout)
+    fclose(file);
+
+  g_free(pids);
+
+  return 0;
+}
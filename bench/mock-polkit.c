@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of Gksu PolicyKit.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/*
+ * A stand-in for PolicyKit's authority, for the benchmarks: it owns
+ * org.freedesktop.PolicyKit1 on whatever bus it is started on, and
+ * says yes to every check right away, without a challenge, so that
+ * what is measured is gksu-server and not an authentication agent.
+ */
+
+static const gchar introspection_xml[] =
+  "<node>"
+  "  <interface name='org.freedesktop.PolicyKit1.Authority'>"
+  "    <method name='CheckAuthorization'>"
+  "      <arg type='(sa{sv})' name='subject' direction='in'/>"
+  "      <arg type='s' name='action_id' direction='in'/>"
+  "      <arg type='a{ss}' name='details' direction='in'/>"
+  "      <arg type='u' name='flags' direction='in'/>"
+  "      <arg type='s' name='cancellation_id' direction='in'/>"
+  "      <arg type='(bba{ss})' name='result' direction='out'/>"
+  "    </method>"
+  "    <method name='CancelCheckAuthorization'>"
+  "      <arg type='s' name='cancellation_id' direction='in'/>"
+  "    </method>"
+  "    <signal name='Changed'/>"
+  "    <property type='s' name='BackendName' access='read'/>"
+  "    <property type='s' name='BackendVersion' access='read'/>"
+  "    <property type='u' name='BackendFeatures' access='read'/>"
+  "  </interface>"
+  "</node>";
+
+static GDBusNodeInfo *introspection_data = NULL;
+
+static void mock_polkit_method_call(GDBusConnection *connection, const gchar *sender,
+                                    const gchar *object_path, const gchar *interface_name,
+                                    const gchar *method_name, GVariant *parameters,
+                                    GDBusMethodInvocation *invocation, gpointer user_data)
+{
+  if(!g_strcmp0(method_name, "CheckAuthorization"))
+    {
+      g_dbus_method_invocation_return_value(invocation,
+                                            g_variant_new("((bb@a{ss}))", TRUE, FALSE,
+                                                          g_variant_new_array(G_VARIANT_TYPE("{ss}"),
+                                                                              NULL, 0)));
+      return;
+    }
+
+  /* there is never anything to cancel */
+  g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static GVariant* mock_polkit_get_property(GDBusConnection *connection, const gchar *sender,
+                                          const gchar *object_path,
+                                          const gchar *interface_name,
+                                          const gchar *property_name,
+                                          GError **error, gpointer user_data)
+{
+  if(!g_strcmp0(property_name, "BackendName"))
+    return g_variant_new_string("mock");
+
+  if(!g_strcmp0(property_name, "BackendVersion"))
+    return g_variant_new_string(PACKAGE_VERSION);
+
+  return g_variant_new_uint32(0);
+}
+
+static const GDBusInterfaceVTable interface_vtable =
+{
+  mock_polkit_method_call,
+  mock_polkit_get_property,
+  NULL
+};
+
+static void mock_polkit_bus_acquired_cb(GDBusConnection *connection, const gchar *name,
+                                        gpointer user_data)
+{
+  GError *error = NULL;
+
+  g_dbus_connection_register_object(connection, "/org/freedesktop/PolicyKit1/Authority",
+                                    introspection_data->interfaces[0],
+                                    &interface_vtable, NULL, NULL, &error);
+  if(error)
+    {
+      g_warning("%s", error->message);
+      exit(1);
+    }
+}
+
+static void mock_polkit_name_lost_cb(GDBusConnection *connection, const gchar *name,
+                                     gpointer user_data)
+{
+  g_warning("Unable to own %s.", name);
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  GMainLoop *loop;
+
+  g_type_init();
+
+  introspection_data = g_dbus_node_info_new_for_xml(introspection_xml, NULL);
+
+  /* the bus is a private one, whose address is given as the system
+   * bus', so that gksu-server finds us where it looks for PolicyKit */
+  g_bus_own_name(G_BUS_TYPE_SYSTEM, "org.freedesktop.PolicyKit1",
+                 G_BUS_NAME_OWNER_FLAGS_NONE,
+                 mock_polkit_bus_acquired_cb, NULL, mock_polkit_name_lost_cb,
+                 NULL, NULL);
+
+  loop = g_main_loop_new(NULL, FALSE);
+  g_main_loop_run(loop);
+
+  return 0;
+}
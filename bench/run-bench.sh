@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# Runs gksu-bench against a gksu-server of its own: a private
+# dbus-daemon stands in for the system bus, and mock-polkit for
+# PolicyKit, approving everything; the server is started by the bus
+# when the driver first calls it, as it would be on a real system.
+#
+# Usage: run-bench.sh SERVER MOCK_POLKIT DRIVER [DRIVER ARGUMENTS...]
+#
+# $BENCH_SERVER_ARGS is passed on to the server, e.g.
+# --prefork-launcher. An X display is needed by libgksu; Xvfb is
+# started when there is none.
+
+set -e
+
+if [ $# -lt 3 ]; then
+    echo "Usage: $0 SERVER MOCK_POLKIT DRIVER [DRIVER ARGUMENTS...]" >&2
+    exit 1
+fi
+
+absolute() {
+    case "$1" in
+        /*) echo "$1" ;;
+        *) echo "$(pwd)/$1" ;;
+    esac
+}
+
+server=$(absolute "$1")
+mock_polkit=$(absolute "$2")
+driver=$(absolute "$3")
+shift 3
+
+tmpdir=$(mktemp -d "${TMPDIR:-/tmp}/gksu-bench-XXXXXX")
+bus_pid=
+xvfb_pid=
+
+cleanup() {
+    [ -n "$xvfb_pid" ] && kill "$xvfb_pid" 2>/dev/null
+    [ -n "$bus_pid" ] && kill "$bus_pid" 2>/dev/null
+    rm -rf "$tmpdir"
+}
+trap cleanup EXIT INT TERM
+
+mkdir "$tmpdir/services"
+
+cat > "$tmpdir/services/org.gnome.Gksu.service" <<SERVICE
+[D-BUS Service]
+Name=org.gnome.Gksu
+Exec=$server $BENCH_SERVER_ARGS
+SERVICE
+
+cat > "$tmpdir/services/org.freedesktop.PolicyKit1.service" <<SERVICE
+[D-BUS Service]
+Name=org.freedesktop.PolicyKit1
+Exec=$mock_polkit
+SERVICE
+
+# a session-type bus, so the services run as ourselves
+cat > "$tmpdir/bus.conf" <<CONF
+<!DOCTYPE busconfig PUBLIC "-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN"
+ "http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd">
+<busconfig>
+  <type>session</type>
+  <listen>unix:path=$tmpdir/bus</listen>
+  <servicedir>$tmpdir/services</servicedir>
+  <policy context="default">
+    <allow send_destination="*" eavesdrop="true"/>
+    <allow eavesdrop="true"/>
+    <allow own="*"/>
+  </policy>
+</busconfig>
+CONF
+
+# the services inherit it from the bus
+DBUS_SYSTEM_BUS_ADDRESS="unix:path=$tmpdir/bus"
+export DBUS_SYSTEM_BUS_ADDRESS
+
+dbus-daemon --config-file="$tmpdir/bus.conf" --nofork &
+bus_pid=$!
+while [ ! -S "$tmpdir/bus" ]; do
+    sleep 0.1
+done
+
+if [ -z "$DISPLAY" ]; then
+    display=:99
+    while [ -e "/tmp/.X11-unix/X${display#:}" ]; do
+        display=":$((${display#:} + 1))"
+    done
+    Xvfb "$display" -nolisten tcp > /dev/null 2>&1 &
+    xvfb_pid=$!
+    while [ ! -e "/tmp/.X11-unix/X${display#:}" ]; do
+        sleep 0.1
+    done
+    DISPLAY=$display
+    export DISPLAY
+fi
+
+"$driver" "$@"
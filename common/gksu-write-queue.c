@@ -21,7 +21,9 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <glib-object.h>
@@ -30,15 +32,113 @@
 
 G_DEFINE_TYPE(GksuWriteQueue, gksu_write_queue, G_TYPE_OBJECT);
 
+/*
+ * Data is kept in a list of large chunks, and new data is appended to
+ * the spare room of the last one, so adding is O(1) and small writes
+ * get coalesced; when the fd is ready we hand as many chunks as we
+ * can to a single writev().
+ */
+#define CHUNK_SIZE 65536
+
+#ifdef IOV_MAX
+#define MAX_IOV MIN(IOV_MAX, 64)
+#else
+#define MAX_IOV 16
+#endif
+
+typedef struct {
+  gsize size;
+  gsize start;
+  gsize end;
+  gchar *data;
+} GksuWriteQueueChunk;
+
 struct _GksuWriteQueuePrivate {
   GIOChannel *channel;
+  gint fd;
   guint source_id;
-  GSList *queue;
-  gsize queue_len;
+  guint hangup_source_id;
+  GQueue *chunks;
+
+  /* one drained chunk is kept around to spare us the allocation */
+  GksuWriteQueueChunk *spare;
+
+  /* bytes waiting to be written */
+  gsize length;
+
+  /* once the queue grows past the high watermark it is considered
+   * full until it drains back to the low one, so that producers can
+   * stop feeding it for a while; a high watermark of 0 means no
+   * limit */
+  gsize low_watermark;
+  gsize high_watermark;
+  gboolean full;
+
+  /* gksu_write_queue_close() was called while data was still queued */
+  gboolean close_when_empty;
 };
 
+enum {
+  FULL,
+  DRAINED,
+
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = {0,};
+
 #define GKSU_WRITE_QUEUE_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_WRITE_QUEUE, GksuWriteQueuePrivate))
 
+static void gksu_write_queue_chunk_free(GksuWriteQueueChunk *chunk)
+{
+  g_free(chunk->data);
+  g_slice_free(GksuWriteQueueChunk, chunk);
+}
+
+static GksuWriteQueueChunk* gksu_write_queue_chunk_new(GksuWriteQueue *self, gsize size)
+{
+  GksuWriteQueuePrivate *priv = self->priv;
+  GksuWriteQueueChunk *chunk;
+
+  if(priv->spare && (priv->spare->size >= size))
+    {
+      chunk = priv->spare;
+      priv->spare = NULL;
+    }
+  else
+    {
+      chunk = g_slice_new(GksuWriteQueueChunk);
+      chunk->size = MAX(size, CHUNK_SIZE);
+      chunk->data = g_malloc(chunk->size);
+    }
+
+  chunk->start = 0;
+  chunk->end = 0;
+
+  return chunk;
+}
+
+static void gksu_write_queue_check_low_watermark(GksuWriteQueue *self)
+{
+  GksuWriteQueuePrivate *priv = self->priv;
+
+  if(priv->full && (priv->length <= priv->low_watermark))
+    {
+      priv->full = FALSE;
+      g_signal_emit(self, signals[DRAINED], 0);
+    }
+}
+
+static void gksu_write_queue_clear(GksuWriteQueue *self)
+{
+  GksuWriteQueuePrivate *priv = self->priv;
+  GksuWriteQueueChunk *chunk;
+
+  while((chunk = g_queue_pop_head(priv->chunks)) != NULL)
+    gksu_write_queue_chunk_free(chunk);
+  priv->length = 0;
+}
+
 static void gksu_write_queue_finalize(GObject *object)
 {
   GksuWriteQueue *self = GKSU_WRITE_QUEUE(object);
@@ -46,11 +146,18 @@ static void gksu_write_queue_finalize(GObject *object)
 
   if(priv->channel)
     {
-      g_source_remove(priv->source_id);
+      if(priv->source_id)
+        g_source_remove(priv->source_id);
+      if(priv->hangup_source_id)
+        g_source_remove(priv->hangup_source_id);
       g_io_channel_unref(priv->channel);
     }
 
-  g_slist_free(priv->queue);
+  gksu_write_queue_clear(self);
+  g_queue_free(priv->chunks);
+
+  if(priv->spare)
+    gksu_write_queue_chunk_free(priv->spare);
 
   G_OBJECT_CLASS(gksu_write_queue_parent_class)->finalize(object);
 }
@@ -59,6 +166,24 @@ static void gksu_write_queue_class_init(GksuWriteQueueClass *klass)
 {
   G_OBJECT_CLASS(klass)->finalize = gksu_write_queue_finalize;
 
+  signals[FULL] = g_signal_new("full",
+                               GKSU_TYPE_WRITE_QUEUE,
+                               G_SIGNAL_RUN_LAST,
+                               0,
+                               NULL,
+                               NULL,
+                               g_cclosure_marshal_VOID__VOID,
+                               G_TYPE_NONE, 0);
+
+  signals[DRAINED] = g_signal_new("drained",
+                                  GKSU_TYPE_WRITE_QUEUE,
+                                  G_SIGNAL_RUN_LAST,
+                                  0,
+                                  NULL,
+                                  NULL,
+                                  g_cclosure_marshal_VOID__VOID,
+                                  G_TYPE_NONE, 0);
+
   g_type_class_add_private(klass, sizeof(GksuWriteQueuePrivate));
 }
 
@@ -66,6 +191,8 @@ static void gksu_write_queue_init(GksuWriteQueue *self)
 {
   GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
   self->priv = priv;
+
+  priv->chunks = g_queue_new();
 }
 
 gboolean
@@ -73,77 +200,165 @@ gksu_write_queue_disable(GIOChannel *channel, GIOCondition condition,
                          GksuWriteQueue *self)
 {
   GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
-  g_source_remove(priv->source_id);
+
+  /* nobody is going to read what we have */
+  if(priv->source_id)
+    {
+      g_source_remove(priv->source_id);
+      priv->source_id = 0;
+    }
+  gksu_write_queue_clear(self);
+  gksu_write_queue_check_low_watermark(self);
+
+  priv->hangup_source_id = 0;
   return FALSE;
 }
 
+/*
+ * Drops @written bytes from the head of the queue.
+ */
+static void gksu_write_queue_consume(GksuWriteQueue *self, gsize written)
+{
+  GksuWriteQueuePrivate *priv = self->priv;
+
+  priv->length -= written;
+
+  while(written > 0)
+    {
+      GksuWriteQueueChunk *chunk = g_queue_peek_head(priv->chunks);
+      gsize available = chunk->end - chunk->start;
+
+      if(written < available)
+        {
+          chunk->start += written;
+          return;
+        }
+
+      written -= available;
+      g_queue_pop_head(priv->chunks);
+
+      if(priv->spare == NULL)
+        priv->spare = chunk;
+      else
+        gksu_write_queue_chunk_free(chunk);
+    }
+}
+
 gboolean
 gksu_write_queue_perform(GIOChannel *channel, GIOCondition condition,
                          GksuWriteQueue *self)
 {
   GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
-  GIOStatus status = G_IO_STATUS_NORMAL;
-  GError *error = NULL;
-  GSList *iter = priv->queue;
-
-  if(priv->queue_len == 0)
-    {
-      g_source_remove(priv->source_id);
-      return FALSE;
-    }
 
-  while((iter != NULL) && (status != G_IO_STATUS_AGAIN))
+  while(priv->length > 0)
     {
-      GString *curstring = iter->data;
-      gsize written;
+      struct iovec iov[MAX_IOV];
+      GList *iter = priv->chunks->head;
+      gssize written;
+      gint count;
 
-      status = g_io_channel_write_chars(channel, curstring->str,
-                                        curstring->len, &written, &error);
-      if(error)
+      for(count = 0; (iter != NULL) && (count < MAX_IOV); iter = iter->next, count++)
         {
-          fprintf(stderr, "%s\n", error->message);
-          g_clear_error(&error);
+          GksuWriteQueueChunk *chunk = iter->data;
+          iov[count].iov_base = chunk->data + chunk->start;
+          iov[count].iov_len = chunk->end - chunk->start;
         }
 
-      if(error)
+      written = writev(priv->fd, iov, count);
+      if(written < 0)
         {
-          fprintf(stderr, "%s\n", error->message);
-          g_clear_error(&error);
-        }
+          if(errno == EINTR)
+            continue;
 
-      if((status == G_IO_STATUS_AGAIN) && (written < curstring->len))
-        {
-          g_string_erase(curstring, 0, written);
+          /* the reader needs to make some room; we'll be back */
+          if(errno == EAGAIN)
+            return TRUE;
+
+          fprintf(stderr, "%s\n", g_strerror(errno));
+          gksu_write_queue_clear(self);
+          gksu_write_queue_check_low_watermark(self);
           break;
         }
 
-      g_string_free(curstring, TRUE);
-      priv->queue = g_slist_delete_link(priv->queue, iter);
-      iter = priv->queue;
-      priv->queue_len--;
+      gksu_write_queue_consume(self, written);
 
-      /* we should never go bellow 0! */
-      g_assert(priv->queue_len >= 0);
+      /* handlers may add more data; the loop takes care of it */
+      gksu_write_queue_check_low_watermark(self);
     }
 
-  return TRUE;
+  priv->source_id = 0;
+
+  if(priv->close_when_empty)
+    gksu_write_queue_shutdown(self, FALSE);
+
+  return FALSE;
 }
 
 void
-gksu_write_queue_add(GksuWriteQueue *self, gchar *data, gsize length)
+gksu_write_queue_add(GksuWriteQueue *self, const gchar *data, gsize length)
 {
   GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
-  GString *string = g_string_new_len(data, length);
+  GksuWriteQueueChunk *chunk = g_queue_peek_tail(priv->chunks);
+  gsize room;
+
+  if(length == 0)
+    return;
 
-  if(priv->queue_len == 0)
+  if(priv->source_id == 0)
     {
       priv->source_id = g_io_add_watch(priv->channel, G_IO_OUT,
                                        (GIOFunc)gksu_write_queue_perform,
                                        (gpointer)self);
     }
 
-  priv->queue = g_slist_append(priv->queue, string);
-  priv->queue_len++;
+  priv->length += length;
+
+  /* fill whatever room the last chunk has left... */
+  if(chunk != NULL)
+    {
+      room = MIN(chunk->size - chunk->end, length);
+      memcpy(chunk->data + chunk->end, data, room);
+      chunk->end += room;
+      data += room;
+      length -= room;
+    }
+
+  /* ...and put the rest in a new one */
+  if(length > 0)
+    {
+      chunk = gksu_write_queue_chunk_new(self, length);
+      memcpy(chunk->data, data, length);
+      chunk->end = length;
+      g_queue_push_tail(priv->chunks, chunk);
+    }
+
+  if(!priv->full && priv->high_watermark &&
+     (priv->length >= priv->high_watermark))
+    {
+      priv->full = TRUE;
+      g_signal_emit(self, signals[FULL], 0);
+    }
+}
+
+/*
+ * Once more than @high bytes are waiting, the queue emits ::full, and
+ * once it goes back down to @low bytes, ::drained; producers are
+ * expected to hold new data in between. A @high of 0 disables this.
+ */
+void
+gksu_write_queue_set_watermarks(GksuWriteQueue *self, gsize low, gsize high)
+{
+  GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
+
+  priv->low_watermark = MIN(low, high);
+  priv->high_watermark = high;
+}
+
+gboolean
+gksu_write_queue_is_full(GksuWriteQueue *self)
+{
+  GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
+  return priv->full;
 }
 
 void
@@ -151,11 +366,41 @@ gksu_write_queue_shutdown(GksuWriteQueue *self, gboolean flush)
 {
   GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
 
-  while(priv->queue_len > 0)
-    gksu_write_queue_perform(priv->channel, G_IO_OUT, self);
+  if(flush && (priv->length > 0))
+    {
+      gint flags = fcntl(priv->fd, F_GETFL);
+
+      /* block until everything is written, instead of spinning */
+      fcntl(priv->fd, F_SETFL, flags & ~O_NONBLOCK);
+      gksu_write_queue_perform(priv->channel, G_IO_OUT, self);
+      fcntl(priv->fd, F_SETFL, flags);
+    }
+
+  if(priv->source_id)
+    {
+      g_source_remove(priv->source_id);
+      priv->source_id = 0;
+    }
+  gksu_write_queue_clear(self);
+
   g_io_channel_shutdown(priv->channel, TRUE, NULL);
 }
 
+/*
+ * Shuts the channel down as soon as everything that was queued has
+ * been written, without blocking.
+ */
+void
+gksu_write_queue_close(GksuWriteQueue *self)
+{
+  GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
+
+  if(priv->length == 0)
+    gksu_write_queue_shutdown(self, FALSE);
+  else
+    priv->close_when_empty = TRUE;
+}
+
 GksuWriteQueue*
 gksu_write_queue_new(GIOChannel *channel)
 {
@@ -163,10 +408,11 @@ gksu_write_queue_new(GIOChannel *channel)
   GksuWriteQueuePrivate *priv = GKSU_WRITE_QUEUE_GET_PRIVATE(self);
 
   priv->channel = g_io_channel_ref(channel);
-  g_io_add_watch(channel, G_IO_HUP|G_IO_NVAL,
-                 (GIOFunc)gksu_write_queue_disable,
-                 (gpointer)self);
+  priv->fd = g_io_channel_unix_get_fd(channel);
+  priv->hangup_source_id =
+    g_io_add_watch(channel, G_IO_HUP|G_IO_NVAL,
+                   (GIOFunc)gksu_write_queue_disable,
+                   (gpointer)self);
 
   return self;
 }
-
@@ -39,8 +39,11 @@ GType gksu_write_queue_get_type(void);
 #define GKSU_WRITE_QUEUE(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GKSU_TYPE_WRITE_QUEUE, GksuWriteQueue))
 #define GKSU_WRITE_QUEUE_GET_CLASS(object)  (G_TYPE_INSTANCE_GET_CLASS ((object), GKSU_TYPE_WRITE_QUEUE, GksuWriteQueueClass))
 
-void gksu_write_queue_add(GksuWriteQueue *self, gchar *data, gsize length);
+void gksu_write_queue_add(GksuWriteQueue *self, const gchar *data, gsize length);
+void gksu_write_queue_set_watermarks(GksuWriteQueue *self, gsize low, gsize high);
+gboolean gksu_write_queue_is_full(GksuWriteQueue *self);
 void gksu_write_queue_shutdown(GksuWriteQueue *self, gboolean flush);
+void gksu_write_queue_close(GksuWriteQueue *self);
 GksuWriteQueue* gksu_write_queue_new(GIOChannel *channel);
 
 #endif
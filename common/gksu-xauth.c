@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit library.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include <glib.h>
+#include <gio/gio.h>
+
+#include "gksu-xauth.h"
+
+/*
+ * Reads and writes X authority files, in the format libXau uses: a
+ * list of records, each a 16 bit family followed by the address, the
+ * display number, the protocol name and the cookie itself, all four
+ * as a 16 bit length and that many bytes, everything big endian.
+ */
+
+/* from X11/Xauth.h and X11/X.h */
+#define GKSU_XAUTH_FAMILY_INTERNET 0
+#define GKSU_XAUTH_FAMILY_INTERNET6 6
+#define GKSU_XAUTH_FAMILY_LOCAL 256
+#define GKSU_XAUTH_FAMILY_WILD 65535
+
+typedef struct {
+  guint16 family;
+  const guint8 *address;
+  gsize address_length;
+  const guint8 *number;
+  gsize number_length;
+  const guint8 *name;
+  gsize name_length;
+  const guint8 *data;
+  gsize data_length;
+} GksuXauthEntry;
+
+static void gksu_xauth_append_short(GByteArray *buffer, guint16 value)
+{
+  guint8 bytes[2];
+
+  bytes[0] = value >> 8;
+  bytes[1] = value & 0xff;
+  g_byte_array_append(buffer, bytes, 2);
+}
+
+static void gksu_xauth_append_field(GByteArray *buffer, const guint8 *data, gsize length)
+{
+  gksu_xauth_append_short(buffer, length);
+  g_byte_array_append(buffer, data, length);
+}
+
+/*
+ * Splits a DISPLAY such as "host:0.1" in its host and display number;
+ * the screen number is not part of what X authorizes.
+ */
+static gboolean gksu_xauth_parse_display(const gchar *display, gchar **host,
+                                         gchar **number)
+{
+  const gchar *colon = strrchr(display, ':');
+  const gchar *end;
+
+  if((colon == NULL) || !g_ascii_isdigit(colon[1]))
+    return FALSE;
+
+  for(end = colon + 1; g_ascii_isdigit(*end); end++)
+    ;
+
+  *host = g_strndup(display, colon - display);
+  *number = g_strndup(colon + 1, end - (colon + 1));
+
+  return TRUE;
+}
+
+/*
+ * Displays reached through a local socket are authorized by the
+ * machine's host name; a path is what launchd puts in DISPLAY.
+ */
+static gboolean gksu_xauth_is_local_host(const gchar *host)
+{
+  return (host[0] == '\0') || !strcmp(host, "unix") || (host[0] == '/');
+}
+
+static gboolean gksu_xauth_read_short(const guint8 **cursor, const guint8 *end,
+                                      guint16 *value)
+{
+  if(end - *cursor < 2)
+    return FALSE;
+
+  *value = ((*cursor)[0] << 8) | (*cursor)[1];
+  *cursor += 2;
+
+  return TRUE;
+}
+
+static gboolean gksu_xauth_read_field(const guint8 **cursor, const guint8 *end,
+                                      const guint8 **data, gsize *length)
+{
+  guint16 field_length;
+
+  if(!gksu_xauth_read_short(cursor, end, &field_length) ||
+     (end - *cursor < field_length))
+    return FALSE;
+
+  *data = *cursor;
+  *length = field_length;
+  *cursor += field_length;
+
+  return TRUE;
+}
+
+static gboolean gksu_xauth_read_entry(const guint8 **cursor, const guint8 *end,
+                                      GksuXauthEntry *entry)
+{
+  return gksu_xauth_read_short(cursor, end, &entry->family) &&
+    gksu_xauth_read_field(cursor, end, &entry->address, &entry->address_length) &&
+    gksu_xauth_read_field(cursor, end, &entry->number, &entry->number_length) &&
+    gksu_xauth_read_field(cursor, end, &entry->name, &entry->name_length) &&
+    gksu_xauth_read_field(cursor, end, &entry->data, &entry->data_length);
+}
+
+static gboolean gksu_xauth_field_equals(const guint8 *field, gsize length,
+                                        const gchar *string)
+{
+  return (length == strlen(string)) && !memcmp(field, string, length);
+}
+
+/*
+ * The addresses an entry may have for @host, as xauth works them out:
+ * local displays are known by the machine's name, others by their
+ * IPv4 and IPv6 addresses.
+ */
+static GPtrArray* gksu_xauth_host_addresses(const gchar *host, gboolean *local)
+{
+  GPtrArray *addresses = g_ptr_array_new_with_free_func((GDestroyNotify)g_byte_array_unref);
+  struct addrinfo hints;
+  struct addrinfo *result;
+  struct addrinfo *iter;
+
+  *local = gksu_xauth_is_local_host(host) || !strcmp(host, g_get_host_name());
+  if(*local)
+    return addresses;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if(getaddrinfo(host, NULL, &hints, &result))
+    return addresses;
+
+  for(iter = result; iter != NULL; iter = iter->ai_next)
+    {
+      GByteArray *address = g_byte_array_new();
+      guint8 family[2];
+
+      if(iter->ai_family == AF_INET)
+        {
+          struct sockaddr_in *in = (struct sockaddr_in*)iter->ai_addr;
+
+          family[0] = GKSU_XAUTH_FAMILY_INTERNET >> 8;
+          family[1] = GKSU_XAUTH_FAMILY_INTERNET & 0xff;
+          g_byte_array_append(address, family, 2);
+          g_byte_array_append(address, (const guint8*)&in->sin_addr, 4);
+        }
+      else if(iter->ai_family == AF_INET6)
+        {
+          struct sockaddr_in6 *in6 = (struct sockaddr_in6*)iter->ai_addr;
+
+          family[0] = GKSU_XAUTH_FAMILY_INTERNET6 >> 8;
+          family[1] = GKSU_XAUTH_FAMILY_INTERNET6 & 0xff;
+          g_byte_array_append(address, family, 2);
+          g_byte_array_append(address, (const guint8*)&in6->sin6_addr, 16);
+        }
+      else
+        {
+          g_byte_array_unref(address);
+          continue;
+        }
+
+      g_ptr_array_add(addresses, address);
+    }
+  freeaddrinfo(result);
+
+  return addresses;
+}
+
+static gboolean gksu_xauth_entry_matches(GksuXauthEntry *entry, const gchar *number,
+                                         gboolean local, GPtrArray *addresses)
+{
+  guint i;
+
+  if(!gksu_xauth_field_equals(entry->number, entry->number_length, number) ||
+     !gksu_xauth_field_equals(entry->name, entry->name_length, GKSU_XAUTH_PROTOCOL))
+    return FALSE;
+
+  if(entry->family == GKSU_XAUTH_FAMILY_WILD)
+    return TRUE;
+
+  if(local)
+    return (entry->family == GKSU_XAUTH_FAMILY_LOCAL) &&
+      gksu_xauth_field_equals(entry->address, entry->address_length, g_get_host_name());
+
+  /* each address is kept with its family in front */
+  for(i = 0; i < addresses->len; i++)
+    {
+      GByteArray *address = g_ptr_array_index(addresses, i);
+
+      if((entry->family == ((address->data[0] << 8) | address->data[1])) &&
+         (entry->address_length == address->len - 2) &&
+         !memcmp(entry->address, address->data + 2, entry->address_length))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gchar* gksu_xauth_lookup_display(const guint8 *contents, gsize length,
+                                        const gchar *display)
+{
+  const guint8 *cursor = contents;
+  const guint8 *end = contents + length;
+  GksuXauthEntry entry;
+  GPtrArray *addresses;
+  gboolean local;
+  gchar *host;
+  gchar *number;
+  gchar *cookie = NULL;
+
+  if(!gksu_xauth_parse_display(display, &host, &number))
+    return NULL;
+
+  addresses = gksu_xauth_host_addresses(host, &local);
+
+  while(gksu_xauth_read_entry(&cursor, end, &entry))
+    {
+      GString *hex;
+      gsize i;
+
+      if(!gksu_xauth_entry_matches(&entry, number, local, addresses))
+        continue;
+
+      hex = g_string_sized_new(entry.data_length * 2);
+      for(i = 0; i < entry.data_length; i++)
+        g_string_append_printf(hex, "%02x", entry.data[i]);
+      cookie = g_string_free(hex, FALSE);
+      break;
+    }
+
+  g_ptr_array_free(addresses, TRUE);
+  g_free(host);
+  g_free(number);
+
+  return cookie;
+}
+
+/**
+ * gksu_xauth_lookup_cookie:
+ * @filename: the authority file to look in
+ * @display: the display to find the cookie for
+ *
+ * Finds the MIT-MAGIC-COOKIE-1 cookie for @display in @filename, as
+ * `xauth list @display` would. If there is none, the host part of the
+ * display is dropped and the local display of the same number is
+ * tried; that is where ssh puts the cookies for forwarded displays.
+ *
+ * Returns: the cookie in hexadecimal, or %NULL if none was found;
+ * free it with g_free()
+ */
+gchar* gksu_xauth_lookup_cookie(const gchar *filename, const gchar *display)
+{
+  gchar *contents;
+  gsize length;
+  gchar *cookie;
+  const gchar *colon;
+
+  if(!g_file_get_contents(filename, &contents, &length, NULL))
+    return NULL;
+
+  cookie = gksu_xauth_lookup_display((const guint8*)contents, length, display);
+
+  colon = strrchr(display, ':');
+  if((cookie == NULL) && (colon != NULL) && (colon != display))
+    cookie = gksu_xauth_lookup_display((const guint8*)contents, length, colon);
+
+  g_free(contents);
+
+  return cookie;
+}
+
+static GByteArray* gksu_xauth_parse_cookie(const gchar *cookie)
+{
+  GByteArray *data = g_byte_array_new();
+  gchar *hex = g_strstrip(g_strdup(cookie));
+  gsize length = strlen(hex);
+  gsize i;
+
+  if(length % 2)
+    goto invalid;
+
+  for(i = 0; i < length; i += 2)
+    {
+      gint high = g_ascii_xdigit_value(hex[i]);
+      gint low = g_ascii_xdigit_value(hex[i + 1]);
+      guint8 byte;
+
+      if((high == -1) || (low == -1))
+        goto invalid;
+
+      byte = (high << 4) | low;
+      g_byte_array_append(data, &byte, 1);
+    }
+
+  g_free(hex);
+  return data;
+
+ invalid:
+  g_free(hex);
+  g_byte_array_free(data, TRUE);
+  return NULL;
+}
+
+/**
+ * gksu_xauth_write_cookie:
+ * @filename: the authority file to create or replace
+ * @display: the display the cookie is for, or %NULL
+ * @cookie: the MIT-MAGIC-COOKIE-1 cookie, in hexadecimal, as xauth
+ * lists it; may be empty
+ * @error: return location for a #GError, or %NULL
+ *
+ * Writes an X authority file with a single entry, doing what `xauth
+ * add @display . @cookie` would, in a single atomic write. Without a
+ * display, or without a cookie, the file is written with no entries.
+ *
+ * Only local displays are handled; for others the address would
+ * have to be resolved as xauth does, and %G_IO_ERROR_NOT_SUPPORTED is
+ * returned.
+ *
+ * Returns: %TRUE if the file was written
+ */
+gboolean gksu_xauth_write_cookie(const gchar *filename, const gchar *display,
+                                 const gchar *cookie, GError **error)
+{
+  GByteArray *buffer = g_byte_array_new();
+  GByteArray *data = NULL;
+  gchar *host = NULL;
+  gchar *number = NULL;
+  gboolean success = FALSE;
+
+  if(cookie)
+    {
+      data = gksu_xauth_parse_cookie(cookie);
+      if(data == NULL)
+        {
+          g_set_error_literal(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                              "Invalid X authorization cookie.");
+          goto out;
+        }
+    }
+
+  if(display && data && data->len)
+    {
+      const gchar *hostname = g_get_host_name();
+
+      if(!gksu_xauth_parse_display(display, &host, &number))
+        {
+          g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                      "Invalid display: %s", display);
+          goto out;
+        }
+
+      if(!gksu_xauth_is_local_host(host))
+        {
+          g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                      "Not a local display: %s", display);
+          goto out;
+        }
+
+      gksu_xauth_append_short(buffer, GKSU_XAUTH_FAMILY_LOCAL);
+      gksu_xauth_append_field(buffer, (const guint8*)hostname, strlen(hostname));
+      gksu_xauth_append_field(buffer, (const guint8*)number, strlen(number));
+      gksu_xauth_append_field(buffer, (const guint8*)GKSU_XAUTH_PROTOCOL,
+                              strlen(GKSU_XAUTH_PROTOCOL));
+      gksu_xauth_append_field(buffer, data->data, data->len);
+    }
+
+  /* written to a temporary file which is then renamed over @filename,
+   * so nobody ever sees half of it */
+  success = g_file_set_contents(filename, (const gchar*)buffer->data, buffer->len, error);
+  if(success)
+    chmod(filename, S_IRUSR|S_IWUSR);
+
+ out:
+  g_free(host);
+  g_free(number);
+  if(data)
+    g_byte_array_free(data, TRUE);
+  g_byte_array_free(buffer, TRUE);
+
+  return success;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit library.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * as published by the Free Software Foundation; either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GKSU_XAUTH_H__
+#define __GKSU_XAUTH_H__ 1
+
+#include <glib.h>
+
+/* the only kind of cookie gksu hands over */
+#define GKSU_XAUTH_PROTOCOL "MIT-MAGIC-COOKIE-1"
+
+gboolean gksu_xauth_write_cookie(const gchar *filename, const gchar *display,
+                                 const gchar *cookie, GError **error);
+
+gchar* gksu_xauth_lookup_cookie(const gchar *filename, const gchar *display);
+
+#endif
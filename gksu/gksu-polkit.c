@@ -24,7 +24,8 @@
 
 #include <gtk/gtk.h>
 #include <gksu-process.h>
-#include <gksu-write-queue.h>
+
+#include "gksu-relay.h"
 
 /* so that we can use it in our signal handlers */
 GksuProcess *process;
@@ -49,77 +50,6 @@ static void process_exited_cb(GksuProcess *self, gint status, GMainLoop *loop)
   retval = WEXITSTATUS(status);
 }
 
-static gboolean output_received (GIOChannel *channel,
-                                 GIOCondition condition,
-                                 gpointer dara)
-{
-  GError *error = NULL;
-  GString *retstring;
-  gchar buffer[1024];
-  gsize length = -1;
-
-  if((condition == G_IO_NVAL) || (condition == G_IO_HUP))
-    {
-      return FALSE;
-    }
-
-  retstring = g_string_new("");
-
-  while(length != 0)
-    {
-      GIOStatus status;
-      status = g_io_channel_read_chars(channel, buffer, 1024, &length, &error);
-      if(error)
-        {
-          g_warning("%s", error->message);
-          g_error_free(error);
-        }
-      g_string_append_len(retstring, buffer, length);
-    }
-
-  write(1, retstring->str, retstring->len);
-  g_string_free(retstring, TRUE);
-
-  return TRUE;
-}
-
-static gboolean input_received (GIOChannel *channel,
-                                GIOCondition condition,
-                                GksuWriteQueue *queue)
-{
-  GError *error = NULL;
-  GString *retstring;
-  GIOStatus status = G_IO_STATUS_AGAIN;
-  gchar buffer[1024];
-  gsize length = -1;
-
-  if((condition == G_IO_HUP) || (condition == G_IO_NVAL))
-    {
-      gksu_write_queue_shutdown(queue, TRUE);
-      return FALSE;
-    }
-
-  retstring = g_string_new("");
-
-  while(length != 0)
-    {
-      status = g_io_channel_read_chars(channel, buffer, 1024, &length, &error);
-      if(error)
-        {
-          g_warning("%s", error->message);
-          g_error_free(error);
-        }
-      g_string_append_len(retstring, buffer, length);
-    }
-
-  if (retstring->len > 0)
-    gksu_write_queue_add(queue, retstring->str, retstring->len);
-
-  g_string_free(retstring, TRUE);
-
-  return status != G_IO_STATUS_EOF;
-}
-
 static void kill_process_handler(int signum)
 {
   GError *error = NULL;
@@ -153,13 +83,11 @@ int main(int argc, char **argv)
   gint count;
   GError *error = NULL;
   gint stdin_fd;
-  GIOChannel *stdin_channel;
-  GIOChannel *process_stdin_channel;
-  GksuWriteQueue *stdin_write_queue;
   gint stdout_fd;
-  GIOChannel *stdout_channel;
   gint stderr_fd;
-  GIOChannel *stderr_channel;
+  GksuRelay *stdin_relay;
+  GksuRelay *stdout_relay;
+  GksuRelay *stderr_relay;
   gchar *cwd;
 
   retval = 0;
@@ -217,31 +145,17 @@ int main(int argc, char **argv)
       return 1;
     }
 
-  process_stdin_channel = g_io_channel_unix_new(stdin_fd);
-  g_io_channel_set_encoding(process_stdin_channel, NULL, NULL);
-  g_io_channel_set_buffered(process_stdin_channel, FALSE);
-  stdin_write_queue = gksu_write_queue_new(process_stdin_channel);
-
-  stdin_channel = g_io_channel_unix_new(0);
-  g_io_channel_set_encoding(stdin_channel, NULL, NULL);
-  g_io_channel_set_buffered(stdin_channel, FALSE);
-  g_io_add_watch(stdin_channel, G_IO_IN|G_IO_PRI|G_IO_HUP|G_IO_NVAL,
-                 (GIOFunc)input_received,
-                 stdin_write_queue);
-
-  stdout_channel = g_io_channel_unix_new(stdout_fd);
-  g_io_channel_set_encoding(stdout_channel, NULL, NULL);
-  g_io_add_watch(stdout_channel, G_IO_IN|G_IO_PRI|G_IO_HUP|G_IO_NVAL,
-                 (GIOFunc)output_received,
-                 NULL);
-
-  stderr_channel = g_io_channel_unix_new(stderr_fd);
-  g_io_channel_set_encoding(stderr_channel, NULL, NULL);
-  g_io_add_watch(stderr_channel, G_IO_IN|G_IO_PRI|G_IO_HUP|G_IO_NVAL,
-                 (GIOFunc)output_received,
-                 NULL);
+  /* the child's stdout and stderr are kept apart, so that shell
+   * redirections work as expected */
+  stdin_relay = gksu_relay_new(0, stdin_fd, TRUE);
+  stdout_relay = gksu_relay_new(stdout_fd, 1, FALSE);
+  stderr_relay = gksu_relay_new(stderr_fd, 2, FALSE);
 
   g_main_loop_run(loop);
 
+  gksu_relay_free(stdin_relay);
+  gksu_relay_free(stdout_relay);
+  gksu_relay_free(stderr_relay);
+
   return retval;
 }
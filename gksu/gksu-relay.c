@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of Gksu PolicyKit.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.  You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* for splice() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "gksu-relay.h"
+
+/*
+ * A relay moves everything that shows up on one fd to another, from
+ * the main loop. The pipes we get from libgksu are moved to our
+ * stdout and stderr with splice(), so that the data never has to be
+ * copied into our address space; when the other end does not support
+ * that (a terminal, say) we fall back to copying through a buffer of
+ * a fixed size, never reading more until what we have has been
+ * written.
+ */
+
+/* how much we ask for in a single splice() or read() */
+#define RELAY_CHUNK_SIZE 65536
+
+/* how much is moved before going back to the main loop */
+#define RELAY_MAX_PER_WAKEUP (16 * RELAY_CHUNK_SIZE)
+
+typedef enum {
+  RELAY_WAIT_INPUT,
+  RELAY_WAIT_OUTPUT,
+  RELAY_FINISHED
+} GksuRelayState;
+
+struct _GksuRelay {
+  gint in_fd;
+  gint out_fd;
+  gboolean close_out_on_eof;
+
+  /* reading from something that is not a pipe may block, so we only
+   * do it once per wakeup */
+  gboolean in_is_pipe;
+
+  gboolean use_splice;
+  gchar *buffer;
+  gsize buffer_start;
+  gsize buffer_end;
+
+  GIOChannel *in_channel;
+  guint in_source_id;
+  GIOChannel *out_channel;
+  guint out_source_id;
+};
+
+static gboolean gksu_relay_output_writable(gint fd)
+{
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+
+  return (poll(&pfd, 1, 0) == 1) && (pfd.revents & POLLOUT);
+}
+
+static GksuRelayState gksu_relay_copy(GksuRelay *relay)
+{
+  gsize moved = 0;
+  gboolean did_read = FALSE;
+  gssize count;
+
+  while(moved < RELAY_MAX_PER_WAKEUP)
+    {
+      if(relay->buffer_start == relay->buffer_end)
+        {
+          if(did_read && !relay->in_is_pipe)
+            return RELAY_WAIT_INPUT;
+
+          count = read(relay->in_fd, relay->buffer, RELAY_CHUNK_SIZE);
+          if(count == 0)
+            return RELAY_FINISHED;
+
+          if(count < 0)
+            {
+              if(errno == EINTR)
+                continue;
+              if(errno == EAGAIN)
+                return RELAY_WAIT_INPUT;
+
+              g_warning("%s", g_strerror(errno));
+              return RELAY_FINISHED;
+            }
+
+          relay->buffer_start = 0;
+          relay->buffer_end = count;
+          did_read = TRUE;
+        }
+
+      count = write(relay->out_fd, relay->buffer + relay->buffer_start,
+                    relay->buffer_end - relay->buffer_start);
+      if(count < 0)
+        {
+          if(errno == EINTR)
+            continue;
+          if(errno == EAGAIN)
+            return RELAY_WAIT_OUTPUT;
+
+          g_warning("%s", g_strerror(errno));
+          return RELAY_FINISHED;
+        }
+
+      relay->buffer_start += count;
+      moved += count;
+    }
+
+  return RELAY_WAIT_INPUT;
+}
+
+static GksuRelayState gksu_relay_splice(GksuRelay *relay)
+{
+#ifdef HAVE_SPLICE
+  gsize moved = 0;
+  gssize count;
+
+  while(moved < RELAY_MAX_PER_WAKEUP)
+    {
+      count = splice(relay->in_fd, NULL, relay->out_fd, NULL, RELAY_CHUNK_SIZE,
+                     SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+      if(count > 0)
+        {
+          moved += count;
+          if(!relay->in_is_pipe)
+            return RELAY_WAIT_INPUT;
+          continue;
+        }
+
+      if(count == 0)
+        return RELAY_FINISHED;
+
+      switch(errno)
+        {
+        case EINTR:
+          continue;
+        case EAGAIN:
+          /* either side may be the one that would block */
+          if(gksu_relay_output_writable(relay->out_fd))
+            return RELAY_WAIT_INPUT;
+          return RELAY_WAIT_OUTPUT;
+        case EINVAL:
+        case ENOSYS:
+          /* the other end does not do splice; this is not going to
+           * change, so copy from now on */
+          break;
+        default:
+          g_warning("%s", g_strerror(errno));
+          return RELAY_FINISHED;
+        }
+
+      break;
+    }
+
+  if(moved >= RELAY_MAX_PER_WAKEUP)
+    return RELAY_WAIT_INPUT;
+#endif
+
+  relay->use_splice = FALSE;
+  relay->buffer = g_malloc(RELAY_CHUNK_SIZE);
+
+  return gksu_relay_copy(relay);
+}
+
+static gboolean gksu_relay_input_cb(GIOChannel *channel, GIOCondition condition,
+                                    GksuRelay *relay);
+static gboolean gksu_relay_output_cb(GIOChannel *channel, GIOCondition condition,
+                                     GksuRelay *relay);
+
+static GksuRelayState gksu_relay_pump(GksuRelay *relay)
+{
+  GksuRelayState state;
+
+  if(relay->use_splice)
+    state = gksu_relay_splice(relay);
+  else
+    state = gksu_relay_copy(relay);
+
+  if((state == RELAY_FINISHED) && relay->close_out_on_eof)
+    close(relay->out_fd);
+
+  return state;
+}
+
+static gboolean gksu_relay_input_cb(GIOChannel *channel, GIOCondition condition,
+                                    GksuRelay *relay)
+{
+  switch(gksu_relay_pump(relay))
+    {
+    case RELAY_WAIT_INPUT:
+      return TRUE;
+    case RELAY_WAIT_OUTPUT:
+      relay->out_source_id =
+        g_io_add_watch(relay->out_channel, G_IO_OUT|G_IO_ERR|G_IO_HUP,
+                       (GIOFunc)gksu_relay_output_cb, (gpointer)relay);
+      break;
+    case RELAY_FINISHED:
+      break;
+    }
+
+  relay->in_source_id = 0;
+  return FALSE;
+}
+
+static gboolean gksu_relay_output_cb(GIOChannel *channel, GIOCondition condition,
+                                     GksuRelay *relay)
+{
+  switch(gksu_relay_pump(relay))
+    {
+    case RELAY_WAIT_OUTPUT:
+      return TRUE;
+    case RELAY_WAIT_INPUT:
+      relay->in_source_id =
+        g_io_add_watch(relay->in_channel, G_IO_IN|G_IO_PRI|G_IO_HUP|G_IO_ERR,
+                       (GIOFunc)gksu_relay_input_cb, (gpointer)relay);
+      break;
+    case RELAY_FINISHED:
+      break;
+    }
+
+  relay->out_source_id = 0;
+  return FALSE;
+}
+
+/**
+ * gksu_relay_new
+ * @in_fd: the fd to read from
+ * @out_fd: the fd to write to
+ * @close_out_on_eof: whether @out_fd should be closed when @in_fd
+ * reaches end of file
+ *
+ * Starts relaying everything that is read from @in_fd to @out_fd,
+ * from the main loop.
+ *
+ * Returns: the new relay
+ */
+GksuRelay* gksu_relay_new(gint in_fd, gint out_fd, gboolean close_out_on_eof)
+{
+  GksuRelay *relay = g_slice_new0(GksuRelay);
+  struct stat in_stat;
+
+  relay->in_fd = in_fd;
+  relay->out_fd = out_fd;
+  relay->close_out_on_eof = close_out_on_eof;
+  relay->in_is_pipe = (fstat(in_fd, &in_stat) == 0) && S_ISFIFO(in_stat.st_mode);
+
+#ifdef HAVE_SPLICE
+  relay->use_splice = TRUE;
+#else
+  relay->buffer = g_malloc(RELAY_CHUNK_SIZE);
+#endif
+
+  relay->in_channel = g_io_channel_unix_new(in_fd);
+  relay->out_channel = g_io_channel_unix_new(out_fd);
+
+  relay->in_source_id =
+    g_io_add_watch(relay->in_channel, G_IO_IN|G_IO_PRI|G_IO_HUP|G_IO_ERR,
+                   (GIOFunc)gksu_relay_input_cb, (gpointer)relay);
+
+  return relay;
+}
+
+void gksu_relay_free(GksuRelay *relay)
+{
+  if(relay->in_source_id)
+    g_source_remove(relay->in_source_id);
+  if(relay->out_source_id)
+    g_source_remove(relay->out_source_id);
+
+  g_io_channel_unref(relay->in_channel);
+  g_io_channel_unref(relay->out_channel);
+  g_free(relay->buffer);
+
+  g_slice_free(GksuRelay, relay);
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of Gksu PolicyKit.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.  You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GKSU_RELAY_H__
+#define __GKSU_RELAY_H__ 1
+
+#include <glib.h>
+
+typedef struct _GksuRelay GksuRelay;
+
+GksuRelay* gksu_relay_new(gint in_fd, gint out_fd, gboolean close_out_on_eof);
+
+void gksu_relay_free(GksuRelay *relay);
+
+#endif
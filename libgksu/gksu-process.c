@@ -22,13 +22,13 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 
 #include <glib-object.h>
-#include <dbus/dbus-glib.h>
-#include <dbus/dbus-glib-lowlevel.h>
-#include <dbus/dbus.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 
 #define SN_API_NOT_YET_FROZEN
 #include <libsn/sn.h>
@@ -38,20 +38,64 @@
 #include <gksu-process-error.h>
 #include <gksu-environment.h>
 #include <gksu-write-queue.h>
-#include <gksu-marshal.h>
+#include <gksu-xauth.h>
+#include <gksu-dbus.h>
 
 #include "gksu-process.h"
 
 G_DEFINE_TYPE(GksuProcess, gksu_process, G_TYPE_OBJECT);
 
 struct _GksuProcessPrivate {
-  DBusGConnection *dbus;
-  DBusGProxy *server;
+  GDBusConnection *connection;
+  GksuDBusGksu *server;
+
+  /* binary-safe versions of the data transfer methods; we fall back
+   * to the string-based ones if the server does not have them */
+  GksuDBusGksu2 *server_bytes;
+  gboolean use_string_transport;
+
+  /* the process' own object on the server, if it has them; the
+   * notifications about our process come from it, so that the bus
+   * only wakes us up for what is ours */
+  GksuDBusGksuProcess *process_proxy;
+  gchar *process_path;
+
+  /* we listen for the object's signals before asking for it, as the
+   * server starts sending them there as soon as it answers; those
+   * that come before we know which object is ours wait here */
+  guint process_signals_id;
+  GQueue early_signals;
+
+  /* set once the process object told us the child is gone */
+  gboolean exited;
+
+  /* a private connection to the server that carries only this
+   * process' traffic; once we have it every call and notification
+   * about the process goes through it instead of the bus */
+  GDBusConnection *channel;
+  GksuDBusGksuProcess *channel_proxy;
+  /* whether gksu_process_attach() should get us a channel, and ask
+   * for the output to be streamed once it is done */
+  gboolean open_channel;
+  gboolean start_streaming;
   gchar *working_directory;
   gchar **arguments;
   gint pid;
   guint32 cookie;
 
+  /* whether the server pushes output to us with OutputData, instead
+   * of announcing it with OutputAvailable */
+  gboolean streaming;
+
+  /* when our write queues pile up more than the high watermark we
+   * stop taking output from the server until they get down to the
+   * low one; a pull is deferred by not calling ReadOutput, a push by
+   * asking the server to pause the stream */
+  gsize output_low_watermark;
+  gsize output_high_watermark;
+  gboolean stdout_read_pending;
+  gboolean stderr_read_pending;
+
   /* Startup notification */
   GdkDisplay *display;
   SnLauncherContext *sn_context;
@@ -68,6 +112,22 @@ struct _GksuProcessPrivate {
   GIOChannel *stdin_mirror;
   guint stdin_mirror_id;
 
+  /* input is sent in chunks of at most input_chunk_size bytes, with
+   * up to input_max_in_flight WriteInput calls awaiting their reply;
+   * the server handles them in the order they were sent, so that is
+   * all we need to keep the data in order */
+  gsize input_chunk_size;
+  guint input_max_in_flight;
+  guint input_in_flight;
+  /* we only pipeline once we know which interface the server talks */
+  gboolean input_transport_known;
+  /* input moves to the channel only once nothing is left in flight
+   * on the bus, so that it can't overtake what was sent before */
+  gboolean input_on_channel;
+  /* the application closed its end; the server's is closed as soon
+   * as whatever is left has been sent */
+  gboolean stdin_closing;
+
   /* We need the write queue because the channel to which we need to
    * write is not always available for writing, and that may be
    * because the buffer is filled, and application needs to read some
@@ -86,6 +146,14 @@ struct _GksuProcessPrivate {
   GksuWriteQueue *stderr_write_queue;
 };
 
+/* how much of the child's output we are willing to hold while the
+ * application is not reading it */
+#define DEFAULT_OUTPUT_LOW_WATERMARK (256*1024)
+#define DEFAULT_OUTPUT_HIGH_WATERMARK (1024*1024)
+
+#define DEFAULT_INPUT_CHUNK_SIZE 65536
+#define DEFAULT_INPUT_MAX_IN_FLIGHT 4
+
 #define GKSU_PROCESS_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_PROCESS, GksuProcessPrivate))
 
 enum {
@@ -96,21 +164,13 @@ enum {
 
 static guint signals[LAST_SIGNAL] = {0,};
 
-static void process_died_cb(DBusGProxy *server, gint pid, GksuProcess *self)
+static void gksu_process_handle_exit(GksuProcess *self)
 {
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
   GError *error = NULL;
   gint status;
 
-  /* we only care about the process we are managing */
-  if(pid != priv->pid)
-    return;
-
-  dbus_g_proxy_call(server, "Wait", &error,
-                    G_TYPE_UINT, priv->cookie,
-                    G_TYPE_INVALID,
-                    G_TYPE_INT, &status,
-                    G_TYPE_INVALID);
+  gksu_dbus_gksu_call_wait_sync(priv->server, priv->cookie, &status, NULL, &error);
 
   if(error)
     {
@@ -121,51 +181,676 @@ static void process_died_cb(DBusGProxy *server, gint pid, GksuProcess *self)
   g_signal_emit(self, signals[EXITED], 0, status);
 }
 
-static void output_available_cb(DBusGProxy *server, gint pid, gint fd, GksuProcess *self)
+static void process_died_cb(GksuDBusGksu *server, gint pid, GksuProcess *self)
 {
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
-  GError *error = NULL;
-  gchar *data = NULL;
-  guint64 uint_length;
-  gsize length;
 
+  /* we only care about the process we are managing */
   if(pid != priv->pid)
     return;
 
-  dbus_g_proxy_call(server, "ReadOutput", &error,
-                    G_TYPE_UINT, priv->cookie,
-                    G_TYPE_INT, fd,
-                    G_TYPE_INVALID,
-                    G_TYPE_STRING, &data,
-                    G_TYPE_UINT64, &uint_length,
-                    G_TYPE_INVALID);
+  gksu_process_handle_exit(self);
+}
 
-  length = (gsize)uint_length;
+static void gksu_process_queue_output(GksuProcess *self, gint fd, GVariant *data);
 
-  if(error)
+/*
+ * The process object tells us everything in its Exited signal, and is
+ * gone by the time we get it; there is nothing to Wait for.
+ */
+static void process_object_exited_cb(GksuDBusGksuProcess *process, gint status,
+                                     GVariant *remaining_stdout,
+                                     GVariant *remaining_stderr,
+                                     GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  priv->exited = TRUE;
+
+  /* whatever we held back reading is in here */
+  priv->stdout_read_pending = FALSE;
+  priv->stderr_read_pending = FALSE;
+
+  gksu_process_queue_output(self, 1, remaining_stdout);
+  gksu_process_queue_output(self, 2, remaining_stderr);
+
+  g_signal_emit(self, signals[EXITED], 0, status);
+}
+
+static gboolean is_unknown_method_error(GError *error)
+{
+  return g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD);
+}
+
+/*
+ * A call that raced with the child's exit finds the process gone;
+ * what it was after comes with the Exited signal.
+ */
+static gboolean is_process_gone_error(GError *error)
+{
+  gchar *name;
+  gboolean gone;
+
+  if(g_error_matches(error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_OBJECT) ||
+     g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CLOSED))
+    return TRUE;
+
+  name = g_dbus_error_get_remote_error(error);
+  gone = !g_strcmp0(name, "org.gnome.Gksu.Error.ProcessNotFound");
+  g_free(name);
+
+  return gone;
+}
+
+/*
+ * Reads pending output for @fd from the server, preferring the
+ * org.gnome.Gksu2 interface, which carries bytes instead of strings.
+ * Returns a byte array variant.
+ */
+static GVariant* gksu_process_read_output(GksuProcess *self, gint fd, GError **error)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *internal_error = NULL;
+  GVariant *bytes = NULL;
+  gchar *data = NULL;
+  guint64 length;
+
+  if(priv->channel_proxy)
     {
-      g_warning("%s", error->message);
-      g_error_free(error);
-      return;
+      gksu_dbus_gksu_process_call_read_output_sync(priv->channel_proxy, fd,
+                                                   &bytes, NULL, error);
+      return bytes;
+    }
+
+  if(!priv->use_string_transport)
+    {
+      gksu_dbus_gksu2_call_read_output_sync(priv->server_bytes, priv->cookie, fd,
+                                            &bytes, NULL, &internal_error);
+
+      if(internal_error == NULL)
+        return bytes;
+
+      if(!is_unknown_method_error(internal_error))
+        {
+          g_propagate_error(error, internal_error);
+          return NULL;
+        }
+
+      g_clear_error(&internal_error);
+      priv->use_string_transport = TRUE;
+    }
+
+  gksu_dbus_gksu_call_read_output_sync(priv->server, priv->cookie, fd,
+                                       &data, &length, NULL, &internal_error);
+
+  if(internal_error)
+    {
+      g_propagate_error(error, internal_error);
+      return NULL;
     }
 
+  bytes = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, data,
+                                    MIN(length, strlen(data)), 1);
+  g_free(data);
+
+  return g_variant_ref_sink(bytes);
+}
+
+static void gksu_process_queue_output(GksuProcess *self, gint fd, GVariant *data)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  const gchar *bytes;
+  gsize length;
+
+  bytes = g_variant_get_fixed_array(data, &length, 1);
+
   switch(fd)
     {
     case 1:
       if(priv->stdout_channel)
-        {
-          gksu_write_queue_add(priv->stdout_write_queue, data, length);
-        }
+        gksu_write_queue_add(priv->stdout_write_queue, bytes, length);
       break;
     case 2:
       if(priv->stderr_channel)
-        {
-          gksu_write_queue_add(priv->stderr_write_queue, data, length);
-        }
+        gksu_write_queue_add(priv->stderr_write_queue, bytes, length);
       break;
     }
+}
 
-  g_free(data);
+static void gksu_process_fetch_output(GksuProcess *self, gint fd)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+  GVariant *data;
+
+  if(priv->exited)
+    return;
+
+  data = gksu_process_read_output(self, fd, &error);
+
+  if(error)
+    {
+      if(!(priv->process_path && is_process_gone_error(error)))
+        g_warning("%s", error->message);
+      g_error_free(error);
+      return;
+    }
+
+  gksu_process_queue_output(self, fd, data);
+  g_variant_unref(data);
+}
+
+static void gksu_process_handle_output_available(GksuProcess *self, gint fd)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  /* the server won't look at the child's output again until we read
+   * what it has, so leaving it there is enough to hold the child back */
+  if((fd == 1) && priv->stdout_channel &&
+     gksu_write_queue_is_full(priv->stdout_write_queue))
+    {
+      priv->stdout_read_pending = TRUE;
+      return;
+    }
+
+  if((fd == 2) && priv->stderr_channel &&
+     gksu_write_queue_is_full(priv->stderr_write_queue))
+    {
+      priv->stderr_read_pending = TRUE;
+      return;
+    }
+
+  gksu_process_fetch_output(self, fd);
+}
+
+static void output_available_cb(GksuDBusGksu *server, gint pid, gint fd, GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(pid != priv->pid)
+    return;
+
+  gksu_process_handle_output_available(self, fd);
+}
+
+static void process_object_output_available_cb(GksuDBusGksuProcess *process, gint fd,
+                                               GksuProcess *self)
+{
+  gksu_process_handle_output_available(self, fd);
+}
+
+static gint
+gksu_process_queue_fd(GksuProcess *self, GksuWriteQueue *queue)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(priv->stdout_channel && (queue == priv->stdout_write_queue))
+    return 1;
+
+  return 2;
+}
+
+static void
+gksu_process_set_output_paused(GksuProcess *self, gint fd, gboolean paused)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(priv->exited)
+    return;
+
+  /* no callback means no reply is asked for */
+  if(priv->channel_proxy)
+    gksu_dbus_gksu_process_call_set_output_paused(priv->channel_proxy, fd, paused,
+                                                  NULL, NULL, NULL);
+  else
+    gksu_dbus_gksu_call_set_output_paused(priv->server, priv->cookie, fd, paused,
+                                          NULL, NULL, NULL);
+}
+
+static void
+gksu_process_queue_full_cb(GksuWriteQueue *queue, GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(!priv->streaming)
+    return;
+
+  gksu_process_set_output_paused(self, gksu_process_queue_fd(self, queue), TRUE);
+}
+
+static void
+gksu_process_queue_drained_cb(GksuWriteQueue *queue, GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  gint fd = gksu_process_queue_fd(self, queue);
+  gboolean *read_pending;
+
+  if(priv->streaming)
+    {
+      gksu_process_set_output_paused(self, fd, FALSE);
+      return;
+    }
+
+  read_pending = (fd == 1) ? &(priv->stdout_read_pending) : &(priv->stderr_read_pending);
+  if(*read_pending)
+    {
+      *read_pending = FALSE;
+      gksu_process_fetch_output(self, fd);
+    }
+}
+
+static void output_data_cb(GksuDBusGksu *server, gint pid, gint fd, GVariant *data,
+                           GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(pid != priv->pid)
+    return;
+
+  gksu_process_queue_output(self, fd, data);
+}
+
+static void process_object_output_data_cb(GksuDBusGksuProcess *process, gint fd,
+                                          GVariant *data, GksuProcess *self)
+{
+  gksu_process_queue_output(self, fd, data);
+}
+
+/*
+ * Pushed output may already be on its way when the server tells us
+ * it will stream, so the queues may have gone over the watermark
+ * without the server being asked to pause.
+ */
+static void
+gksu_process_streaming_started_cb(GObject *proxy, GAsyncResult *result,
+                                  GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+
+  if(proxy == G_OBJECT(priv->channel_proxy))
+    gksu_dbus_gksu_process_call_start_streaming_finish(priv->channel_proxy,
+                                                       result, &error);
+  else
+    gksu_dbus_gksu_call_start_streaming_finish(priv->server, result, &error);
+
+  if(error)
+    {
+      g_error_free(error);
+      g_object_unref(self);
+      return;
+    }
+
+  priv->streaming = TRUE;
+
+  if(priv->stdout_channel && gksu_write_queue_is_full(priv->stdout_write_queue))
+    gksu_process_set_output_paused(self, 1, TRUE);
+  if(priv->stderr_channel && gksu_write_queue_is_full(priv->stderr_write_queue))
+    gksu_process_set_output_paused(self, 2, TRUE);
+
+  g_object_unref(self);
+}
+
+/*
+ * The end of gksu_process_attach(), however far it got; drops the
+ * reference it held.
+ */
+static void
+gksu_process_attach_done(GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  /* now that we know where it should go, ask for the output to be
+   * pushed to us, which saves a ReadOutput round trip for each chunk;
+   * servers that don't know about this keep announcing output with
+   * OutputAvailable, and so does this one until it gets the call */
+  if(priv->start_streaming && !priv->exited)
+    {
+      if(priv->channel_proxy)
+        gksu_dbus_gksu_process_call_start_streaming(priv->channel_proxy, NULL,
+                                                    (GAsyncReadyCallback)gksu_process_streaming_started_cb,
+                                                    self);
+      else
+        gksu_dbus_gksu_call_start_streaming(priv->server, priv->cookie, NULL,
+                                            (GAsyncReadyCallback)gksu_process_streaming_started_cb,
+                                            self);
+      return;
+    }
+
+  g_object_unref(self);
+}
+
+static void
+gksu_process_channel_ready_cb(GObject *source, GAsyncResult *result,
+                              GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+
+  priv->channel = g_dbus_connection_new_finish(result, &error);
+  if(!priv->channel)
+    goto out;
+
+  /* no bus name on a peer-to-peer connection, so this does not
+   * need to ask anything of the other end */
+  priv->channel_proxy =
+    gksu_dbus_gksu_process_proxy_new_sync(priv->channel,
+                                          G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                          NULL,
+                                          priv->process_path, NULL, &error);
+  if(!priv->channel_proxy)
+    {
+      g_dbus_connection_close(priv->channel, NULL, NULL, NULL);
+      g_object_unref(priv->channel);
+      priv->channel = NULL;
+      goto out;
+    }
+
+  /* WriteInput replies are deferred while the child is not reading */
+  g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(priv->channel_proxy), G_MAXINT);
+
+  g_signal_connect(priv->channel_proxy, "exited",
+                   G_CALLBACK(process_object_exited_cb), self);
+  g_signal_connect(priv->channel_proxy, "output-available",
+                   G_CALLBACK(process_object_output_available_cb), self);
+  g_signal_connect(priv->channel_proxy, "output-data",
+                   G_CALLBACK(process_object_output_data_cb), self);
+
+  /* input chunks still on their way through the bus could be
+   * overtaken by the ones we send here */
+  if(priv->input_in_flight == 0)
+    priv->input_on_channel = TRUE;
+
+  /* the server may have sent something already; it was held until
+   * we could hear it */
+  g_dbus_connection_start_message_processing(priv->channel);
+
+ out:
+  if(error)
+    {
+      g_warning("Could not set up the channel to the server: %s", error->message);
+      g_error_free(error);
+    }
+  gksu_process_attach_done(self);
+}
+
+static void
+gksu_process_channel_opened_cb(GksuDBusGksuProcess *process, GAsyncResult *result,
+                               GksuProcess *self)
+{
+  GUnixFDList *fd_list = NULL;
+  GSocket *socket;
+  GSocketConnection *stream;
+  GError *error = NULL;
+  gint handle;
+  gint fd;
+
+  gksu_dbus_gksu_process_call_open_channel_finish(process, &handle, &fd_list,
+                                                  result, &error);
+  if(error)
+    {
+      /* older servers do not have OpenChannel, that is fine */
+      if(!is_unknown_method_error(error) && !is_process_gone_error(error))
+        g_warning("Could not open a channel to the server: %s", error->message);
+      g_error_free(error);
+      gksu_process_attach_done(self);
+      return;
+    }
+
+  fd = g_unix_fd_list_get(fd_list, handle, &error);
+  g_object_unref(fd_list);
+  if(fd == -1)
+    goto failed;
+
+  socket = g_socket_new_from_fd(fd, &error);
+  if(!socket)
+    {
+      close(fd);
+      goto failed;
+    }
+
+  stream = g_socket_connection_factory_create_connection(socket);
+  g_object_unref(socket);
+
+  /* the authentication handshake is a round trip of its own; the
+   * server sends the process' signals here as soon as it is done, so
+   * nothing is read until we listen for them */
+  g_dbus_connection_new(G_IO_STREAM(stream), NULL,
+                        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                        G_DBUS_CONNECTION_FLAGS_DELAY_MESSAGE_PROCESSING,
+                        NULL, NULL,
+                        (GAsyncReadyCallback)gksu_process_channel_ready_cb,
+                        self);
+  g_object_unref(stream);
+  return;
+
+ failed:
+  g_warning("Could not set up the channel to the server: %s", error->message);
+  g_error_free(error);
+  gksu_process_attach_done(self);
+}
+
+/*
+ * Asks the server for a connection of our own to the process object,
+ * so that its output and input do not have to go through the bus
+ * daemon. If the server can't give us one we simply stay on the bus.
+ */
+static void
+gksu_process_open_channel(GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(priv->exited ||
+     !(g_dbus_connection_get_capabilities(priv->connection) &
+       G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING))
+    {
+      gksu_process_attach_done(self);
+      return;
+    }
+
+  gksu_dbus_gksu_process_call_open_channel(priv->process_proxy, NULL, NULL,
+                                           (GAsyncReadyCallback)gksu_process_channel_opened_cb,
+                                           self);
+}
+
+typedef struct {
+  gchar *path;
+  gchar *name;
+  GVariant *parameters;
+} GksuProcessEarlySignal;
+
+static void
+gksu_process_early_signal_free(GksuProcessEarlySignal *early)
+{
+  g_free(early->path);
+  g_free(early->name);
+  g_variant_unref(early->parameters);
+  g_slice_free(GksuProcessEarlySignal, early);
+}
+
+static void
+gksu_process_handle_object_signal(GksuProcess *self, const gchar *signal_name,
+                                  GVariant *parameters)
+{
+  GVariant *first;
+  GVariant *second;
+  gint number;
+
+  if(!g_strcmp0(signal_name, "Exited"))
+    {
+      g_variant_get(parameters, "(i@ay@ay)", &number, &first, &second);
+      process_object_exited_cb(NULL, number, first, second, self);
+      g_variant_unref(first);
+      g_variant_unref(second);
+    }
+  else if(!g_strcmp0(signal_name, "OutputAvailable"))
+    {
+      g_variant_get(parameters, "(i)", &number);
+      process_object_output_available_cb(NULL, number, self);
+    }
+  else if(!g_strcmp0(signal_name, "OutputData"))
+    {
+      g_variant_get(parameters, "(i@ay)", &number, &first);
+      process_object_output_data_cb(NULL, number, first, self);
+      g_variant_unref(first);
+    }
+}
+
+/*
+ * Any of our processes' objects may be talking; until GetProcess
+ * tells us which one is ours we keep what they say.
+ */
+static void
+gksu_process_object_signal_cb(GDBusConnection *connection, const gchar *sender,
+                              const gchar *path, const gchar *interface,
+                              const gchar *signal_name, GVariant *parameters,
+                              GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GksuProcessEarlySignal *early;
+
+  if(!g_str_has_prefix(path, "/org/gnome/Gksu/Process/"))
+    return;
+
+  if(priv->process_path == NULL)
+    {
+      early = g_slice_new(GksuProcessEarlySignal);
+      early->path = g_strdup(path);
+      early->name = g_strdup(signal_name);
+      early->parameters = g_variant_ref(parameters);
+      g_queue_push_tail(&(priv->early_signals), early);
+      return;
+    }
+
+  if(!g_strcmp0(path, priv->process_path))
+    gksu_process_handle_object_signal(self, signal_name, parameters);
+}
+
+static void
+gksu_process_stop_listening(GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  if(priv->process_signals_id)
+    g_dbus_connection_signal_unsubscribe(priv->connection,
+                                         priv->process_signals_id);
+  priv->process_signals_id = 0;
+
+  g_queue_foreach(&(priv->early_signals), (GFunc)gksu_process_early_signal_free, NULL);
+  g_queue_clear(&(priv->early_signals));
+}
+
+static void
+gksu_process_attach_cb(GksuDBusGksu *server, GAsyncResult *result,
+                       GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GksuProcessEarlySignal *early;
+  GError *error = NULL;
+  gchar *owner;
+  gchar *path = NULL;
+
+  gksu_dbus_gksu_call_get_process_finish(server, &path, result, &error);
+  if(error)
+    {
+      /* the server did not switch over; we stay on /org/gnome/Gksu */
+      g_error_free(error);
+      gksu_process_stop_listening(self);
+      gksu_process_attach_done(self);
+      return;
+    }
+
+  priv->process_path = path;
+
+  /* whatever was said before we got here is played back in order;
+   * the exit may be in there, so we make sure we're still around
+   * after dealing with it */
+  g_object_ref(self);
+  while((early = g_queue_pop_head(&(priv->early_signals))))
+    {
+      if(!g_strcmp0(early->path, priv->process_path))
+        gksu_process_handle_object_signal(self, early->name, early->parameters);
+      gksu_process_early_signal_free(early);
+    }
+  g_object_unref(self);
+
+  if(!priv->open_channel || priv->exited)
+    {
+      gksu_process_attach_done(self);
+      return;
+    }
+
+  /* the proxy is only used to call the object's methods; we listen
+   * for its signals ourselves. Addressing the server by its unique
+   * name spares the proxy from having to look it up, so creating it
+   * does not block */
+  owner = g_dbus_proxy_get_name_owner(G_DBUS_PROXY(server));
+  if(owner)
+    priv->process_proxy =
+      gksu_dbus_gksu_process_proxy_new_sync(priv->connection,
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES |
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_CONNECT_SIGNALS,
+                                            owner, path, NULL, &error);
+  g_free(owner);
+  if(error)
+    {
+      g_warning("%s", error->message);
+      g_error_free(error);
+    }
+
+  if(priv->process_proxy)
+    gksu_process_open_channel(self);
+  else
+    gksu_process_attach_done(self);
+}
+
+/*
+ * Moves the notifications about our process over to its own object,
+ * if the server has those, and, if @open_channel is set, asks for a
+ * private channel to it for the data we relay; see
+ * gksu_process_open_channel().
+ *
+ * The server sends the notifications from the object as soon as it
+ * has answered GetProcess, so we listen for them from all of our
+ * processes' objects before asking, and pick ours out once we know
+ * its path; until the server answers, they keep coming to
+ * /org/gnome/Gksu.
+ *
+ * None of this waits for the server: each step is started from the
+ * reply to the one before, so the spawn that called us returns after
+ * a single round trip.
+ */
+static void
+gksu_process_attach(GksuProcess *self, gboolean open_channel)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  gchar *owner;
+
+  priv->open_channel = open_channel;
+  g_object_ref(self);
+
+  /* the server's unique name, which nobody else can send as */
+  owner = g_dbus_proxy_get_name_owner(G_DBUS_PROXY(priv->server));
+  if(owner == NULL)
+    {
+      gksu_process_attach_done(self);
+      return;
+    }
+
+  /* the signals are sent to us alone, so there is no match rule to
+   * wait for; we can't match on a path prefix, that is done in the
+   * callback */
+  priv->process_signals_id =
+    g_dbus_connection_signal_subscribe(priv->connection, owner,
+                                       "org.gnome.Gksu.Process", NULL, NULL, NULL,
+                                       G_DBUS_SIGNAL_FLAGS_NONE,
+                                       (GDBusSignalCallback)gksu_process_object_signal_cb,
+                                       self, NULL);
+  g_free(owner);
+
+  gksu_dbus_gksu_call_get_process(priv->server, priv->cookie, NULL,
+                                  (GAsyncReadyCallback)gksu_process_attach_cb,
+                                  self);
 }
 
 static void gksu_process_finalize(GObject *object)
@@ -175,12 +860,14 @@ static void gksu_process_finalize(GObject *object)
 
   if(priv->stdin_channel)
     {
-      g_source_remove(priv->stdin_source_id);
+      if(priv->stdin_source_id)
+        g_source_remove(priv->stdin_source_id);
       g_io_channel_unref(priv->stdin_channel);
     }
   if(priv->stdin_mirror)
     {
-      g_source_remove(priv->stdin_mirror_id);
+      if(priv->stdin_mirror_id)
+        g_source_remove(priv->stdin_mirror_id);
       g_io_channel_unref(priv->stdin_mirror);
     }
 
@@ -206,6 +893,21 @@ static void gksu_process_finalize(GObject *object)
       g_io_channel_unref(priv->stderr_mirror);
     }
 
+  if(priv->channel_proxy)
+    g_object_unref(priv->channel_proxy);
+  if(priv->channel)
+    {
+      g_dbus_connection_close(priv->channel, NULL, NULL, NULL);
+      g_object_unref(priv->channel);
+    }
+  if(priv->process_proxy)
+    g_object_unref(priv->process_proxy);
+  gksu_process_stop_listening(self);
+  g_free(priv->process_path);
+  g_object_unref(priv->server_bytes);
+  g_object_unref(priv->server);
+  g_object_unref(priv->connection);
+
   g_free(priv->working_directory);
   g_strfreev(priv->arguments);
 
@@ -236,33 +938,49 @@ static void gksu_process_init(GksuProcess *self)
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
   self->priv = priv;
 
-  priv->dbus = dbus_g_bus_get(DBUS_BUS_SYSTEM, &error);
+  /* GDBus does the reading and writing of messages in a thread of
+   * its own; only the signals and replies come to our main loop */
+  priv->connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
   if(error)
     {
-      g_error(error->message);
+      g_error("%s", error->message);
       exit(1);
     }
 
-  priv->server = dbus_g_proxy_new_for_name(priv->dbus,
-                                           "org.gnome.Gksu",
-                                           "/org/gnome/Gksu",
-                                           "org.gnome.Gksu");
+  priv->server =
+    gksu_dbus_gksu_proxy_new_sync(priv->connection,
+                                  G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                  "org.gnome.Gksu", "/org/gnome/Gksu",
+                                  NULL, &error);
+  if(error)
+    {
+      g_error("%s", error->message);
+      exit(1);
+    }
 
-  dbus_g_object_register_marshaller(gksu_marshal_VOID__INT_INT,
-                                    G_TYPE_NONE, G_TYPE_INT, G_TYPE_INT,
-                                    G_TYPE_INVALID);
+  priv->server_bytes =
+    gksu_dbus_gksu2_proxy_new_sync(priv->connection,
+                                   G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                   "org.gnome.Gksu", "/org/gnome/Gksu",
+                                   NULL, &error);
+  if(error)
+    {
+      g_error("%s", error->message);
+      exit(1);
+    }
 
-  dbus_g_proxy_add_signal(priv->server, "ProcessExited",
-                          G_TYPE_INT, G_TYPE_INVALID);
-  dbus_g_proxy_connect_signal(priv->server, "ProcessExited",
-                              G_CALLBACK(process_died_cb),
-                              (gpointer)self, NULL);
+  /* authorization may involve the user typing a password, and the
+   * server holds WriteInput replies while the child is not reading,
+   * so we can't have calls time out on us */
+  g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(priv->server), G_MAXINT);
+  g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(priv->server_bytes), G_MAXINT);
 
-  dbus_g_proxy_add_signal(priv->server, "OutputAvailable",
-                          G_TYPE_INT, G_TYPE_INT, G_TYPE_INVALID);
-  dbus_g_proxy_connect_signal(priv->server, "OutputAvailable",
-                              G_CALLBACK(output_available_cb),
-                              (gpointer)self, NULL);
+  g_signal_connect(priv->server, "process-exited",
+                   G_CALLBACK(process_died_cb), self);
+  g_signal_connect(priv->server, "output-available",
+                   G_CALLBACK(output_available_cb), self);
+  g_signal_connect(priv->server, "output-data",
+                   G_CALLBACK(output_data_cb), self);
 
   priv->display = gdk_display_get_default();
   if(priv->display == NULL)
@@ -276,6 +994,12 @@ static void gksu_process_init(GksuProcess *self)
   priv->stdin_channel = NULL;
   priv->stdout_channel = NULL;
   priv->stderr_channel = NULL;
+
+  priv->input_chunk_size = DEFAULT_INPUT_CHUNK_SIZE;
+  priv->input_max_in_flight = DEFAULT_INPUT_MAX_IN_FLIGHT;
+
+  priv->output_low_watermark = DEFAULT_OUTPUT_LOW_WATERMARK;
+  priv->output_high_watermark = DEFAULT_OUTPUT_HIGH_WATERMARK;
 }
 
 static void
@@ -308,144 +1032,389 @@ gksu_process_launch_initiate(GksuProcess *self)
   g_setenv("DESKTOP_STARTUP_ID", priv->sn_id, TRUE);
 }
 
-/* copied from libgksu */
+/*
+ * The cookies we found, by display; an entry is good for as long as
+ * the authority file it came from is not replaced or changed, which
+ * a stat() tells us.
+ */
+typedef struct {
+  gchar *filename;
+  ino_t inode;
+  time_t mtime;
+  off_t size;
+  gchar *cookie;
+} XauthCacheEntry;
+
+static GHashTable *xauth_cache = NULL;
+G_LOCK_DEFINE_STATIC(xauth_cache);
+
+static void
+xauth_cache_entry_free(XauthCacheEntry *entry)
+{
+  g_free(entry->filename);
+  g_free(entry->cookie);
+  g_slice_free(XauthCacheEntry, entry);
+}
+
+/*
+ * Reads the cookie for the display we are on from the user's
+ * authority file, as `xauth list $DISPLAY` would, including its
+ * fallback to the local display of the same number for ssh-forwarded
+ * displays; see gksu_xauth_lookup_cookie().
+ */
 static gchar*
-get_xauth_token(const gchar *explicit_display)
+get_xauth_token(void)
+{
+  const gchar *display = g_getenv("DISPLAY");
+  XauthCacheEntry *entry;
+  gchar *filename;
+  gchar *cookie;
+  struct stat info;
+
+  if(display == NULL)
+    return NULL;
+
+  if(g_getenv("XAUTHORITY"))
+    filename = g_strdup(g_getenv("XAUTHORITY"));
+  else
+    filename = g_build_filename(g_get_home_dir(), ".Xauthority", NULL);
+
+  if(stat(filename, &info))
+    {
+      g_free(filename);
+      return NULL;
+    }
+
+  G_LOCK(xauth_cache);
+
+  if(xauth_cache == NULL)
+    xauth_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify)xauth_cache_entry_free);
+
+  entry = g_hash_table_lookup(xauth_cache, display);
+  if(entry && !strcmp(entry->filename, filename) && (entry->inode == info.st_ino) &&
+     (entry->mtime == info.st_mtime) && (entry->size == info.st_size))
+    {
+      cookie = g_strdup(entry->cookie);
+      G_UNLOCK(xauth_cache);
+      g_free(filename);
+      return cookie;
+    }
+
+  cookie = gksu_xauth_lookup_cookie(filename, display);
+
+  entry = g_slice_new(XauthCacheEntry);
+  entry->filename = filename;
+  entry->inode = info.st_ino;
+  entry->mtime = info.st_mtime;
+  entry->size = info.st_size;
+  entry->cookie = g_strdup(cookie);
+  g_hash_table_replace(xauth_cache, g_strdup(display), entry);
+
+  G_UNLOCK(xauth_cache);
+
+  return cookie;
+}
+
+static void gksu_process_prepare_pipe(GIOChannel **channel, GIOChannel **mirror,
+                                      gint stdpipe[2], gint *fd, gboolean is_input)
+{
+  pipe(stdpipe);
+  fcntl(stdpipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(stdpipe[1], F_SETFL, O_NONBLOCK);
+
+  /*
+   * is_input defines whether the pipe fds are for output (FALSE) or
+   * input (TRUE)
+   */
+  if(is_input)
+    {
+      *channel = g_io_channel_unix_new(stdpipe[0]);
+      *fd = stdpipe[1];
+
+      *mirror = g_io_channel_unix_new(stdpipe[1]);
+    }
+  else
+    {
+      *channel = g_io_channel_unix_new(stdpipe[1]);
+      *fd = stdpipe[0];
+
+      *mirror = g_io_channel_unix_new(stdpipe[0]);
+    }
+
+  /* if the channel is buffered, we may end up not seeing some output
+   * for a long time */
+  g_io_channel_set_encoding(*channel, NULL, NULL);
+  g_io_channel_set_buffered(*channel, FALSE);
+}
+
+static void
+gksu_process_close_server_fd(GksuProcess *self, guint fd)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+
+  if(priv->channel_proxy)
+    gksu_dbus_gksu_process_call_close_fd_sync(priv->channel_proxy, fd, NULL, &error);
+  else
+    gksu_dbus_gksu_call_close_fd_sync(priv->server, priv->cookie, fd, NULL, &error);
+
+  if(error)
+    {
+      g_warning("%s", error->message);
+      g_error_free(error);
+    }
+}
+
+static gboolean
+gksu_process_stdout_mirror_hangup_cb(GIOChannel *channel, GIOCondition condition,
+                                     GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+
+  if((condition == G_IO_HUP) || (condition == G_IO_NVAL))
+    {
+      gksu_process_close_server_fd(self, 1);
+      g_io_channel_shutdown(priv->stdout_channel, TRUE, &error);
+      if(error)
+        {
+          g_warning("%s", error->message);
+          g_error_free(error);
+        }
+    }
+
+  return FALSE;
+}
+
+static gboolean
+gksu_process_stderr_mirror_hangup_cb(GIOChannel *channel, GIOCondition condition,
+                                     GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+
+  if((condition == G_IO_HUP) || (condition == G_IO_NVAL))
+    {
+      gksu_process_close_server_fd(self, 2);
+      g_io_channel_shutdown(priv->stderr_channel, TRUE, &error);
+      if(error)
+        {
+          g_warning("%s", error->message);
+          g_error_free(error);
+        }
+    }
+
+  return FALSE;
+}
+
+static void
+gksu_process_stdin_finish_close(GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+
+  gksu_process_close_server_fd(self, 0);
+  g_io_channel_shutdown(priv->stdin_channel, TRUE, &error);
+  if(error)
+    {
+      g_warning("%s", error->message);
+      g_error_free(error);
+    }
+}
+
+typedef struct
+{
+  GksuProcess *self;
+  /* a byte array, which goes into the message as it is */
+  GVariant *bytes;
+} InputChunk;
+
+static void
+input_chunk_free(InputChunk *chunk)
+{
+  g_object_unref(chunk->self);
+  g_variant_unref(chunk->bytes);
+  g_slice_free(InputChunk, chunk);
+}
+
+static void gksu_process_send_input_chunk(GksuProcess *self, InputChunk *chunk);
+static gboolean gksu_process_stdin_ready_to_send_cb(GIOChannel *channel,
+                                                    GIOCondition condition,
+                                                    GksuProcess *self);
+
+/*
+ * Sends as much of the pending input as the in-flight window allows;
+ * returns %FALSE if the pipe from the application had nothing left
+ * for us.
+ */
+static gboolean
+gksu_process_stdin_pump(GksuProcess *self)
 {
-  gchar *display;
-  gchar *xauth_bin = NULL;
-  FILE *xauth_output;
-  gchar *tmp = NULL;
-  gchar *xauth = g_new0(gchar, 256);
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  guint window;
 
-  if(explicit_display == NULL)
-    display = (gchar*)g_getenv("DISPLAY");
+  /* until the first reply tells us which interface to use, a chunk
+   * may need to be sent again, so we send them one at a time */
+  if(priv->input_transport_known || priv->use_string_transport ||
+     priv->input_on_channel)
+    window = priv->input_max_in_flight;
   else
-    display = (gchar*)explicit_display;
+    window = 1;
 
-  /* find out where the xauth binary is located */
-  if (g_file_test ("/usr/bin/xauth", G_FILE_TEST_IS_EXECUTABLE))
-    xauth_bin = "/usr/bin/xauth";
-  else if (g_file_test ("/usr/X11R6/bin/xauth", G_FILE_TEST_IS_EXECUTABLE))
-    xauth_bin = "/usr/X11R6/bin/xauth";
-  else
+  while(priv->input_in_flight < window)
     {
-      g_warning("Failed to obtain xauth key: xauth binary not found "
-                "at usual locations.");
+      InputChunk *chunk;
+      gchar *bytes;
+      gssize count;
 
-      return NULL;
-    }
+      bytes = g_malloc(priv->input_chunk_size);
 
-  /* get the authorization token */
-  tmp = g_strdup_printf ("%s -i list %s | "
-			 "head -1 | awk '{ print $3 }'",
-			 xauth_bin,
-			 display);
-  if ((xauth_output = popen (tmp, "r")) == NULL)
-    {
-      g_warning("Failed to obtain xauth key: %s", g_strerror(errno));
-      return NULL;
-    }
+      do
+        count = read(priv->stdin[0], bytes, priv->input_chunk_size);
+      while((count < 0) && (errno == EINTR));
 
-  fread (xauth, sizeof(char), 255, xauth_output);
-  pclose (xauth_output);
-  g_free (tmp);
+      if(count <= 0)
+        {
+          g_free(bytes);
+          return FALSE;
+        }
 
-  /* If xauth is the empty string, then try striping the
-   * hostname part of the DISPLAY string for getting the
-   * auth token; this is needed for ssh-forwarded usage
-   */
-  if((!strcmp("", xauth)) && (explicit_display == NULL))
-    {
-      gchar *cut_display = NULL;
+      chunk = g_slice_new(InputChunk);
+      chunk->self = g_object_ref(self);
+      /* the variant takes the buffer over, so the data is not copied
+       * again before it is written out */
+      chunk->bytes = g_variant_ref_sink(g_variant_new_from_data(G_VARIANT_TYPE("ay"),
+                                                                bytes, count, TRUE,
+                                                                g_free, bytes));
 
-      g_free (xauth);
-      cut_display = g_strdup(g_strrstr (display, ":"));
-      xauth = get_xauth_token(cut_display);
-      g_free(cut_display);
+      gksu_process_send_input_chunk(self, chunk);
     }
 
-  return xauth;
+  return TRUE;
 }
 
-static void gksu_process_prepare_pipe(GIOChannel **channel, GIOChannel **mirror,
-                                      gint stdpipe[2], gint *fd, gboolean is_input)
+static void
+gksu_process_input_written_cb(GObject *proxy, GAsyncResult *result,
+                              InputChunk *chunk)
 {
-  pipe(stdpipe);
-  fcntl(stdpipe[0], F_SETFL, O_NONBLOCK);
-  fcntl(stdpipe[1], F_SETFL, O_NONBLOCK);
+  GksuProcess *self = chunk->self;
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  GError *error = NULL;
+  InputChunk *retry;
 
-  /*
-   * is_input defines whether the pipe fds are for output (FALSE) or
-   * input (TRUE)
-   */
-  if(is_input)
+  priv->input_in_flight--;
+
+  if(priv->channel_proxy && (priv->input_in_flight == 0))
+    priv->input_on_channel = TRUE;
+
+  if(proxy == G_OBJECT(priv->channel_proxy))
+    gksu_dbus_gksu_process_call_write_input_finish(priv->channel_proxy, result, &error);
+  else if(proxy == G_OBJECT(priv->server_bytes))
+    gksu_dbus_gksu2_call_write_input_finish(priv->server_bytes, result, &error);
+  else
+    gksu_dbus_gksu_call_write_input_finish(priv->server, result, &error);
+
+  if(error)
     {
-      *channel = g_io_channel_unix_new(stdpipe[0]);
-      *fd = stdpipe[1];
+      if((proxy == G_OBJECT(priv->server_bytes)) && is_unknown_method_error(error))
+        {
+          /* this server only speaks strings; send the chunk again */
+          g_error_free(error);
+          priv->use_string_transport = TRUE;
+          priv->input_transport_known = TRUE;
 
-      *mirror = g_io_channel_unix_new(stdpipe[1]);
+          retry = g_slice_new(InputChunk);
+          retry->self = g_object_ref(self);
+          retry->bytes = g_variant_ref(chunk->bytes);
+
+          gksu_process_send_input_chunk(self, retry);
+          input_chunk_free(chunk);
+          return;
+        }
+
+      g_warning("%s", error->message);
+      g_error_free(error);
     }
   else
-    {
-      *channel = g_io_channel_unix_new(stdpipe[1]);
-      *fd = stdpipe[0];
+    priv->input_transport_known = TRUE;
 
-      *mirror = g_io_channel_unix_new(stdpipe[0]);
+  input_chunk_free(chunk);
+
+  if(priv->stdin_closing)
+    {
+      if(!gksu_process_stdin_pump(self) && (priv->input_in_flight == 0))
+        gksu_process_stdin_finish_close(self);
+      return;
     }
 
-  /* if the channel is buffered, we may end up not seeing some output
-   * for a long time */
-  g_io_channel_set_encoding(*channel, NULL, NULL);
-  g_io_channel_set_buffered(*channel, FALSE);
+  /* the window has room again */
+  if(priv->stdin_source_id == 0)
+    priv->stdin_source_id =
+      g_io_add_watch(priv->stdin_channel, G_IO_IN|G_IO_PRI,
+                     (GIOFunc)gksu_process_stdin_ready_to_send_cb,
+                     (gpointer)self);
 }
 
-static gchar* read_all_from_channel(GIOChannel *channel, gsize *length)
+static void
+gksu_process_send_input_chunk(GksuProcess *self, InputChunk *chunk)
 {
-  GError *error = NULL;
-  GString *retstring;
-  gchar *retdata;
-  gchar buffer[1024];
-  gsize buffer_length = -1;
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+  const gchar *bytes;
+  const gchar *valid_end;
+  gchar *string;
+  gsize length;
 
-  retstring = g_string_new("");
+  priv->input_in_flight++;
 
-  while(buffer_length != 0)
+  if(priv->input_on_channel)
     {
-      GIOStatus status;
-      status = g_io_channel_read_chars(channel, buffer, 1024, &buffer_length, &error);
-      if(error)
-        {
-          fprintf(stderr, "%s\n", error->message);
-          g_error_free(error);
-        }
-      g_string_append_len(retstring, buffer, buffer_length);
+      gksu_dbus_gksu_process_call_write_input(priv->channel_proxy, chunk->bytes,
+                                              NULL,
+                                              (GAsyncReadyCallback)gksu_process_input_written_cb,
+                                              chunk);
+      return;
     }
 
-  retdata = retstring->str;
-  *length = retstring->len;
-  g_string_free(retstring, FALSE);
+  if(!priv->use_string_transport)
+    {
+      gksu_dbus_gksu2_call_write_input(priv->server_bytes, priv->cookie, chunk->bytes,
+                                       NULL,
+                                       (GAsyncReadyCallback)gksu_process_input_written_cb,
+                                       chunk);
+      return;
+    }
 
-  return retdata;
+  /* old servers take strings, which must be UTF-8 and can't hold NUL
+   * bytes; we send what we can */
+  bytes = g_variant_get_fixed_array(chunk->bytes, &length, 1);
+  if(!g_utf8_validate(bytes, length, &valid_end))
+    g_warning("The server can only take text as input; dropping %" G_GSIZE_FORMAT
+              " bytes.", length - (valid_end - bytes));
+
+  string = g_strndup(bytes, valid_end - bytes);
+  gksu_dbus_gksu_call_write_input(priv->server, priv->cookie,
+                                  string, (guint64)strlen(string), NULL,
+                                  (GAsyncReadyCallback)gksu_process_input_written_cb,
+                                  chunk);
+  g_free(string);
 }
 
-static void
-gksu_process_close_server_fd(GksuProcess *self, guint fd)
+static gboolean
+gksu_process_stdin_ready_to_send_cb(GIOChannel *channel, GIOCondition condition,
+                                    GksuProcess *self)
 {
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
-  GError *error = NULL;
 
-  dbus_g_proxy_call(priv->server, "CloseFD", &error,
-                    G_TYPE_UINT, priv->cookie,
-                    G_TYPE_INT, fd,
-                    G_TYPE_INVALID,
-                    G_TYPE_INVALID);
-
-  if(error)
+  /* with the window full we stop watching the pipe, which leaves the
+   * application blocked on it until the server catches up */
+  if(gksu_process_stdin_pump(self))
     {
-      g_warning("%s", error->message);
-      g_error_free(error);
+      priv->stdin_source_id = 0;
+      return FALSE;
     }
+
+  return TRUE;
 }
 
 static gboolean
@@ -453,82 +1422,157 @@ gksu_process_stdin_mirror_hangup_cb(GIOChannel *channel, GIOCondition condition,
                                     GksuProcess *self)
 {
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
-  GError *error = NULL;
 
   if((condition == G_IO_HUP) || (condition == G_IO_NVAL))
     {
-      gksu_process_close_server_fd(self, 0);
-      g_source_remove(priv->stdin_source_id);
-      g_io_channel_shutdown(priv->stdin_channel, TRUE, &error);
-      if(error)
+      if(priv->stdin_source_id)
         {
-          g_warning("%s", error->message);
-          g_error_free(error);
+          g_source_remove(priv->stdin_source_id);
+          priv->stdin_source_id = 0;
         }
+
+      /* whatever the application wrote before closing must still
+       * reach the child; the replies drive the rest of it */
+      priv->stdin_closing = TRUE;
+      if(!gksu_process_stdin_pump(self) && (priv->input_in_flight == 0))
+        gksu_process_stdin_finish_close(self);
     }
 
+  priv->stdin_mirror_id = 0;
   return FALSE;
 }
 
-static gboolean
-gksu_process_stdout_mirror_hangup_cb(GIOChannel *channel, GIOCondition condition,
-                                     GksuProcess *self)
+/*
+ * Turns the environment into what D-Bus wants; unset variables have
+ * no value to be sent.
+ */
+static GVariant*
+gksu_process_environment_to_variant(GHashTable *environment)
 {
-  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
-  GError *error = NULL;
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
 
-  if((condition == G_IO_HUP) || (condition == G_IO_NVAL))
+  g_variant_builder_init(&builder, G_VARIANT_TYPE("a{ss}"));
+
+  g_hash_table_iter_init(&iter, environment);
+  while(g_hash_table_iter_next(&iter, &key, &value))
     {
-      gksu_process_close_server_fd(self, 1);
-      g_io_channel_shutdown(priv->stdout_channel, TRUE, &error);
-      if(error)
-        {
-          g_warning("%s", error->message);
-          g_error_free(error);
-        }
+      if(value == NULL)
+        continue;
+
+      g_variant_builder_add(&builder, "{ss}", key, value);
     }
 
-  return FALSE;
+  return g_variant_builder_end(&builder);
 }
 
+/*
+ * Tries the SpawnWithFDs method, which hands us the child's own pipe
+ * ends, so that no data has to be relayed through the bus. If the
+ * server or the bus connection do not support fd passing,
+ * @unsupported is set to %TRUE and nothing is done, so that the caller
+ * can fall back to the relaying Spawn.
+ */
 static gboolean
-gksu_process_stderr_mirror_hangup_cb(GIOChannel *channel, GIOCondition condition,
-                                     GksuProcess *self)
+gksu_process_spawn_with_fds(GksuProcess *self, const gchar *xauth,
+                            GHashTable *environment, gint *standard_input,
+                            gint *standard_output, gint *standard_error,
+                            gboolean *unsupported, GError **error)
 {
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
-  GError *error = NULL;
+  GError *internal_error = NULL;
+  GUnixFDList *fd_list = NULL;
+  GVariant *fds = NULL;
+  GVariantIter iter;
+  gint *std_fds[3] = { standard_input, standard_output, standard_error };
+  gint std_fd;
+  gint handle;
+  gint i;
+  gint pid;
+  guint cookie;
 
-  if((condition == G_IO_HUP) || (condition == G_IO_NVAL))
+  *unsupported = FALSE;
+
+  if(!(g_dbus_connection_get_capabilities(priv->connection) &
+       G_DBUS_CAPABILITY_FLAGS_UNIX_FD_PASSING))
     {
-      gksu_process_close_server_fd(self, 2);
-      g_io_channel_shutdown(priv->stderr_channel, TRUE, &error);
-      if(error)
+      *unsupported = TRUE;
+      return FALSE;
+    }
+
+  if(xauth == NULL)
+    xauth = "";
+
+  gksu_dbus_gksu_call_spawn_with_fds_sync(priv->server,
+                                          priv->working_directory, xauth,
+                                          (const gchar *const *)priv->arguments,
+                                          gksu_process_environment_to_variant(environment),
+                                          standard_input != NULL,
+                                          standard_output != NULL,
+                                          standard_error != NULL,
+                                          NULL, &pid, &cookie, &fds, &fd_list,
+                                          NULL, &internal_error);
+
+  if(internal_error)
+    {
+      if(is_unknown_method_error(internal_error))
         {
-          g_warning("%s", error->message);
-          g_error_free(error);
+          *unsupported = TRUE;
+          g_error_free(internal_error);
+        }
+      else
+        {
+          g_dbus_error_strip_remote_error(internal_error);
+          g_propagate_error(error, internal_error);
         }
+      return FALSE;
     }
 
-  return FALSE;
-}
+  priv->pid = pid;
+  priv->cookie = cookie;
 
-static gboolean
-gksu_process_stdin_ready_to_send_cb(GIOChannel *channel, GIOCondition condition,
-                                    GksuProcess *self)
-{
-  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
-  gsize length;
-  gchar *data;
-  GError *error = NULL;
+  for(std_fd = 0; std_fd < 3; std_fd++)
+    if(std_fds[std_fd])
+      *(std_fds[std_fd]) = -1;
+
+  g_variant_iter_init(&iter, fds);
+  while(g_variant_iter_next(&iter, "{ih}", &std_fd, &handle))
+    {
+      /* the descriptor we get here is our own, already duplicated */
+      gint fd = g_unix_fd_list_get(fd_list, handle, NULL);
+
+      if(fd == -1)
+        continue;
+
+      if((std_fd >= 0) && (std_fd < 3) && (std_fds[std_fd] != NULL) &&
+         (*(std_fds[std_fd]) == -1))
+        *(std_fds[std_fd]) = fd;
+      else
+        close(fd);
+    }
+
+  g_variant_unref(fds);
+  if(fd_list)
+    g_object_unref(fd_list);
+
+  /* the child is running already; closing what we did get leaves it
+   * with a broken pipe, rather than one nobody will ever touch */
+  for(std_fd = 0; std_fd < 3; std_fd++)
+    if(std_fds[std_fd] && (*(std_fds[std_fd]) == -1))
+      {
+        for(i = 0; i < 3; i++)
+          if(std_fds[i] && (*(std_fds[i]) != -1))
+            {
+              close(*(std_fds[i]));
+              *(std_fds[i]) = -1;
+            }
+
+        g_set_error(error, GKSU_PROCESS_ERROR, GKSU_PROCESS_ERROR_DBUS,
+                    "The server did not pass file descriptor %d.", std_fd);
+        return FALSE;
+      }
 
-  data = read_all_from_channel(channel, &length);
-  dbus_g_proxy_call(priv->server, "WriteInput", &error,
-                    G_TYPE_UINT, priv->cookie,
-                    G_TYPE_STRING, data,
-                    G_TYPE_UINT64, (guint64)length,
-                    G_TYPE_INVALID,
-                    G_TYPE_INVALID);
-  g_free(data);
   return TRUE;
 }
 
@@ -580,14 +1624,18 @@ gksu_process_new(const gchar *working_directory, const gchar **arguments)
  * created. You need to connect to the GksuProcess::exited signal to
  * know that the process has ended and get its exit status.
  *
- * Notice that some caveats exist in how the input and output are
- * handled. Gksu PolicyKit uses a D-Bus service to do the actual
- * running of the program, and all the input must be sent to and all
- * the output must be received from this service, through D-Bus. The
- * library handles this, but it needs a glib main loop for that. This
- * means that if you keep the mainloop from running by using a loop to
- * read the standard output, for example, you may end up not having
- * anything to read.
+ * Gksu PolicyKit uses a D-Bus service to do the actual running of the
+ * program. When both the service and the bus support passing file
+ * descriptors, the ones you get are the child's own pipes, and no
+ * data goes through D-Bus at all.
+ *
+ * Otherwise some caveats exist in how the input and output are
+ * handled: all the input must be sent to and all the output must be
+ * received from this service, through D-Bus. The library handles
+ * this, but it needs a glib main loop for that. This means that if
+ * you keep the mainloop from running by using a loop to read the
+ * standard output, for example, you may end up not having anything
+ * to read.
  *
  * Returns: %FALSE if @error is set, %TRUE if all went well
  */
@@ -601,9 +1649,10 @@ gksu_process_spawn_async_with_pipes(GksuProcess *self, gint *standard_input,
 
   GksuEnvironment *gksu_environment;
   GHashTable *environment;
-  gchar *xauth = get_xauth_token(NULL);
+  gchar *xauth = get_xauth_token();
   gint pid;
-  guint32 cookie;
+  guint cookie;
+  gboolean fds_unsupported;
 
   /* startup notification; we do this check because we may recursively
    * call this function, so it needs to be idempotent */
@@ -623,23 +1672,40 @@ gksu_process_spawn_async_with_pipes(GksuProcess *self, gint *standard_input,
   environment = gksu_environment_get_variables(gksu_environment);
   g_object_unref(gksu_environment);
 
-  dbus_g_proxy_call(priv->server, "Spawn", &internal_error,
-                    G_TYPE_STRING, priv->working_directory,
-                    G_TYPE_STRING, xauth,
-                    G_TYPE_STRV, priv->arguments,
-                    DBUS_TYPE_G_STRING_STRING_HASHTABLE, environment,
-                    G_TYPE_BOOLEAN, standard_input != NULL,
-                    G_TYPE_BOOLEAN, standard_output != NULL,
-                    G_TYPE_BOOLEAN, standard_error != NULL,
-                    G_TYPE_INVALID,
-                    G_TYPE_INT, &pid,
-                    G_TYPE_UINT, &cookie,
-                    G_TYPE_INVALID);
+  /* if we can get hold of the child's own pipes there is nothing to
+   * relay, and we are done */
+  if(gksu_process_spawn_with_fds(self, xauth, environment, standard_input,
+                                 standard_output, standard_error,
+                                 &fds_unsupported, &internal_error))
+    {
+      g_hash_table_destroy(environment);
+      g_free(xauth);
+      gksu_process_attach(self, FALSE);
+      return TRUE;
+    }
+
+  if(!fds_unsupported)
+    {
+      g_hash_table_destroy(environment);
+      g_free(xauth);
+      g_propagate_error(error, internal_error);
+      return FALSE;
+    }
+
+  gksu_dbus_gksu_call_spawn_sync(priv->server,
+                                 priv->working_directory, xauth ? xauth : "",
+                                 (const gchar *const *)priv->arguments,
+                                 gksu_process_environment_to_variant(environment),
+                                 standard_input != NULL,
+                                 standard_output != NULL,
+                                 standard_error != NULL,
+                                 &pid, &cookie, NULL, &internal_error);
   g_hash_table_destroy(environment);
   g_free(xauth);
 
   if(internal_error)
     {
+      g_dbus_error_strip_remote_error(internal_error);
       g_propagate_error(error, internal_error);
       return FALSE;
     }
@@ -682,6 +1748,13 @@ gksu_process_spawn_async_with_pipes(GksuProcess *self, gint *standard_input,
 
       priv->stdout_write_queue =
         gksu_write_queue_new(priv->stdout_channel);
+      gksu_write_queue_set_watermarks(priv->stdout_write_queue,
+                                      priv->output_low_watermark,
+                                      priv->output_high_watermark);
+      g_signal_connect(priv->stdout_write_queue, "full",
+                       G_CALLBACK(gksu_process_queue_full_cb), self);
+      g_signal_connect(priv->stdout_write_queue, "drained",
+                       G_CALLBACK(gksu_process_queue_drained_cb), self);
     }
 
   if(standard_error)
@@ -699,11 +1772,81 @@ gksu_process_spawn_async_with_pipes(GksuProcess *self, gint *standard_input,
 
       priv->stderr_write_queue =
         gksu_write_queue_new(priv->stderr_channel);
+      gksu_write_queue_set_watermarks(priv->stderr_write_queue,
+                                      priv->output_low_watermark,
+                                      priv->output_high_watermark);
+      g_signal_connect(priv->stderr_write_queue, "full",
+                       G_CALLBACK(gksu_process_queue_full_cb), self);
+      g_signal_connect(priv->stderr_write_queue, "drained",
+                       G_CALLBACK(gksu_process_queue_drained_cb), self);
     }
 
+  /* we are going to relay data, so take it off the bus if we can,
+   * and have the output pushed to us once we know where it goes */
+  priv->start_streaming = (standard_output || standard_error);
+  gksu_process_attach(self, TRUE);
+
   return TRUE;
 }
 
+/**
+ * gksu_process_set_input_window
+ * @self: a #GksuProcess instance
+ * @chunk_size: maximum number of bytes sent in one go
+ * @max_in_flight: number of chunks that may be on their way at once
+ *
+ * When the child's input goes through D-Bus (see
+ * gksu_process_spawn_async_with_pipes()), what the application
+ * writes is sent to the server in chunks of at most @chunk_size
+ * bytes, without waiting for each one to be acknowledged before
+ * sending the next, as long as no more than @max_in_flight of them
+ * are pending. Larger values help when the bus has a long round
+ * trip; the data still reaches the child in the order it was
+ * written.
+ *
+ * The defaults are 64 KiB and 4 chunks.
+ *
+ * Since: 0.0.3
+ */
+void
+gksu_process_set_input_window(GksuProcess *self, gsize chunk_size,
+                              guint max_in_flight)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  priv->input_chunk_size = MAX(chunk_size, 1);
+  priv->input_max_in_flight = MAX(max_in_flight, 1);
+}
+
+/**
+ * gksu_process_set_output_watermarks
+ * @self: a #GksuProcess instance
+ * @low: number of bytes
+ * @high: number of bytes, or 0
+ *
+ * When the child's output goes through D-Bus (see
+ * gksu_process_spawn_async_with_pipes()), the library holds what the
+ * application has not yet read from its end of the pipes. Once more
+ * than @high bytes are being held for one of them, the library stops
+ * taking output from the server, which in turn stops reading from
+ * the child, until the application reads enough of it to get down to
+ * @low bytes. Passing 0 as @high lets the output pile up without
+ * limit.
+ *
+ * This must be called before the process is spawned; the defaults
+ * are 256 KiB and 1 MiB.
+ *
+ * Since: 0.0.3
+ */
+void
+gksu_process_set_output_watermarks(GksuProcess *self, gsize low, gsize high)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  priv->output_low_watermark = low;
+  priv->output_high_watermark = high;
+}
+
 /**
  * gksu_process_spawn_async
  * @self: a #GksuProcess instance
@@ -726,6 +1869,192 @@ gksu_process_spawn_async(GksuProcess *self, GError **error)
   return gksu_process_spawn_async_with_pipes(self, NULL, NULL, NULL, error);
 }
 
+/*
+ * SpawnMany for servers that don't have it: one Spawn per process.
+ */
+static gboolean
+gksu_process_spawn_each(GksuProcess **processes, guint n_processes, GError **error)
+{
+  GError *first_error = NULL;
+  guint failed = 0;
+  guint i;
+
+  for(i = 0; i < n_processes; i++)
+    {
+      GError *internal_error = NULL;
+
+      if(gksu_process_spawn_async(processes[i], &internal_error))
+        continue;
+
+      failed++;
+      if(first_error == NULL)
+        first_error = internal_error;
+      else
+        g_error_free(internal_error);
+    }
+
+  if(first_error == NULL)
+    return TRUE;
+
+  g_set_error(error, first_error->domain, first_error->code,
+              "%u of %u commands could not be started: %s",
+              failed, n_processes, first_error->message);
+  g_error_free(first_error);
+
+  return FALSE;
+}
+
+/**
+ * gksu_process_spawn_many
+ * @processes: an array of #GksuProcess instances
+ * @n_processes: the number of elements in @processes
+ * @error: return location for a #GError
+ *
+ * Creates all the processes in @processes, as
+ * gksu_process_spawn_async() would, but with a single request to the
+ * service, so that the user is asked for authorization only once and
+ * the cost of going through D-Bus and PolicyKit is not paid for each
+ * one. This is meant for launching many short commands in a row.
+ *
+ * A command that can't be started does not keep the others from
+ * being started. If any of them failed, @error is set to describe the
+ * first failure and %FALSE is returned; you can tell which were
+ * started with gksu_process_get_pid(). Those that were will emit
+ * GksuProcess::exited as usual.
+ *
+ * Since: 0.0.3
+ *
+ * Returns: %FALSE if @error is set, %TRUE if all went well
+ */
+gboolean
+gksu_process_spawn_many(GksuProcess **processes, guint n_processes, GError **error)
+{
+  GksuProcessPrivate *priv;
+  GksuEnvironment *gksu_environment;
+  GHashTable *environment;
+  GVariantBuilder commands;
+  GVariant *results = NULL;
+  GVariantIter iter;
+  GError *internal_error = NULL;
+  gchar *xauth;
+  gchar *first_failure = NULL;
+  const gchar *message;
+  guint failed = 0;
+  guint32 cookie;
+  gint pid;
+  guint i;
+
+  g_return_val_if_fail((processes != NULL) || (n_processes == 0), FALSE);
+
+  if(n_processes == 0)
+    return TRUE;
+
+  g_variant_builder_init(&commands, G_VARIANT_TYPE("a(sasa{ss}bbb)"));
+  for(i = 0; i < n_processes; i++)
+    {
+      GVariantBuilder overrides;
+
+      priv = GKSU_PROCESS_GET_PRIVATE(processes[i]);
+
+      if(!sn_launcher_context_get_initiated(priv->sn_context))
+        {
+          sn_launcher_context_set_description(priv->sn_context,
+                                              priv->arguments[0]);
+          sn_launcher_context_set_name(priv->sn_context,
+                                       priv->arguments[0]);
+          gksu_process_launch_initiate(processes[i]);
+        }
+
+      /* the startup id is the only thing that differs between the
+       * processes' environments */
+      g_variant_builder_init(&overrides, G_VARIANT_TYPE("a{ss}"));
+      if(priv->sn_id)
+        g_variant_builder_add(&overrides, "{ss}", "DESKTOP_STARTUP_ID", priv->sn_id);
+
+      g_variant_builder_add(&commands, "(s^as@a{ss}bbb)",
+                            priv->working_directory, priv->arguments,
+                            g_variant_builder_end(&overrides),
+                            FALSE, FALSE, FALSE);
+    }
+
+  gksu_environment = gksu_environment_new();
+  environment = gksu_environment_get_variables(gksu_environment);
+  g_object_unref(gksu_environment);
+  xauth = get_xauth_token();
+
+  priv = GKSU_PROCESS_GET_PRIVATE(processes[0]);
+  gksu_dbus_gksu_call_spawn_many_sync(priv->server, xauth ? xauth : "",
+                                      gksu_process_environment_to_variant(environment),
+                                      g_variant_builder_end(&commands),
+                                      &results, NULL, &internal_error);
+  g_hash_table_destroy(environment);
+  g_free(xauth);
+
+  if(internal_error)
+    {
+      if(is_unknown_method_error(internal_error))
+        {
+          g_error_free(internal_error);
+          return gksu_process_spawn_each(processes, n_processes, error);
+        }
+
+      g_dbus_error_strip_remote_error(internal_error);
+      g_propagate_error(error, internal_error);
+      return FALSE;
+    }
+
+  i = 0;
+  g_variant_iter_init(&iter, results);
+  while((i < n_processes) &&
+        g_variant_iter_next(&iter, "(iu&s)", &pid, &cookie, &message))
+    {
+      GksuProcess *process = processes[i++];
+
+      if(*message != '\0')
+        {
+          failed++;
+          if(first_failure == NULL)
+            first_failure = g_strdup(message);
+          continue;
+        }
+
+      priv = GKSU_PROCESS_GET_PRIVATE(process);
+      priv->pid = pid;
+      priv->cookie = cookie;
+      /* this only sends the GetProcess calls; the replies are dealt
+       * with as they come, so the batch still costs one round trip */
+      gksu_process_attach(process, FALSE);
+    }
+  g_variant_unref(results);
+
+  if(failed == 0)
+    return TRUE;
+
+  g_set_error(error, GKSU_PROCESS_ERROR, GKSU_PROCESS_ERROR_DBUS,
+              "%u of %u commands could not be started: %s",
+              failed, n_processes, first_failure);
+  g_free(first_failure);
+
+  return FALSE;
+}
+
+/**
+ * gksu_process_get_pid
+ * @self: a #GksuProcess instance
+ *
+ * Since: 0.0.3
+ *
+ * Returns: the process ID of the child, or 0 if it has not been
+ * started
+ */
+gint
+gksu_process_get_pid(GksuProcess *self)
+{
+  GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
+
+  return priv->pid;
+}
+
 typedef struct
 {
   GMainLoop *loop;
@@ -807,14 +2136,16 @@ gksu_process_send_signal(GksuProcess *self, gint signum, GError **error)
   GksuProcessPrivate *priv = GKSU_PROCESS_GET_PRIVATE(self);
   GError *internal_error = NULL;
 
-  dbus_g_proxy_call(priv->server, "SendSignal", &internal_error,
-                    G_TYPE_UINT, priv->cookie,
-                    G_TYPE_INT, signum,
-                    G_TYPE_INVALID,
-                    G_TYPE_INVALID);
+  if(priv->channel_proxy)
+    gksu_dbus_gksu_process_call_send_signal_sync(priv->channel_proxy, signum,
+                                                 NULL, &internal_error);
+  else
+    gksu_dbus_gksu_call_send_signal_sync(priv->server, priv->cookie, signum,
+                                         NULL, &internal_error);
 
   if(internal_error)
     {
+      g_dbus_error_strip_remote_error(internal_error);
       g_propagate_error(error, internal_error);
       return FALSE;
     }
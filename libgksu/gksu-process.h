@@ -45,10 +45,19 @@ GksuProcess* gksu_process_new(const gchar *working_directory, const gchar **argu
 gboolean gksu_process_spawn_async_with_pipes(GksuProcess *process, gint *standard_input,
                                              gint *standard_output, gint *standard_error,
                                              GError **error);
+void gksu_process_set_input_window(GksuProcess *process, gsize chunk_size,
+                                   guint max_in_flight);
+void gksu_process_set_output_watermarks(GksuProcess *process, gsize low, gsize high);
+
 gboolean gksu_process_spawn_async(GksuProcess *process, GError **error);
 
 gboolean gksu_process_spawn_sync(GksuProcess *process, gint *status, GError **error);
 
+gboolean gksu_process_spawn_many(GksuProcess **processes, guint n_processes,
+                                 GError **error);
+
+gint gksu_process_get_pid(GksuProcess *process);
+
 gboolean gksu_process_send_signal(GksuProcess *process, gint signum, GError **error);
 
 #endif
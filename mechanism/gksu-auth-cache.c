@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+
+#include <glib-object.h>
+
+#include "gksu-auth-cache.h"
+
+/*
+ * Remembers, for a little while, that PolicyKit said yes to a subject
+ * for an action, so that a client spawning one command after another
+ * does not wait on PolicyKit for each of them. Only answers PolicyKit
+ * itself would give again without asking anybody are kept: the server
+ * decides that, we only keep time. The subjects are unique bus names,
+ * which are never reused, so an entry can't outlive its client into
+ * another one.
+ *
+ * There is no locking: lookups expire entries as they go, so the
+ * cache must only be used from one thread, the server's main loop.
+ */
+
+G_DEFINE_TYPE(GksuAuthCache, gksu_auth_cache, G_TYPE_OBJECT);
+
+struct _GksuAuthCachePrivate {
+  /* "subject\naction" -> expiry, in monotonic microseconds */
+  GHashTable *entries;
+  gint64 ttl;
+};
+
+#define GKSU_AUTH_CACHE_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_AUTH_CACHE, GksuAuthCachePrivate))
+
+static void gksu_auth_cache_finalize(GObject *object)
+{
+  GksuAuthCache *self = GKSU_AUTH_CACHE(object);
+
+  g_hash_table_destroy(self->priv->entries);
+
+  G_OBJECT_CLASS(gksu_auth_cache_parent_class)->finalize(object);
+}
+
+static void gksu_auth_cache_class_init(GksuAuthCacheClass *klass)
+{
+  G_OBJECT_CLASS(klass)->finalize = gksu_auth_cache_finalize;
+
+  g_type_class_add_private(klass, sizeof(GksuAuthCachePrivate));
+}
+
+static void gksu_auth_cache_init(GksuAuthCache *self)
+{
+  GksuAuthCachePrivate *priv = GKSU_AUTH_CACHE_GET_PRIVATE(self);
+  self->priv = priv;
+
+  priv->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/*
+ * @ttl is how many seconds an answer is trusted for; 0 turns the
+ * cache off.
+ */
+GksuAuthCache* gksu_auth_cache_new(guint ttl)
+{
+  GksuAuthCache *self = g_object_new(GKSU_TYPE_AUTH_CACHE, NULL);
+
+  self->priv->ttl = (gint64)ttl * G_USEC_PER_SEC;
+
+  return self;
+}
+
+void gksu_auth_cache_set_ttl(GksuAuthCache *self, guint ttl)
+{
+  self->priv->ttl = (gint64)ttl * G_USEC_PER_SEC;
+
+  /* entries made under a longer ttl must not outlive the new one */
+  g_hash_table_remove_all(self->priv->entries);
+}
+
+static gchar* gksu_auth_cache_make_key(const gchar *subject, const gchar *action)
+{
+  return g_strconcat(subject, "\n", action, NULL);
+}
+
+static gboolean gksu_auth_cache_is_expired_cb(gpointer key, gint64 *expiry, gint64 *now)
+{
+  return *expiry <= *now;
+}
+
+gboolean gksu_auth_cache_lookup(GksuAuthCache *self, const gchar *subject,
+                                const gchar *action)
+{
+  GksuAuthCachePrivate *priv = self->priv;
+  gint64 *expiry;
+  gchar *key;
+  gboolean valid = FALSE;
+
+  if(subject == NULL)
+    return FALSE;
+
+  key = gksu_auth_cache_make_key(subject, action);
+  expiry = g_hash_table_lookup(priv->entries, key);
+  if(expiry != NULL)
+    {
+      valid = (*expiry > g_get_monotonic_time());
+      if(!valid)
+        g_hash_table_remove(priv->entries, key);
+    }
+  g_free(key);
+
+  return valid;
+}
+
+void gksu_auth_cache_insert(GksuAuthCache *self, const gchar *subject,
+                            const gchar *action)
+{
+  GksuAuthCachePrivate *priv = self->priv;
+  gint64 now = g_get_monotonic_time();
+  gint64 *expiry;
+
+  if((priv->ttl == 0) || (subject == NULL))
+    return;
+
+  /* clients come and go without telling us; their entries are
+   * dropped here once they are stale, so the table stays small */
+  g_hash_table_foreach_remove(priv->entries,
+                              (GHRFunc)gksu_auth_cache_is_expired_cb, &now);
+
+  expiry = g_new(gint64, 1);
+  *expiry = now + priv->ttl;
+  g_hash_table_replace(priv->entries, gksu_auth_cache_make_key(subject, action), expiry);
+}
+
+static gboolean gksu_auth_cache_has_subject_cb(const gchar *key, gpointer value,
+                                               const gchar *subject)
+{
+  gsize length = strlen(subject);
+
+  return (strncmp(key, subject, length) == 0) && (key[length] == '\n');
+}
+
+/*
+ * Forgets what we know about @subject, or about everybody if @subject
+ * is %NULL.
+ */
+void gksu_auth_cache_invalidate(GksuAuthCache *self, const gchar *subject)
+{
+  GksuAuthCachePrivate *priv = self->priv;
+
+  if(subject == NULL)
+    {
+      g_hash_table_remove_all(priv->entries);
+      return;
+    }
+
+  g_hash_table_foreach_remove(priv->entries,
+                              (GHRFunc)gksu_auth_cache_has_subject_cb,
+                              (gpointer)subject);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GKSU_AUTH_CACHE_H__
+#define __GKSU_AUTH_CACHE_H__ 1
+
+#include <glib-object.h>
+
+typedef struct _GksuAuthCachePrivate GksuAuthCachePrivate;
+
+typedef struct {
+  GObject parent;
+  GksuAuthCachePrivate *priv;
+} GksuAuthCache;
+
+typedef struct {
+  GObjectClass parent;
+} GksuAuthCacheClass;
+
+GType gksu_auth_cache_get_type(void);
+
+#define GKSU_TYPE_AUTH_CACHE (gksu_auth_cache_get_type())
+#define GKSU_AUTH_CACHE(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GKSU_TYPE_AUTH_CACHE, GksuAuthCache))
+#define GKSU_AUTH_CACHE_GET_CLASS(object)  (G_TYPE_INSTANCE_GET_CLASS ((object), GKSU_TYPE_AUTH_CACHE, GksuAuthCacheClass))
+
+GksuAuthCache* gksu_auth_cache_new(guint ttl);
+
+void gksu_auth_cache_set_ttl(GksuAuthCache *self, guint ttl);
+
+gboolean gksu_auth_cache_lookup(GksuAuthCache *self, const gchar *subject,
+                                const gchar *action);
+
+void gksu_auth_cache_insert(GksuAuthCache *self, const gchar *subject,
+                            const gchar *action);
+
+void gksu_auth_cache_invalidate(GksuAuthCache *self, const gchar *subject);
+
+#endif
@@ -26,26 +26,31 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 
 #include <glib-object.h>
-#include <dbus/dbus-glib.h>
-#include <dbus/dbus-glib-lowlevel.h>
-#include <dbus/dbus.h>
+#include <gio/gio.h>
 
 #include <gksu-environment.h>
 #include <gksu-error.h>
+#include <gksu-marshal.h>
+#include <gksu-write-queue.h>
+#include <gksu-xauth.h>
 
 #include "gksu-controller.h"
+#include "gksu-launcher.h"
 
 G_DEFINE_TYPE(GksuController, gksu_controller, G_TYPE_OBJECT);
 
 struct _GksuControllerPrivate {
-  DBusGConnection *dbus;
   gchar *working_directory;
   gchar **arguments;
   gchar *xauth_file;
   gint pid;
 
+  /* what gksu_controller_prepare_async() got ready, until the fork */
+  gchar **environmentv;
+
   /* this integer is an authentication cookie we use to do calls to
    * control a process after Spawn; it is generated by GksuServer */
   guint32 cookie;
@@ -53,30 +58,101 @@ struct _GksuControllerPrivate {
   GIOChannel *stdin;
   guint stdin_source_id;
 
+  /* input is queued and written as the child reads it, so that a
+   * child which is not reading its stdin can't block the server;
+   * while the queue is full, replies to WriteInput are held back
+   * here, which in turn holds back the client */
+  GksuWriteQueue *stdin_queue;
+  GQueue *input_replies;
+
   GIOChannel *stdout;
   guint stdout_source_id;
 
   GIOChannel *stderr;
   guint stderr_source_id;
+
+  /* the unique bus name of whoever spawned the process; everything
+   * we have to tell about it is sent to that name only */
+  gchar *owner;
+
+  /* when streaming, output is pushed to the owner of the process
+   * instead of being announced and then read by ReadOutput; small
+   * reads are batched to save on bus messages */
+  gboolean streaming;
+  GString *stdout_batch;
+  GString *stderr_batch;
+  guint batch_source_id;
+
+  /* output read for ReadOutput goes here; it is reused for every
+   * read, and grows to whatever the workload needs, up to the budget */
+  GString *read_buffer;
+  gsize read_budget;
+
+  /* share of the server's I/O this process gets when streaming,
+   * relative to the others */
+  guint io_weight;
+
+  /* the client can't keep up; we stop reading, so that the child
+   * blocks on its own pipe */
+  gboolean stdout_paused;
+  gboolean stderr_paused;
+
+  /* how much input and output went through us, for monitoring */
+  guint64 bytes_relayed;
 };
 
+/* how much input we hold for a child before making clients wait */
+#define INPUT_LOW_WATERMARK (256 * 1024)
+#define INPUT_HIGH_WATERMARK (1024 * 1024)
+
+/* how much output is read from a pipe in one go, by default, before
+ * other processes are given their chance */
+#define DEFAULT_READ_BUDGET (256 * 1024)
+
+/* how much we try to read when the kernel can't tell us how much is
+ * pending */
+#define DEFAULT_PIPE_CAPACITY 65536
+
+/* streamed output is sent once this many bytes have been batched, or
+ * when the oldest batched byte is this many milliseconds old */
+#define STREAM_BATCH_SIZE 65536
+#define STREAM_BATCH_DELAY 20
+
 #define GKSU_CONTROLLER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_CONTROLLER, GksuControllerPrivate))
 
 enum {
   PROCESS_EXITED,
   OUTPUT_AVAILABLE,
+  OUTPUT_DATA,
 
   LAST_SIGNAL
 };
 
 static guint signals[LAST_SIGNAL] = {0,};
 
-void gksu_controller_cleanup(GksuController *self)
+/*
+ * Removes the directory made for @xauth_file, and whatever is in it:
+ * the file itself, and whatever xauth or an interrupted atomic write
+ * left behind. The directory is our own, from mkdtemp().
+ */
+static void gksu_controller_remove_xauth_dir(const gchar *xauth_file)
 {
-  GksuControllerPrivate *priv = self->priv;
-  gchar *xauth_dir = g_path_get_dirname(priv->xauth_file);
-  
-  unlink(priv->xauth_file);
+  gchar *xauth_dir = g_path_get_dirname(xauth_file);
+  const gchar *name;
+  GDir *dir;
+
+  dir = g_dir_open(xauth_dir, 0, NULL);
+  if(dir)
+    {
+      while((name = g_dir_read_name(dir)) != NULL)
+        {
+          gchar *path = g_build_filename(xauth_dir, name, NULL);
+
+          unlink(path);
+          g_free(path);
+        }
+      g_dir_close(dir);
+    }
 
   if(rmdir(xauth_dir))
     g_warning("Unable to remove directory %s: %s", xauth_dir,
@@ -85,6 +161,13 @@ void gksu_controller_cleanup(GksuController *self)
   g_free(xauth_dir);
 }
 
+void gksu_controller_cleanup(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  gksu_controller_remove_xauth_dir(priv->xauth_file);
+}
+
 static void gksu_controller_real_process_exited(GksuController *self, gint status)
 {
   gksu_controller_cleanup(self);
@@ -93,34 +176,75 @@ static void gksu_controller_real_process_exited(GksuController *self, gint statu
   g_object_unref(self);
 }
 
+static void gksu_controller_return_input_replies(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GDBusMethodInvocation *invocation;
+
+  while((invocation = g_queue_pop_head(priv->input_replies)) != NULL)
+    g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+static void gksu_controller_stdin_drained_cb(GksuWriteQueue *queue,
+                                             GksuController *self)
+{
+  gksu_controller_return_input_replies(self);
+}
+
 static void gksu_controller_finalize(GObject *object)
 {
   GksuController *self = GKSU_CONTROLLER(object);
   GksuControllerPrivate *priv = self->priv;
 
+  gksu_controller_return_input_replies(self);
+  g_queue_free(priv->input_replies);
+
+  if(priv->stdin_queue)
+    g_object_unref(priv->stdin_queue);
+
   if(priv->stdin)
     {
-      g_source_remove(priv->stdin_source_id);
+      if(priv->stdin_source_id)
+        g_source_remove(priv->stdin_source_id);
       g_io_channel_shutdown(priv->stdin, FALSE, NULL);
       g_io_channel_unref(priv->stdin);
     }
 
   if(priv->stdout)
     {
-      g_source_remove(priv->stdout_source_id);
+      if(priv->stdout_source_id)
+        g_source_remove(priv->stdout_source_id);
       g_io_channel_shutdown(priv->stdout, FALSE, NULL);
       g_io_channel_unref(priv->stdout);
     }
 
   if(priv->stderr)
     {
-      g_source_remove(priv->stderr_source_id);
+      if(priv->stderr_source_id)
+        g_source_remove(priv->stderr_source_id);
       g_io_channel_shutdown(priv->stderr, FALSE, NULL);
       g_io_channel_unref(priv->stderr);
     }
 
+  if(priv->batch_source_id)
+    g_source_remove(priv->batch_source_id);
+
+  if(priv->stdout_batch)
+    g_string_free(priv->stdout_batch, TRUE);
+
+  if(priv->stderr_batch)
+    g_string_free(priv->stderr_batch, TRUE);
+
+  g_string_free(priv->read_buffer, TRUE);
+
+  /* prepared, but never run */
+  if(priv->xauth_file && (priv->pid == 0))
+    gksu_controller_cleanup(self);
+
+  g_free(priv->owner);
   g_free(priv->working_directory);
   g_free(priv->xauth_file);
+  g_strfreev(priv->environmentv);
   g_strfreev(priv->arguments);
 
   G_OBJECT_CLASS(gksu_controller_parent_class)->finalize(object);
@@ -150,6 +274,17 @@ static void gksu_controller_class_init(GksuControllerClass *klass)
                                            G_TYPE_NONE, 1,
                                            G_TYPE_INT);
 
+  signals[OUTPUT_DATA] = g_signal_new("output-data",
+                                      GKSU_TYPE_CONTROLLER,
+                                      G_SIGNAL_RUN_LAST,
+                                      0,
+                                      NULL,
+                                      NULL,
+                                      gksu_marshal_VOID__INT_POINTER,
+                                      G_TYPE_NONE, 2,
+                                      G_TYPE_INT,
+                                      G_TYPE_POINTER);
+
   klass->process_exited = gksu_controller_real_process_exited;
 
   g_type_class_add_private(klass, sizeof(GksuControllerPrivate));
@@ -159,11 +294,21 @@ static void gksu_controller_init(GksuController *self)
 {
   GksuControllerPrivate *priv = GKSU_CONTROLLER_GET_PRIVATE(self);
   self->priv = priv;
+
+  priv->read_buffer = g_string_new("");
+  priv->read_budget = DEFAULT_READ_BUDGET;
+  priv->io_weight = 1;
+  priv->input_replies = g_queue_new();
 }
 
 static void gksu_controller_process_exited_cb(GPid pid, gint status, GksuController *self)
 {
+  /* the server drops the slot's reference to us from its handler,
+   * and the class handler our own; we are still needed until the
+   * emission is over */
+  g_object_ref(self);
   g_signal_emit(self, signals[PROCESS_EXITED], 0, status);
+  g_object_unref(self);
 }
 
 static gboolean gksu_controller_stdin_hangup_cb(GIOChannel *stdin,
@@ -172,12 +317,182 @@ static gboolean gksu_controller_stdin_hangup_cb(GIOChannel *stdin,
 {
   GksuControllerPrivate *priv = self->priv;
 
-  if(condition == G_IO_HUP)
+  priv->stdin_source_id = 0;
+  return FALSE;
+}
+
+/*
+ * Tells how many bytes are waiting to be read from the pipe. If the
+ * kernel can't tell, we assume a full pipe, and let read() sort it
+ * out.
+ */
+static gsize gksu_controller_pending_bytes(gint raw_fd, gboolean *known)
+{
+  gint pending = 0;
+
+  if(ioctl(raw_fd, FIONREAD, &pending) == 0)
     {
-      g_source_remove(priv->stdin_source_id);
-      return FALSE;
+      *known = TRUE;
+      return (pending > 0) ? (gsize)pending : 0;
     }
 
+  *known = FALSE;
+
+#ifdef F_GETPIPE_SZ
+  pending = fcntl(raw_fd, F_GETPIPE_SZ);
+  if(pending > 0)
+    return pending;
+#endif
+
+  return DEFAULT_PIPE_CAPACITY;
+}
+
+/*
+ * Appends output from @raw_fd to @buffer, reading straight into its
+ * spare room, as much as is pending at each step. No more than
+ * @budget bytes are read, unless @budget is 0, which means reading
+ * until the pipe is empty. @more is set if output is still pending
+ * after the budget was used up, and @eof if the child closed its end
+ * of the pipe.
+ */
+static void gksu_controller_fill_buffer(gint raw_fd, GString *buffer, gsize budget,
+                                        gboolean *more, gboolean *eof)
+{
+  gsize total = 0;
+  gboolean known;
+
+  *more = FALSE;
+  *eof = FALSE;
+
+  while((budget == 0) || (total < budget))
+    {
+      gsize old_length = buffer->len;
+      gsize wanted = gksu_controller_pending_bytes(raw_fd, &known);
+      gssize bytes_read;
+
+      /* FIONREAD says 0 both when the pipe is empty and when the
+       * child is gone; a 1-byte read tells them apart */
+      if(wanted == 0)
+        wanted = 1;
+
+      if(budget != 0)
+        wanted = MIN(wanted, budget - total);
+
+      g_string_set_size(buffer, old_length + wanted);
+      bytes_read = read(raw_fd, buffer->str + old_length, wanted);
+
+      if(bytes_read < 0)
+        {
+          g_string_set_size(buffer, old_length);
+
+          if(errno == EINTR)
+            continue;
+
+          if(errno != EAGAIN)
+            {
+              g_warning("Error reading child output: %s", g_strerror(errno));
+              *eof = TRUE;
+            }
+          return;
+        }
+
+      g_string_set_size(buffer, old_length + bytes_read);
+
+      if(bytes_read == 0)
+        {
+          *eof = TRUE;
+          return;
+        }
+
+      total += bytes_read;
+    }
+
+  *more = (gksu_controller_pending_bytes(raw_fd, &known) > 0) || !known;
+}
+
+static void gksu_controller_flush_batches(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  if(priv->batch_source_id)
+    {
+      g_source_remove(priv->batch_source_id);
+      priv->batch_source_id = 0;
+    }
+
+  if(priv->stdout_batch && priv->stdout_batch->len)
+    {
+      /* 1 == stdout */
+      g_signal_emit(self, signals[OUTPUT_DATA], 0, 1, priv->stdout_batch);
+      g_string_truncate(priv->stdout_batch, 0);
+    }
+
+  if(priv->stderr_batch && priv->stderr_batch->len)
+    {
+      /* 2 == stderr */
+      g_signal_emit(self, signals[OUTPUT_DATA], 0, 2, priv->stderr_batch);
+      g_string_truncate(priv->stderr_batch, 0);
+    }
+}
+
+static gboolean gksu_controller_batch_timeout_cb(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  priv->batch_source_id = 0;
+  gksu_controller_flush_batches(self);
+
+  return FALSE;
+}
+
+/*
+ * Reads what is available on the channel into the batch for the
+ * given fd, up to @budget bytes (0 meaning everything), and decides
+ * whether the batch is due to be sent. Returns %FALSE when the child
+ * has closed its end of the pipe.
+ */
+static gboolean gksu_controller_stream_output(GksuController *self, gint fd,
+                                              GIOChannel *channel, gsize budget,
+                                              gboolean *more, gsize *length)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GString *batch = (fd == 1) ? priv->stdout_batch : priv->stderr_batch;
+  gsize old_length = batch->len;
+  gboolean eof;
+
+  gksu_controller_fill_buffer(g_io_channel_unix_get_fd(channel), batch,
+                              budget, more, &eof);
+  *length = batch->len - old_length;
+  priv->bytes_relayed += *length;
+
+  if((batch->len >= STREAM_BATCH_SIZE) || eof || (budget == 0))
+    gksu_controller_flush_batches(self);
+  else if((batch->len > 0) && (priv->batch_source_id == 0))
+    priv->batch_source_id =
+      g_timeout_add(STREAM_BATCH_DELAY,
+                    (GSourceFunc)gksu_controller_batch_timeout_cb,
+                    (gpointer)self);
+
+  return !eof;
+}
+
+static gboolean gksu_controller_output_ready(GksuController *self, gint fd,
+                                             GIOChannel *channel,
+                                             GIOCondition condition,
+                                             guint *source_id)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  /* this watch is added again once the output has been read, by
+   * gksu_controller_read_output or gksu_controller_read_stream */
+  *source_id = 0;
+
+  /* when streaming, the hangup needs to be read as well, so that the
+   * batch gets flushed */
+  if((condition == G_IO_HUP) && !priv->streaming)
+    return FALSE;
+
+  g_signal_emit(self, signals[OUTPUT_AVAILABLE], 0, fd);
   return FALSE;
 }
 
@@ -191,15 +506,9 @@ static gboolean gksu_controller_stdout_ready_to_read_cb(GIOChannel *stdout,
 
   priv = self->priv;
 
-  if(condition == G_IO_HUP)
-    {
-      g_source_remove(priv->stdout_source_id);
-      return FALSE;
-    }
-
   /* 1 == stdout */
-  g_signal_emit(self, signals[OUTPUT_AVAILABLE], 0, 1);
-  return FALSE;
+  return gksu_controller_output_ready(self, 1, stdout, condition,
+                                      &(priv->stdout_source_id));
 }
 
 static gboolean gksu_controller_stderr_ready_to_read_cb(GIOChannel *stderr,
@@ -212,21 +521,41 @@ static gboolean gksu_controller_stderr_ready_to_read_cb(GIOChannel *stderr,
 
   priv = self->priv;
 
-  if(condition == G_IO_HUP)
-    {
-      g_source_remove(priv->stderr_source_id);
-      return FALSE;
-    }
-
   /* 2 == stderr */
-  g_signal_emit(self, signals[OUTPUT_AVAILABLE], 0, 2);
-  return FALSE;
+  return gksu_controller_output_ready(self, 2, stderr, condition,
+                                      &(priv->stderr_source_id));
 }
 
-static gboolean gksu_controller_prepare_xauth(GksuController *self, GHashTable *environment,
-                                              gchar *xauth_token)
+/*
+ * What a spawn needs before the fork: the checked environment, and the
+ * X authority file. Getting it touches the disk and runs xauth, so it
+ * is done by a worker thread; only the worker uses this until the
+ * result is completed.
+ */
+typedef struct {
+  GHashTable *environment;
+  gchar *xauth;
+  gchar *xauth_file;
+  gchar **environmentv;
+} GksuControllerPrepareData;
+
+/* how many spawns may be prepared at the same time; more wait in
+ * the pool's queue */
+#define PREPARE_MAX_THREADS 4
+
+static GThreadPool *prepare_pool = NULL;
+
+static void gksu_controller_prepare_data_free(GksuControllerPrepareData *data)
+{
+  g_hash_table_unref(data->environment);
+  g_free(data->xauth);
+  g_free(data->xauth_file);
+  g_strfreev(data->environmentv);
+  g_slice_free(GksuControllerPrepareData, data);
+}
+
+static gboolean gksu_controller_prepare_xauth(GksuControllerPrepareData *data)
 {
-  GksuControllerPrivate *priv = self->priv;
   gchar *xauth_dirtemplate = g_strdup ("/tmp/" PACKAGE_NAME "-XXXXXX");
   gchar *xauth_bin = NULL;
   gchar *xauth_dir = NULL;
@@ -244,13 +573,29 @@ static gboolean gksu_controller_prepare_xauth(GksuController *self, GHashTable *
   if (!xauth_dir)
     {
       g_warning("Failed creating xauth_dir.\n");
+      g_free(xauth_dirtemplate);
       return FALSE;
     }
 
   xauth_file = g_strdup_printf("%s/.Xauthority", xauth_dir);
   g_free(xauth_dir);
 
-  xauth_display = g_hash_table_lookup(environment, "DISPLAY");
+  xauth_display = g_hash_table_lookup(data->environment, "DISPLAY");
+
+  /* we write the file ourselves when we can, which saves running
+   * xauth; it is still needed for remote displays, whose address it
+   * knows how to resolve */
+  if(gksu_xauth_write_cookie(xauth_file, xauth_display, data->xauth, &error))
+    goto done;
+
+  if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    {
+      g_warning("Failure writing the X authority file: %s\n", error->message);
+      g_error_free(error);
+      goto failed;
+    }
+  g_clear_error(&error);
+
   tmpfilename = g_strdup_printf ("%s.tmp", xauth_file);
 
   /* write a temporary file with a command to add the cookie we have */
@@ -259,10 +604,10 @@ static gboolean gksu_controller_prepare_xauth(GksuController *self, GHashTable *
     {
       g_warning("Error writing temporary auth file: %s\n", tmpfilename);
       g_free(tmpfilename);
-      return FALSE;
+      goto failed;
     }
 
-  xauth_cmd = g_strdup_printf("add %s . %s\n", xauth_display, xauth_token);
+  xauth_cmd = g_strdup_printf("add %s . %s\n", xauth_display, data->xauth);
   fwrite(xauth_cmd, sizeof(gchar), strlen(xauth_cmd), file);
   g_free(xauth_cmd);
   fclose(file);
@@ -275,12 +620,10 @@ static gboolean gksu_controller_prepare_xauth(GksuController *self, GHashTable *
     xauth_bin = "/usr/X11R6/bin/xauth";
   else
     {
-      unlink(tmpfilename);
       g_free(tmpfilename);
       g_warning("Failed to obtain xauth key: xauth binary not found "
                 "at usual locations");
-
-      return FALSE;
+      goto failed;
     }
 
   command = g_strdup_printf("%s -q -f %s source %s", xauth_bin, xauth_file, tmpfilename);
@@ -295,73 +638,30 @@ static gboolean gksu_controller_prepare_xauth(GksuController *self, GHashTable *
     {
       g_warning("Failure running xauth: %s\n", error->message);
       g_error_free(error);
-      return FALSE;
+      goto failed;
     }
 
-  g_hash_table_replace(environment, g_strdup("XAUTHORITY"), g_strdup(xauth_file));
-  priv->xauth_file = xauth_file;
+ done:
+  g_hash_table_replace(data->environment, g_strdup("XAUTHORITY"), g_strdup(xauth_file));
+  data->xauth_file = xauth_file;
 
   return TRUE;
-}
 
-GksuController* gksu_controller_new(gchar *working_directory, gchar **arguments, DBusGConnection *dbus)
-{
-  GksuController *self = g_object_new(GKSU_TYPE_CONTROLLER, NULL);
-  GksuControllerPrivate *priv = self->priv;
-
-  /* FIXME: turn these into real properties */
-  priv->working_directory = g_strdup(working_directory);
-  priv->arguments = g_strdupv(arguments);
-  priv->dbus = dbus;
+ failed:
+  /* nothing of a failed spawn is left in /tmp */
+  gksu_controller_remove_xauth_dir(xauth_file);
+  g_free(xauth_file);
 
-  return self;
+  return FALSE;
 }
 
-GksuController* gksu_controller_run(GksuController *self,
-                                    GHashTable *environment, gchar *xauth,
-                                    gboolean using_stdin, gboolean using_stdout,
-                                    gboolean using_stderr, gint *pid, GError **error)
+static gchar** gksu_controller_build_environment(GHashTable *environment)
 {
-  GksuControllerPrivate *priv = self->priv;
   GList *keys;
   GList *iter;
-  GksuEnvironment *gksu_environment;
   gchar **environmentv;
   gint size = 0;
 
-  GSpawnFlags spawn_flags = G_SPAWN_SEARCH_PATH|G_SPAWN_DO_NOT_REAP_CHILD;
-
-  /* the pointers are just to allow us to only pass in fds in which
-   * our caller is interested */
-  gint *stdin = NULL;
-  gint *stdout = NULL;
-  gint *stderr = NULL;
-  gint stdin_real, stdout_real, stderr_real;
-
-  GError *internal_error = NULL;
-
-  /* first we verify that all variables we were given are OK */
-  gksu_environment = gksu_environment_new();
-  if(!gksu_environment_validate_hash_table(gksu_environment, environment))
-    {
-      g_object_unref(gksu_environment);
-      g_set_error(error, GKSU_ERROR, GKSU_ERROR_INVALID_VARIABLE,
-                  "One or more of the passed variables are not valid.");
-      return NULL;
-    }
-  g_object_unref(gksu_environment);
-
-  /* First we handle xauth, and add the XAUTHORITY variable to the
-   * environment, so that X-based applications will be able to open
-   * their windows */
-  if(!gksu_controller_prepare_xauth(self, environment, xauth))
-    {
-      g_object_unref(self);
-      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PREPARE_XAUTH_FAILED,
-                  "Unable to prepare the X authorization environment.");
-      return NULL;
-    }
-
   environmentv = g_malloc(sizeof(gchar**));
 
   keys = g_hash_table_get_keys(environment);
@@ -379,35 +679,165 @@ GksuController* gksu_controller_run(GksuController *self,
   environmentv = g_realloc(environmentv, sizeof(gchar*) * (size + 1));
   environmentv[size] = NULL;
 
-  /* if we are not using a given FD, it remains set to NULL, and
-   * g_spawn_async_with_pipes handles it correctly
-   */
-  if(using_stdin)
-    stdin = &stdin_real;
+  g_list_free(keys);
 
-  if(using_stdout)
-    stdout = &stdout_real;
-  else
-    spawn_flags |= G_SPAWN_STDOUT_TO_DEV_NULL;
+  return environmentv;
+}
 
-  if(using_stderr)
-    stderr = &stderr_real;
+/*
+ * Runs in one of the pool's threads; the task's callback runs in the
+ * main loop the preparation was asked from, and may look at the data
+ * as soon as the task returns.
+ */
+static void gksu_controller_prepare_thread(GTask *task, gpointer user_data)
+{
+  GksuControllerPrepareData *data = g_task_get_task_data(task);
+  GksuEnvironment *gksu_environment;
+
+  /* first we verify that all variables we were given are OK */
+  gksu_environment = gksu_environment_new();
+  if(!gksu_environment_validate_hash_table(gksu_environment, data->environment))
+    g_task_return_new_error(task, GKSU_ERROR, GKSU_ERROR_INVALID_VARIABLE,
+                            "One or more of the passed variables are not valid.");
+  /* then we handle xauth, and add the XAUTHORITY variable to the
+   * environment, so that X-based applications will be able to open
+   * their windows */
+  else if(!gksu_controller_prepare_xauth(data))
+    g_task_return_new_error(task, GKSU_ERROR, GKSU_ERROR_PREPARE_XAUTH_FAILED,
+                            "Unable to prepare the X authorization environment.");
   else
-    spawn_flags |= G_SPAWN_STDERR_TO_DEV_NULL;
+    {
+      data->environmentv = gksu_controller_build_environment(data->environment);
+      g_task_return_boolean(task, TRUE);
+    }
+  g_object_unref(gksu_environment);
+
+  g_object_unref(task);
+}
 
-  g_spawn_async_with_pipes(priv->working_directory, priv->arguments, environmentv,
-                           spawn_flags, NULL, NULL, pid,
-                           stdin, stdout, stderr, &internal_error);
-  g_strfreev(environmentv);
+GksuController* gksu_controller_new(const gchar *working_directory, gchar **arguments)
+{
+  GksuController *self = g_object_new(GKSU_TYPE_CONTROLLER, NULL);
+  GksuControllerPrivate *priv = self->priv;
 
-  if(internal_error)
+  /* FIXME: turn these into real properties */
+  priv->working_directory = g_strdup(working_directory);
+  priv->arguments = g_strdupv(arguments);
+
+  return self;
+}
+
+/*
+ * Checks @environment and writes the X authority file for the child in
+ * a worker thread, so that the main loop keeps relaying the output of
+ * the other processes meanwhile; @callback is called from the main
+ * loop once done, and gksu_controller_run_async() may then be called.
+ */
+void gksu_controller_prepare_async(GksuController *self, GHashTable *environment,
+                                   const gchar *xauth, GAsyncReadyCallback callback,
+                                   gpointer user_data)
+{
+  GTask *task;
+  GksuControllerPrepareData *data;
+  GError *error = NULL;
+
+  task = g_task_new(self, NULL, callback, user_data);
+  g_task_set_source_tag(task, gksu_controller_prepare_async);
+
+  /* the worker gets a copy of its own */
+  data = g_slice_new0(GksuControllerPrepareData);
+  data->environment = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  if(environment)
     {
-      g_warning("%s\n", internal_error->message);
-      g_propagate_error(error, internal_error);
-      return NULL;
+      GHashTableIter iter;
+      gpointer key, value;
+
+      g_hash_table_iter_init(&iter, environment);
+      while(g_hash_table_iter_next(&iter, &key, &value))
+        g_hash_table_replace(data->environment, g_strdup(key), g_strdup(value));
     }
+  data->xauth = g_strdup(xauth);
+  g_task_set_task_data(task, data, (GDestroyNotify)gksu_controller_prepare_data_free);
 
-  priv->pid = *pid;
+  if(prepare_pool == NULL)
+    prepare_pool = g_thread_pool_new((GFunc)gksu_controller_prepare_thread, NULL,
+                                     PREPARE_MAX_THREADS, FALSE, &error);
+
+  /* the callback still gets called, from an idle, so the spawn gets
+   * its reply and its slot is freed */
+  if((prepare_pool == NULL) || !g_thread_pool_push(prepare_pool, task, &error))
+    {
+      g_prefix_error(&error, "Unable to start a thread to prepare the spawn: ");
+      g_task_return_error(task, error);
+      g_object_unref(task);
+    }
+}
+
+typedef struct {
+  gboolean using_stdin;
+  gboolean using_stdout;
+  gboolean using_stderr;
+} GksuControllerRunData;
+
+static void gksu_controller_run_data_free(GksuControllerRunData *data)
+{
+  g_slice_free(GksuControllerRunData, data);
+}
+
+gboolean gksu_controller_prepare_finish(GksuController *self, GAsyncResult *result,
+                                        GError **error)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GksuControllerPrepareData *data;
+
+  g_return_val_if_fail(g_task_is_valid(result, self), FALSE);
+
+  if(!g_task_propagate_boolean(G_TASK(result), error))
+    return FALSE;
+
+  data = g_task_get_task_data(G_TASK(result));
+
+  priv->xauth_file = data->xauth_file;
+  data->xauth_file = NULL;
+
+  priv->environmentv = data->environmentv;
+  data->environmentv = NULL;
+
+  return TRUE;
+}
+
+static void gksu_controller_spawned_cb(GObject *source, GAsyncResult *result,
+                                      GTask *task)
+{
+  GksuController *self = g_task_get_source_object(task);
+  GksuControllerPrivate *priv = self->priv;
+  GksuControllerRunData *data = g_task_get_task_data(task);
+
+  /* the pointers are just to allow us to only pass in fds in which
+   * our caller is interested */
+  gint *stdin = NULL;
+  gint *stdout = NULL;
+  gint *stderr = NULL;
+  gint stdin_real, stdout_real, stderr_real;
+
+  GError *error = NULL;
+
+  if(data->using_stdin)
+    stdin = &stdin_real;
+
+  if(data->using_stdout)
+    stdout = &stdout_real;
+
+  if(data->using_stderr)
+    stderr = &stderr_real;
+
+  if(!gksu_launcher_spawn_finish(result, stdin, stdout, stderr, &(priv->pid), &error))
+    {
+      g_warning("%s\n", error->message);
+      g_task_return_error(task, error);
+      g_object_unref(task);
+      return;
+    }
 
   /* these conditions are here so that we don't waste resources on fds
    * in which our caller is not interested
@@ -415,12 +845,20 @@ GksuController* gksu_controller_run(GksuController *self,
   if(stdin)
     {
       priv->stdin = g_io_channel_unix_new(stdin_real);
+      g_io_channel_set_flags(priv->stdin, G_IO_FLAG_NONBLOCK, NULL);
       g_io_channel_set_encoding(priv->stdin, NULL, NULL);
       g_io_channel_set_buffered(priv->stdin, FALSE);
       priv->stdin_source_id = 
         g_io_add_watch(priv->stdin, G_IO_HUP|G_IO_NVAL,
                        (GIOFunc)gksu_controller_stdin_hangup_cb,
                        (gpointer)self);
+
+      priv->stdin_queue = gksu_write_queue_new(priv->stdin);
+      gksu_write_queue_set_watermarks(priv->stdin_queue,
+                                      INPUT_LOW_WATERMARK,
+                                      INPUT_HIGH_WATERMARK);
+      g_signal_connect(priv->stdin_queue, "drained",
+                       G_CALLBACK(gksu_controller_stdin_drained_cb), self);
     }
 
   if(stdout)
@@ -450,7 +888,58 @@ GksuController* gksu_controller_run(GksuController *self,
                     (GChildWatchFunc)gksu_controller_process_exited_cb,
                     (gpointer)self);
 
-  return self;
+  g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
+}
+
+/*
+ * Starts the child, once gksu_controller_prepare_finish() has said
+ * all is ready; @callback is called from the main loop once it is
+ * running, or has failed to start.
+ */
+void gksu_controller_run_async(GksuController *self,
+                               gboolean using_stdin, gboolean using_stdout,
+                               gboolean using_stderr, GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GksuControllerRunData *data;
+  GTask *task;
+
+  g_return_if_fail(priv->environmentv != NULL);
+
+  task = g_task_new(self, NULL, callback, user_data);
+  g_task_set_source_tag(task, gksu_controller_run_async);
+
+  data = g_slice_new(GksuControllerRunData);
+  data->using_stdin = using_stdin;
+  data->using_stdout = using_stdout;
+  data->using_stderr = using_stderr;
+  g_task_set_task_data(task, data, (GDestroyNotify)gksu_controller_run_data_free);
+
+  /* if we are not using a given FD the launcher gives the child
+   * /dev/null for it */
+  gksu_launcher_spawn_async(priv->working_directory, priv->arguments, priv->environmentv,
+                            using_stdin, using_stdout, using_stderr,
+                            (GAsyncReadyCallback)gksu_controller_spawned_cb, task);
+  g_strfreev(priv->environmentv);
+  priv->environmentv = NULL;
+}
+
+gboolean gksu_controller_run_finish(GksuController *self, GAsyncResult *result,
+                                    gint *pid, GError **error)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  g_return_val_if_fail(g_task_is_valid(result, self), FALSE);
+
+  if(!g_task_propagate_boolean(G_TASK(result), error))
+    return FALSE;
+
+  if(pid)
+    *pid = priv->pid;
+
+  return TRUE;
 }
 
 void gksu_controller_finish(GksuController *controller)
@@ -501,6 +990,13 @@ void gksu_controller_close_fd(GksuController *self, gint fd, GError **error)
   if(channel == NULL)
     return;
 
+  /* input still queued for the child goes in before the EOF */
+  if((fd == 0) && priv->stdin_queue)
+    {
+      gksu_write_queue_close(priv->stdin_queue);
+      return;
+    }
+
   g_io_channel_shutdown(channel, TRUE, &internal_error);
   if(internal_error)
     {
@@ -509,65 +1005,62 @@ void gksu_controller_close_fd(GksuController *self, gint fd, GError **error)
     }
 }
 
-gchar* gksu_controller_read_output(GksuController *self, gint fd,
-                                   gsize *length, gboolean read_to_end)
+static GIOChannel* gksu_controller_get_output_channel(GksuController *self, gint fd,
+                                                      guint **source_id,
+                                                      GIOFunc *handler_func)
 {
   GksuControllerPrivate *priv = self->priv;
-  GIOChannel *channel;
-  guint *source_id;
-  GIOFunc handler_func;
-  GError *error = NULL;
-  GString *retstring;
-  gchar *retdata;
-  gchar buffer[1024];
-  gsize buffer_length = -1;
-  gint count;
 
   switch(fd)
     {
     case 1:
-      channel = priv->stdout;
-      source_id = &(priv->stdout_source_id);
-      handler_func = (GIOFunc)gksu_controller_stdout_ready_to_read_cb;
-      break;
+      *source_id = &(priv->stdout_source_id);
+      *handler_func = (GIOFunc)gksu_controller_stdout_ready_to_read_cb;
+      return priv->stdout;
     case 2:
-      channel = priv->stderr;
-      source_id = &(priv->stderr_source_id);
-      handler_func = (GIOFunc)gksu_controller_stderr_ready_to_read_cb;
-      break;
-    default:
-      return FALSE;
+      *source_id = &(priv->stderr_source_id);
+      *handler_func = (GIOFunc)gksu_controller_stderr_ready_to_read_cb;
+      return priv->stderr;
     }
 
-  retstring = g_string_new("");
+  return NULL;
+}
 
-  /*
-   * Unless we're told to read every possible character, we read only
-   * 5 x 1024 chars, in order to not let the rest of the server suffer
-   * from starvation when the child outputs loads of text. Reading
-   * everything in one go is important for when the child is gone,
-   * though, so that we can quickly store the pending output in the
-   * GksuZombie, in GksuServer.
-   */
-  for(count = 0; (((buffer_length != 0) && (read_to_end)) || ((buffer_length != 0) && (count < 5))); count++)
-    {
-      GIOStatus status;
-      status = g_io_channel_read_chars(channel, buffer, 1024, &buffer_length, &error);
-      if(error)
-        {
-          fprintf(stderr, "%s\n", error->message);
-          g_error_free(error);
-        }
-      g_string_append_len(retstring, buffer, buffer_length);
-    }
+/*
+ * Reads pending output into the controller's own buffer, and returns
+ * a pointer to it, which is only valid until the next read. At most
+ * the read budget is read, unless @read_to_end is given, so that the
+ * rest of the server does not suffer from starvation when the child
+ * outputs loads of text; if more is pending, output-available is
+ * emitted again. Reading everything in one go is important for when
+ * the child is gone, though, so that we can quickly store the
+ * pending output in the GksuZombie, in GksuServer.
+ */
+const gchar* gksu_controller_read_output_direct(GksuController *self, gint fd,
+                                                gsize *length, gboolean read_to_end)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GIOChannel *channel;
+  guint *source_id;
+  GIOFunc handler_func;
+  gboolean more;
+  gboolean eof;
 
-  retdata = retstring->str;
-  *length = retstring->len;
-  g_string_free(retstring, FALSE);
+  *length = 0;
 
-  if((count == 5) && (buffer_length != 0))
+  channel = gksu_controller_get_output_channel(self, fd, &source_id, &handler_func);
+  if(channel == NULL)
+    return NULL;
+
+  g_string_truncate(priv->read_buffer, 0);
+  gksu_controller_fill_buffer(g_io_channel_unix_get_fd(channel), priv->read_buffer,
+                              read_to_end ? 0 : priv->read_budget,
+                              &more, &eof);
+  priv->bytes_relayed += priv->read_buffer->len;
+
+  if(more)
     g_signal_emit(self, signals[OUTPUT_AVAILABLE], 0, fd);
-  else
+  else if(!eof)
     {
       if(*source_id)
         {
@@ -581,35 +1074,324 @@ gchar* gksu_controller_read_output(GksuController *self, gint fd,
                        (gpointer)self);
     }
 
+  *length = priv->read_buffer->len;
+  return priv->read_buffer->str;
+}
+
+/*
+ * Same as gksu_controller_read_output_direct(), but returns a newly
+ * allocated, NUL-terminated copy of the data.
+ */
+gchar* gksu_controller_read_output(GksuController *self, gint fd,
+                                   gsize *length, gboolean read_to_end)
+{
+  const gchar *data;
+  gchar *retdata;
+
+  data = gksu_controller_read_output_direct(self, fd, length, read_to_end);
+  if(data == NULL)
+    return NULL;
+
+  retdata = g_malloc(*length + 1);
+  memcpy(retdata, data, *length);
+  retdata[*length] = '\0';
+
   return retdata;
 }
 
+/*
+ * Queues @data to be written to the child's stdin as it reads it;
+ * this never blocks. Once the queue is full, callers are expected to
+ * hold off until it drains; see gksu_controller_input_is_full().
+ */
 gboolean gksu_controller_write_input(GksuController *self, const gchar *data,
                                      const gsize length, GError **error)
 {
   GksuControllerPrivate *priv = self->priv;
-  GIOChannel *channel = priv->stdin;
-  GError *internal_error = NULL;
-  gsize bytes_written =0;
-  gsize bytes_left = length;
-  gchar *writing_from = (gchar*)data;
 
-  while(bytes_left > 0)
+  if(priv->stdin_queue == NULL)
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_FD_NOT_AVAILABLE,
+                  "The process' standard input is not available.");
+      return FALSE;
+    }
+
+  gksu_write_queue_add(priv->stdin_queue, data, length);
+  priv->bytes_relayed += length;
+
+  return TRUE;
+}
+
+gboolean gksu_controller_input_is_full(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  if(priv->stdin_queue == NULL)
+    return FALSE;
+
+  return gksu_write_queue_is_full(priv->stdin_queue);
+}
+
+/*
+ * Holds the reply to a WriteInput call until the input queue drains
+ * below its low watermark.
+ */
+void gksu_controller_defer_input_reply(GksuController *self,
+                                       GDBusMethodInvocation *invocation)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  g_queue_push_tail(priv->input_replies, invocation);
+}
+
+/*
+ * Detaches the controller from one of the child's standard pipes and
+ * hands the raw file descriptor over to the caller, which becomes
+ * responsible for closing it. This is used when the pipes are passed
+ * directly to the client over D-Bus, so that we do not relay anything.
+ */
+gint gksu_controller_steal_fd(GksuController *self, gint fd)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GIOChannel **channel;
+  guint *source_id;
+  gint raw_fd;
+  gint flags;
+
+  switch(fd)
+    {
+    case 0:
+      channel = &(priv->stdin);
+      source_id = &(priv->stdin_source_id);
+      break;
+    case 1:
+      channel = &(priv->stdout);
+      source_id = &(priv->stdout_source_id);
+      break;
+    case 2:
+      channel = &(priv->stderr);
+      source_id = &(priv->stderr_source_id);
+      break;
+    default:
+      return -1;
+    }
+
+  if(*channel == NULL)
+    return -1;
+
+  if(*source_id)
+    {
+      g_source_remove(*source_id);
+      *source_id = 0;
+    }
+
+  if((fd == 0) && priv->stdin_queue)
+    {
+      g_object_unref(priv->stdin_queue);
+      priv->stdin_queue = NULL;
+    }
+
+  raw_fd = g_io_channel_unix_get_fd(*channel);
+  g_io_channel_unref(*channel);
+  *channel = NULL;
+
+  /* the client shares the file description with us, so it should not
+   * inherit the non-blocking mode we use for our own watches */
+  flags = fcntl(raw_fd, F_GETFL);
+  if(flags != -1)
+    fcntl(raw_fd, F_SETFL, flags & ~O_NONBLOCK);
+
+  return raw_fd;
+}
+
+/*
+ * Switches the controller to push mode: from now on output is read as
+ * soon as it is available, batched, and delivered through the
+ * output-data signal, to be sent to the owner.
+ */
+void gksu_controller_start_streaming(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  if(priv->streaming)
+    return;
+
+  priv->streaming = TRUE;
+
+  if(priv->stdout)
+    {
+      priv->stdout_batch = g_string_sized_new(STREAM_BATCH_SIZE);
+
+      /* while in pull mode the watch is only there while we wait for
+       * the output to be read */
+      if((priv->stdout_source_id == 0) && !priv->stdout_paused)
+        priv->stdout_source_id =
+          g_io_add_watch(priv->stdout, G_IO_IN|G_IO_PRI|G_IO_HUP,
+                         (GIOFunc)gksu_controller_stdout_ready_to_read_cb,
+                         (gpointer)self);
+    }
+
+  if(priv->stderr)
+    {
+      priv->stderr_batch = g_string_sized_new(STREAM_BATCH_SIZE);
+
+      if((priv->stderr_source_id == 0) && !priv->stderr_paused)
+        priv->stderr_source_id =
+          g_io_add_watch(priv->stderr, G_IO_IN|G_IO_PRI|G_IO_HUP,
+                         (GIOFunc)gksu_controller_stderr_ready_to_read_cb,
+                         (gpointer)self);
+    }
+}
+
+void gksu_controller_set_read_budget(GksuController *self, gsize budget)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  /* 0 would mean reading until the pipe is empty */
+  priv->read_budget = MAX(budget, 1);
+}
+
+void gksu_controller_set_io_weight(GksuController *self, guint weight)
+{
+  GksuControllerPrivate *priv = self->priv;
+  priv->io_weight = CLAMP(weight, 1, GKSU_CONTROLLER_MAX_IO_WEIGHT);
+}
+
+guint gksu_controller_get_io_weight(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+  return priv->io_weight;
+}
+
+/*
+ * Stops or resumes reading the given output fd, when streaming, so
+ * that the child's writes block on its own pipe while the client is
+ * unable to keep up with what we push.
+ */
+void gksu_controller_set_output_paused(GksuController *self, gint fd, gboolean paused)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GIOChannel *channel;
+  guint *source_id;
+  GIOFunc handler_func;
+  gboolean *paused_flag;
+
+  channel = gksu_controller_get_output_channel(self, fd, &source_id, &handler_func);
+  if(channel == NULL)
+    return;
+
+  paused_flag = (fd == 1) ? &(priv->stdout_paused) : &(priv->stderr_paused);
+  if(*paused_flag == paused)
+    return;
+
+  *paused_flag = paused;
+
+  if(!priv->streaming)
+    return;
+
+  if(paused)
     {
-      g_io_channel_write_chars(channel, writing_from, bytes_left,
-                               &bytes_written, &internal_error);
-      if(internal_error)
+      if(*source_id)
         {
-          fprintf(stderr, "%s\n", internal_error->message);
-          g_propagate_error(error, internal_error);
-          return FALSE;
+          g_source_remove(*source_id);
+          *source_id = 0;
         }
-
-      bytes_left = bytes_left - bytes_written;
-      writing_from = writing_from + bytes_written;
     }
+  else if(*source_id == 0)
+    *source_id =
+      g_io_add_watch(channel, G_IO_IN|G_IO_PRI|G_IO_HUP,
+                     handler_func, (gpointer)self);
+}
 
-  return TRUE;
+gboolean gksu_controller_is_streaming(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+  return priv->streaming;
+}
+
+guint64 gksu_controller_get_bytes_relayed(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+  return priv->bytes_relayed;
+}
+
+void gksu_controller_set_owner(GksuController *self, const gchar *owner)
+{
+  GksuControllerPrivate *priv = self->priv;
+
+  g_free(priv->owner);
+  priv->owner = g_strdup(owner);
+}
+
+const gchar* gksu_controller_get_owner(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+  return priv->owner;
+}
+
+/*
+ * Reads everything that is left in the child's output pipes and sends
+ * it on right away; used when the child is gone.
+ */
+void gksu_controller_flush_stream(GksuController *self)
+{
+  GksuControllerPrivate *priv = self->priv;
+  gboolean more;
+  gsize length;
+
+  if(!priv->streaming)
+    return;
+
+  if(priv->stdout)
+    gksu_controller_stream_output(self, 1, priv->stdout, 0, &more, &length);
+
+  if(priv->stderr)
+    gksu_controller_stream_output(self, 2, priv->stderr, 0, &more, &length);
+
+  gksu_controller_flush_batches(self);
+}
+
+/*
+ * Reads up to @quota bytes of streamed output for @fd, as told by
+ * the server's I/O scheduler, and sets @length to how much was
+ * read. Returns %TRUE if there is still output pending, in which case
+ * the scheduler is expected to call again; otherwise we go back to
+ * waiting for the child to write something.
+ */
+gboolean gksu_controller_read_stream(GksuController *self, gint fd, gsize quota,
+                                     gsize *length)
+{
+  GksuControllerPrivate *priv = self->priv;
+  GIOChannel *channel;
+  guint *source_id;
+  GIOFunc handler_func;
+  gboolean more;
+
+  *length = 0;
+
+  if(!priv->streaming)
+    return FALSE;
+
+  channel = gksu_controller_get_output_channel(self, fd, &source_id, &handler_func);
+  if(channel == NULL)
+    return FALSE;
+
+  /* the watch is added back when we are resumed */
+  if(((fd == 1) && priv->stdout_paused) || ((fd == 2) && priv->stderr_paused))
+    return FALSE;
+
+  if(!gksu_controller_stream_output(self, fd, channel, MAX(quota, 1), &more, length))
+    return FALSE;
+
+  if(more)
+    return TRUE;
+
+  if(*source_id == 0)
+    *source_id =
+      g_io_add_watch(channel, G_IO_IN|G_IO_PRI|G_IO_HUP,
+                     handler_func, (gpointer)self);
+
+  return FALSE;
 }
 
 gboolean gksu_controller_is_using_stdout(GksuController *self)
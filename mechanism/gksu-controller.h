@@ -21,6 +21,7 @@
 #define __GKSU_CONTROLLER_H__ 1
 
 #include <glib-object.h>
+#include <gio/gio.h>
 
 typedef struct _GksuControllerPrivate GksuControllerPrivate;
 
@@ -42,12 +43,22 @@ GType gksu_controller_get_type(void);
 #define GKSU_IS_CONTROLLER(object) (G_TYPE_CHECK_INSTANCE_TYPE ((object), GKSU_TYPE_CONTROLLER))
 #define GKSU_CONTROLLER_GET_CLASS(object)  (G_TYPE_INSTANCE_GET_CLASS ((object), GKSU_TYPE_CONTROLLER, GksuControllerClass))
 
-GksuController* gksu_controller_new(gchar *working_directory, gchar **arguments, DBusGConnection *dbus);
+#define GKSU_CONTROLLER_MAX_IO_WEIGHT 16
 
-GksuController* gksu_controller_run(GksuController *self,
-                                    GHashTable *environment, gchar *xauth,
-                                    gboolean using_stdin, gboolean using_stdout,
-                                    gboolean using_stderr, gint *pid, GError **error);
+GksuController* gksu_controller_new(const gchar *working_directory, gchar **arguments);
+
+void gksu_controller_prepare_async(GksuController *self, GHashTable *environment,
+                                   const gchar *xauth, GAsyncReadyCallback callback,
+                                   gpointer user_data);
+gboolean gksu_controller_prepare_finish(GksuController *self, GAsyncResult *result,
+                                        GError **error);
+
+void gksu_controller_run_async(GksuController *self,
+                               gboolean using_stdin, gboolean using_stdout,
+                               gboolean using_stderr, GAsyncReadyCallback callback,
+                               gpointer user_data);
+gboolean gksu_controller_run_finish(GksuController *self, GAsyncResult *result,
+                                    gint *pid, GError **error);
 
 void gksu_controller_finish(GksuController *controller);
 
@@ -59,12 +70,41 @@ gint gksu_controller_get_cookie(GksuController *controller);
 
 void gksu_controller_close_fd(GksuController *self, gint fd, GError **error);
 
+const gchar* gksu_controller_read_output_direct(GksuController *self, gint fd,
+                                                gsize *length, gboolean read_to_end);
+
 gchar* gksu_controller_read_output(GksuController *self, gint fd,
                                    gsize *length, gboolean read_to_end);
 
+void gksu_controller_set_read_budget(GksuController *self, gsize budget);
+
+gboolean gksu_controller_input_is_full(GksuController *self);
+void gksu_controller_defer_input_reply(GksuController *self, GDBusMethodInvocation *invocation);
 gboolean gksu_controller_write_input(GksuController *self, const gchar *data,
                                      const gsize length, GError **error);
 
+gint gksu_controller_steal_fd(GksuController *self, gint fd);
+
+void gksu_controller_start_streaming(GksuController *self);
+
+gboolean gksu_controller_is_streaming(GksuController *self);
+
+guint64 gksu_controller_get_bytes_relayed(GksuController *self);
+
+void gksu_controller_set_owner(GksuController *self, const gchar *owner);
+const gchar* gksu_controller_get_owner(GksuController *self);
+
+void gksu_controller_flush_stream(GksuController *self);
+
+gboolean gksu_controller_read_stream(GksuController *self, gint fd, gsize quota,
+                                     gsize *length);
+
+void gksu_controller_set_output_paused(GksuController *self, gint fd, gboolean paused);
+
+void gksu_controller_set_io_weight(GksuController *self, guint weight);
+
+guint gksu_controller_get_io_weight(GksuController *self);
+
 gboolean gksu_controller_is_using_stdout(GksuController *self);
 
 gboolean gksu_controller_is_using_stderr(GksuController *self);
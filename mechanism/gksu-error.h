@@ -29,7 +29,8 @@ typedef enum
     GKSU_ERROR_INVALID_VARIABLE,
     GKSU_ERROR_PREPARE_XAUTH_FAILED,
     GKSU_ERROR_PROCESS_NOT_FOUND,
-    GKSU_ERROR_KILL
+    GKSU_ERROR_KILL,
+    GKSU_ERROR_FD_NOT_AVAILABLE
   } GksuErrorEnum;
 
 #endif
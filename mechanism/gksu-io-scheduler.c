@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <glib-object.h>
+
+#include "gksu-controller.h"
+#include "gksu-io-scheduler.h"
+
+/*
+ * The I/O scheduler decides which child gets its output read next,
+ * when output is being streamed. Controllers with output pending are
+ * kept in a ready queue, which is served in deficit round-robin: each
+ * time an entry comes to the head of the queue it is credited with
+ * quantum x weight bytes, and may read as much as its credit allows
+ * before going to the back of the queue. A child that writes a lot
+ * thus can't keep one that only writes now and then waiting for
+ * more than a round.
+ */
+
+G_DEFINE_TYPE(GksuIOScheduler, gksu_io_scheduler, G_TYPE_OBJECT);
+
+typedef struct {
+  GksuController *controller;
+  gint fd;
+  gsize deficit;
+} GksuIOSchedulerEntry;
+
+struct _GksuIOSchedulerPrivate {
+  GQueue *ready;
+  gsize quantum;
+  guint source_id;
+};
+
+#define GKSU_IO_SCHEDULER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_IO_SCHEDULER, GksuIOSchedulerPrivate))
+
+static void gksu_io_scheduler_entry_free(GksuIOSchedulerEntry *entry)
+{
+  g_object_unref(entry->controller);
+  g_slice_free(GksuIOSchedulerEntry, entry);
+}
+
+static void gksu_io_scheduler_finalize(GObject *object)
+{
+  GksuIOScheduler *self = GKSU_IO_SCHEDULER(object);
+  GksuIOSchedulerPrivate *priv = self->priv;
+  GksuIOSchedulerEntry *entry;
+
+  if(priv->source_id)
+    g_source_remove(priv->source_id);
+
+  while((entry = g_queue_pop_head(priv->ready)) != NULL)
+    gksu_io_scheduler_entry_free(entry);
+  g_queue_free(priv->ready);
+
+  G_OBJECT_CLASS(gksu_io_scheduler_parent_class)->finalize(object);
+}
+
+static void gksu_io_scheduler_class_init(GksuIOSchedulerClass *klass)
+{
+  G_OBJECT_CLASS(klass)->finalize = gksu_io_scheduler_finalize;
+
+  g_type_class_add_private(klass, sizeof(GksuIOSchedulerPrivate));
+}
+
+static void gksu_io_scheduler_init(GksuIOScheduler *self)
+{
+  GksuIOSchedulerPrivate *priv = GKSU_IO_SCHEDULER_GET_PRIVATE(self);
+  self->priv = priv;
+
+  priv->ready = g_queue_new();
+}
+
+/*
+ * Serves one round of the ready queue; runs as an idle, so that
+ * incoming D-Bus messages and new output are looked at between
+ * rounds.
+ */
+static gboolean gksu_io_scheduler_dispatch(GksuIOScheduler *self)
+{
+  GksuIOSchedulerPrivate *priv = self->priv;
+  guint count = g_queue_get_length(priv->ready);
+
+  while(count-- > 0)
+    {
+      GksuIOSchedulerEntry *entry = g_queue_pop_head(priv->ready);
+      gsize length;
+
+      entry->deficit += priv->quantum *
+        gksu_controller_get_io_weight(entry->controller);
+
+      if(gksu_controller_read_stream(entry->controller, entry->fd,
+                                     entry->deficit, &length))
+        {
+          entry->deficit -= MIN(length, entry->deficit);
+          g_queue_push_tail(priv->ready, entry);
+        }
+      else
+        {
+          /* credit is not kept by idle entries */
+          gksu_io_scheduler_entry_free(entry);
+        }
+    }
+
+  if(g_queue_is_empty(priv->ready))
+    {
+      priv->source_id = 0;
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+GksuIOScheduler* gksu_io_scheduler_new(gsize quantum)
+{
+  GksuIOScheduler *self = g_object_new(GKSU_TYPE_IO_SCHEDULER, NULL);
+
+  gksu_io_scheduler_set_quantum(self, quantum);
+
+  return self;
+}
+
+void gksu_io_scheduler_set_quantum(GksuIOScheduler *self, gsize quantum)
+{
+  GksuIOSchedulerPrivate *priv = self->priv;
+  priv->quantum = MAX(quantum, 1);
+}
+
+/*
+ * Puts the given controller's fd in the ready queue; the controller
+ * stops watching the fd until gksu_controller_read_stream() finds it
+ * empty, so the same fd is never queued twice.
+ */
+void gksu_io_scheduler_add(GksuIOScheduler *self, GksuController *controller, gint fd)
+{
+  GksuIOSchedulerPrivate *priv = self->priv;
+  GksuIOSchedulerEntry *entry = g_slice_new(GksuIOSchedulerEntry);
+
+  entry->controller = g_object_ref(controller);
+  entry->fd = fd;
+  entry->deficit = 0;
+
+  g_queue_push_tail(priv->ready, entry);
+
+  if(priv->source_id == 0)
+    priv->source_id = g_idle_add((GSourceFunc)gksu_io_scheduler_dispatch,
+                                 (gpointer)self);
+}
+
+void gksu_io_scheduler_remove(GksuIOScheduler *self, GksuController *controller)
+{
+  GksuIOSchedulerPrivate *priv = self->priv;
+  GList *iter = priv->ready->head;
+
+  while(iter != NULL)
+    {
+      GList *next = iter->next;
+      GksuIOSchedulerEntry *entry = iter->data;
+
+      if(entry->controller == controller)
+        {
+          g_queue_delete_link(priv->ready, iter);
+          gksu_io_scheduler_entry_free(entry);
+        }
+
+      iter = next;
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GKSU_IO_SCHEDULER_H__
+#define __GKSU_IO_SCHEDULER_H__ 1
+
+#include <glib-object.h>
+
+#include "gksu-controller.h"
+
+typedef struct _GksuIOSchedulerPrivate GksuIOSchedulerPrivate;
+
+typedef struct {
+  GObject parent;
+  GksuIOSchedulerPrivate *priv;
+} GksuIOScheduler;
+
+typedef struct {
+  GObjectClass parent;
+} GksuIOSchedulerClass;
+
+GType gksu_io_scheduler_get_type(void);
+
+#define GKSU_TYPE_IO_SCHEDULER (gksu_io_scheduler_get_type())
+#define GKSU_IO_SCHEDULER(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GKSU_TYPE_IO_SCHEDULER, GksuIOScheduler))
+#define GKSU_IO_SCHEDULER_GET_CLASS(object)  (G_TYPE_INSTANCE_GET_CLASS ((object), GKSU_TYPE_IO_SCHEDULER, GksuIOSchedulerClass))
+
+GksuIOScheduler* gksu_io_scheduler_new(gsize quantum);
+
+void gksu_io_scheduler_set_quantum(GksuIOScheduler *self, gsize quantum);
+
+void gksu_io_scheduler_add(GksuIOScheduler *self, GksuController *controller, gint fd);
+
+void gksu_io_scheduler_remove(GksuIOScheduler *self, GksuController *controller);
+
+#endif
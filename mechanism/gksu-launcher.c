@@ -0,0 +1,1085 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+/* for pipe2(), clone flags and the posix_spawn extensions */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include "gksu-launcher.h"
+
+/*
+ * Starts the children of the server. g_spawn_async_with_pipes() forks
+ * the whole server, searches PATH on every call and, in the child,
+ * closes every fd it might have inherited one at a time. Where the C
+ * library lets us, we use posix_spawn() instead, which glibc does
+ * with clone(CLONE_VM|CLONE_VFORK), so nothing is copied no matter
+ * how big the server grows; the stray fds go with a single
+ * close_range() through posix_spawn_file_actions_addclosefrom_np(),
+ * and programs are looked up in PATH once.
+ *
+ * When asked to, with gksu_launcher_start_helper(), children are
+ * started by a helper instead: a copy of the server exec'ed in a mode
+ * where it does nothing else, so its image is small and clean, which
+ * gets launch requests through a socket pair. It clones the child
+ * with CLONE_PARENT, so the child is still ours, to watch and to
+ * reap, and answers once the child has exec'ed; that answer is
+ * waited for from the main loop, by gksu_launcher_spawn_async(). If
+ * the helper dies it is started again.
+ *
+ * Either way the child gets the pipes asked for as its stdin, stdout
+ * and stderr, /dev/null for the others, and is not reaped, as with
+ * G_SPAWN_DO_NOT_REAP_CHILD.
+ */
+
+#if defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCHDIR_NP) && \
+    defined(HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP)
+#define USE_POSIX_SPAWN 1
+#endif
+
+#if defined(__linux__) && defined(SYS_clone)
+#define USE_HELPER 1
+#endif
+
+/* what gksu_launcher_spawn_async() hands to gksu_launcher_spawn_finish() */
+typedef struct {
+  gint *parent_ends[3];
+  gint ends[3];
+  gint pipes[3][2];
+  GPid pid;
+  gchar *name;
+} GksuLauncherSpawnData;
+
+static void gksu_launcher_spawn_data_free(GksuLauncherSpawnData *data)
+{
+  g_free(data->name);
+  g_slice_free(GksuLauncherSpawnData, data);
+}
+
+/* completes @task, and drops it; takes @error over */
+static void gksu_launcher_spawn_return(GTask *task, GError *error)
+{
+  if(error)
+    g_task_return_error(task, error);
+  else
+    g_task_return_boolean(task, TRUE);
+  g_object_unref(task);
+}
+
+#if defined(USE_POSIX_SPAWN) || defined(USE_HELPER)
+
+/* where programs were found in PATH, by name; the server's PATH does
+ * not change, so only a program that went away makes us look again */
+static GHashTable *path_cache = NULL;
+
+#define PATH_CACHE_MAX 128
+
+static gchar* gksu_launcher_find_program(const gchar *name)
+{
+  const gchar *cached;
+  gchar *path;
+
+  if(strchr(name, '/'))
+    return g_strdup(name);
+
+  if(path_cache == NULL)
+    path_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  /* one access() instead of a walk through PATH */
+  cached = g_hash_table_lookup(path_cache, name);
+  if(cached && !access(cached, X_OK))
+    return g_strdup(cached);
+
+  path = g_find_program_in_path(name);
+  if(path == NULL)
+    {
+      g_hash_table_remove(path_cache, name);
+      return NULL;
+    }
+
+  if(g_hash_table_size(path_cache) >= PATH_CACHE_MAX)
+    g_hash_table_remove_all(path_cache);
+  g_hash_table_replace(path_cache, g_strdup(name), g_strdup(path));
+
+  return path;
+}
+
+static gint gksu_launcher_spawn_error_from_errno(gint error_number)
+{
+  switch(error_number)
+    {
+    case ENOENT:
+      return G_SPAWN_ERROR_NOENT;
+    case EACCES:
+      return G_SPAWN_ERROR_ACCES;
+    case EPERM:
+      return G_SPAWN_ERROR_PERM;
+    case ENOEXEC:
+      return G_SPAWN_ERROR_NOEXEC;
+    case ENOMEM:
+      return G_SPAWN_ERROR_NOMEM;
+    case ENOTDIR:
+      return G_SPAWN_ERROR_NOTDIR;
+    case E2BIG:
+      return G_SPAWN_ERROR_TOO_BIG;
+    case ETXTBSY:
+      return G_SPAWN_ERROR_TXTBUSY;
+    default:
+      return G_SPAWN_ERROR_FAILED;
+    }
+}
+
+static void gksu_launcher_set_exec_error(GError **error, const gchar *name,
+                                         gint error_number)
+{
+  g_set_error(error, G_SPAWN_ERROR, gksu_launcher_spawn_error_from_errno(error_number),
+              "Failed to execute child process \"%s\" (%s)",
+              name, g_strerror(error_number));
+}
+
+/*
+ * Both ends are close-on-exec; the child's end is made its stdin,
+ * stdout or stderr by dup2(), which clears the flag on the copy. The
+ * ends are kept above 2, so that they can't be one of the fds they
+ * are being copied over.
+ */
+static gboolean gksu_launcher_make_pipe(gint fds[2], GError **error)
+{
+  gint fd;
+  gint i;
+
+  if(pipe2(fds, O_CLOEXEC))
+    {
+      gint saved_errno = errno;
+
+      g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                  "Failed to create pipe for communicating with child process (%s)",
+                  g_strerror(saved_errno));
+      return FALSE;
+    }
+
+  for(i = 0; i < 2; i++)
+    {
+      if(fds[i] > 2)
+        continue;
+
+      fd = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+      close(fds[i]);
+      fds[i] = fd;
+    }
+
+  if((fds[0] == -1) || (fds[1] == -1))
+    {
+      g_set_error(error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                  "Failed to create pipe for communicating with child process (%s)",
+                  g_strerror(errno));
+      if(fds[0] != -1)
+        close(fds[0]);
+      if(fds[1] != -1)
+        close(fds[1]);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* the end of the pipe for @fd the child uses: it reads from its
+ * stdin, and writes to the others */
+#define CHILD_END(fd) (((fd) == 0) ? 0 : 1)
+
+static gboolean gksu_launcher_make_pipes(gint *parent_ends[3], gint pipes[3][2],
+                                         GError **error)
+{
+  gint fd;
+
+  for(fd = 0; fd < 3; fd++)
+    if(parent_ends[fd] && !gksu_launcher_make_pipe(pipes[fd], error))
+      return FALSE;
+
+  return TRUE;
+}
+
+/* hands the parent's ends over to the caller, and closes the rest */
+static void gksu_launcher_finish_pipes(gint *parent_ends[3], gint pipes[3][2],
+                                       gboolean success)
+{
+  gint fd;
+
+  for(fd = 0; fd < 3; fd++)
+    {
+      if(success && parent_ends[fd])
+        {
+          *(parent_ends[fd]) = pipes[fd][1 - CHILD_END(fd)];
+          pipes[fd][1 - CHILD_END(fd)] = -1;
+        }
+
+      if(pipes[fd][0] != -1)
+        close(pipes[fd][0]);
+      if(pipes[fd][1] != -1)
+        close(pipes[fd][1]);
+    }
+}
+
+#endif
+
+#ifdef USE_HELPER
+
+/*
+ * A launch request is a single packet: this header, then the program,
+ * the working directory (empty for none), the arguments and the
+ * environment, each NUL terminated; the pipes the child is to use
+ * come along as SCM_RIGHTS, in the order of the bits set in @fds.
+ */
+typedef struct {
+  guint32 fds;
+  guint32 n_args;
+  guint32 n_env;
+} GksuLauncherRequest;
+
+typedef struct {
+  gint32 pid;
+  gint32 error_number;
+} GksuLauncherReply;
+
+/* bigger requests are started by the server itself */
+#define HELPER_MAX_REQUEST (128 * 1024)
+
+/* how long to wait for the helper to answer a request */
+#define HELPER_TIMEOUT 5000
+
+/* a helper that dies this soon after starting, this many times in a
+ * row, is not started again */
+#define HELPER_MIN_LIFETIME (G_USEC_PER_SEC)
+#define HELPER_MAX_FAILURES 3
+
+#ifndef CLOSE_RANGE_CLOEXEC
+#define CLOSE_RANGE_CLOEXEC (1U << 2)
+#endif
+
+static gint helper_fd = -1;
+static GPid helper_pid = 0;
+static gint64 helper_started = 0;
+static guint helper_failures = 0;
+
+/* the requests the helper has not answered yet, oldest first; it
+ * serves them one at a time, so the replies come in that order */
+static GQueue helper_pending = G_QUEUE_INIT;
+static GIOChannel *helper_channel = NULL;
+static guint helper_watch_id = 0;
+static guint helper_timeout_id = 0;
+
+static gboolean gksu_launcher_spawn_helper(void);
+static void gksu_launcher_helper_fail(void);
+
+/*
+ * Makes every fd from @first up close-on-exec, or closes them when
+ * @close_them; a single close_range() where the kernel has it.
+ */
+static void gksu_launcher_clear_fds(gint first, gboolean close_them)
+{
+  gint fd;
+  gint max;
+
+#ifdef SYS_close_range
+  if(!syscall(SYS_close_range, first, ~0U, close_them ? 0 : CLOSE_RANGE_CLOEXEC))
+    return;
+#endif
+
+  max = sysconf(_SC_OPEN_MAX);
+  for(fd = first; fd < max; fd++)
+    {
+      if(close_them)
+        close(fd);
+      else
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+}
+
+/* the request got its answer, or never will */
+static void gksu_launcher_helper_done(GTask *task, GError *error)
+{
+  GksuLauncherSpawnData *data = g_task_get_task_data(task);
+
+  gksu_launcher_finish_pipes(data->parent_ends, data->pipes, error == NULL);
+  gksu_launcher_spawn_return(task, error);
+}
+
+/*
+ * Fails every request still waiting for the helper, and makes sure
+ * no more are sent to it: the child watch starts a new one once it is
+ * gone.
+ */
+static void gksu_launcher_helper_fail(void)
+{
+  GksuLauncherSpawnData *data;
+  GTask *task;
+
+  if(helper_timeout_id)
+    g_source_remove(helper_timeout_id);
+  helper_timeout_id = 0;
+
+  if(helper_pid)
+    kill(helper_pid, SIGKILL);
+  if(helper_fd != -1)
+    shutdown(helper_fd, SHUT_RDWR);
+
+  while((task = g_queue_pop_head(&helper_pending)))
+    {
+      data = g_task_get_task_data(task);
+      gksu_launcher_helper_done(task,
+                                g_error_new(G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                                            "Failed to execute child process \"%s\" "
+                                            "(the launcher helper did not answer)",
+                                            data->name));
+    }
+}
+
+static gboolean gksu_launcher_helper_timeout_cb(gpointer user_data)
+{
+  /* it is stuck */
+  helper_timeout_id = 0;
+  gksu_launcher_helper_fail();
+
+  return FALSE;
+}
+
+/* the oldest request gets HELPER_TIMEOUT from when it became so */
+static void gksu_launcher_helper_restart_timeout(void)
+{
+  if(helper_timeout_id)
+    g_source_remove(helper_timeout_id);
+  helper_timeout_id = 0;
+
+  if(!g_queue_is_empty(&helper_pending))
+    helper_timeout_id = g_timeout_add(HELPER_TIMEOUT,
+                                      gksu_launcher_helper_timeout_cb, NULL);
+}
+
+static gboolean gksu_launcher_helper_reply_cb(GIOChannel *channel,
+                                              GIOCondition condition,
+                                              gpointer user_data)
+{
+  GksuLauncherSpawnData *data;
+  GksuLauncherReply reply;
+  GError *error = NULL;
+  GTask *task;
+  gssize count;
+
+  do
+    count = recv(helper_fd, &reply, sizeof(reply), MSG_DONTWAIT);
+  while((count == -1) && (errno == EINTR));
+
+  if((count == -1) && (errno == EAGAIN))
+    return TRUE;
+
+  if(count != sizeof(reply))
+    {
+      /* it is gone, or talking nonsense */
+      helper_watch_id = 0;
+      gksu_launcher_helper_fail();
+      return FALSE;
+    }
+
+  task = g_queue_pop_head(&helper_pending);
+  if(task == NULL)
+    return TRUE;
+
+  gksu_launcher_helper_restart_timeout();
+
+  data = g_task_get_task_data(task);
+  if(reply.error_number)
+    {
+      /* the child that failed to exec is ours to reap */
+      if(reply.pid > 0)
+        waitpid(reply.pid, NULL, 0);
+
+      gksu_launcher_set_exec_error(&error, data->name, reply.error_number);
+    }
+  else
+    data->pid = reply.pid;
+
+  gksu_launcher_helper_done(task, error);
+
+  return TRUE;
+}
+
+static void gksu_launcher_helper_exited_cb(GPid pid, gint status, gpointer data)
+{
+  g_spawn_close_pid(pid);
+
+  if(pid != helper_pid)
+    return;
+
+  /* whatever it was still working on is lost; it is reaped already,
+   * so there is nothing to kill */
+  helper_pid = 0;
+  gksu_launcher_helper_fail();
+
+  if(helper_watch_id)
+    g_source_remove(helper_watch_id);
+  helper_watch_id = 0;
+  g_io_channel_unref(helper_channel);
+  helper_channel = NULL;
+
+  close(helper_fd);
+  helper_fd = -1;
+
+  if(g_get_monotonic_time() - helper_started < HELPER_MIN_LIFETIME)
+    helper_failures++;
+  else
+    helper_failures = 0;
+
+  if(helper_failures >= HELPER_MAX_FAILURES)
+    {
+      g_warning("The launcher helper keeps dying; children will be started "
+                "by the server itself.");
+      return;
+    }
+
+  g_warning("The launcher helper died; starting a new one.");
+  gksu_launcher_spawn_helper();
+}
+
+static gboolean gksu_launcher_spawn_helper(void)
+{
+  gint sockets[2];
+  pid_t pid;
+
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sockets))
+    {
+      g_warning("Unable to start the launcher helper: %s", g_strerror(errno));
+      return FALSE;
+    }
+
+  pid = fork();
+  if(pid == -1)
+    {
+      g_warning("Unable to start the launcher helper: %s", g_strerror(errno));
+      close(sockets[0]);
+      close(sockets[1]);
+      return FALSE;
+    }
+
+  if(pid == 0)
+    {
+      gchar *argv[] = { "gksu-server", GKSU_LAUNCHER_HELPER_ARG, NULL };
+
+      /* the helper's end is its fd 3, and it has nothing else */
+      if(sockets[1] == 3)
+        fcntl(3, F_SETFD, 0);
+      else if(dup2(sockets[1], 3) == -1)
+        _exit(127);
+      gksu_launcher_clear_fds(4, TRUE);
+
+      execv("/proc/self/exe", argv);
+      _exit(127);
+    }
+
+  close(sockets[1]);
+
+  helper_fd = sockets[0];
+  helper_pid = pid;
+  helper_started = g_get_monotonic_time();
+
+  helper_channel = g_io_channel_unix_new(helper_fd);
+  helper_watch_id = g_io_add_watch(helper_channel, G_IO_IN|G_IO_HUP|G_IO_ERR,
+                                   (GIOFunc)gksu_launcher_helper_reply_cb, NULL);
+
+  g_child_watch_add(pid, gksu_launcher_helper_exited_cb, NULL);
+
+  return TRUE;
+}
+
+/**
+ * gksu_launcher_start_helper:
+ *
+ * Starts the launcher helper, which then starts children from its
+ * own small address space instead of the server's; see the top of
+ * this file. Must be called from the main loop's thread, as the
+ * spawns are.
+ */
+void gksu_launcher_start_helper(void)
+{
+  if(helper_fd != -1)
+    return;
+
+  helper_failures = 0;
+  gksu_launcher_spawn_helper();
+}
+
+/* the helper's child; only async-signal-safe calls from here on */
+static void gksu_launcher_helper_exec(const gchar *program, const gchar *cwd,
+                                      gchar **argv, gchar **envp, gint received[3],
+                                      gint error_fd)
+{
+  struct sigaction action;
+  sigset_t mask;
+  gint error_number;
+  gint fd;
+
+  for(fd = 0; fd < 3; fd++)
+    {
+      gint source = received[fd];
+
+      if(source == -1)
+        source = open("/dev/null", (fd == 0) ? O_RDONLY : O_WRONLY);
+      if((source == -1) || (dup2(source, fd) == -1))
+        goto fail;
+    }
+
+  if(cwd[0] && chdir(cwd))
+    goto fail;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = SIG_DFL;
+  sigaction(SIGPIPE, &action, NULL);
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+
+  /* the socket, the pipes we were given and the error pipe all go
+   * away with the exec */
+  gksu_launcher_clear_fds(3, FALSE);
+
+  execve(program, argv, envp);
+
+ fail:
+  error_number = errno;
+  if(write(error_fd, &error_number, sizeof(error_number)) < 0)
+    ;
+  _exit(127);
+}
+
+static void gksu_launcher_helper_handle(gint fd, gchar *buffer, gsize length,
+                                        gint received[3])
+{
+  GksuLauncherRequest *request = (GksuLauncherRequest*)buffer;
+  GksuLauncherReply reply = { 0, 0 };
+  gchar **strings;
+  gchar *cursor = buffer + sizeof(GksuLauncherRequest);
+  gchar *end = buffer + length;
+  guint n_strings;
+  guint i;
+  gint error_pipe[2];
+  pid_t pid;
+
+  if((length < sizeof(GksuLauncherRequest)) || (end[-1] != '\0') ||
+     (request->n_args == 0) || (request->n_args > HELPER_MAX_REQUEST) ||
+     (request->n_env > HELPER_MAX_REQUEST))
+    {
+      reply.error_number = EINVAL;
+      send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+      return;
+    }
+
+  /* program, cwd, then the arguments and the environment, each
+   * followed by NULL */
+  n_strings = 2 + request->n_args + 1 + request->n_env + 1;
+  strings = calloc(n_strings, sizeof(gchar*));
+  if(strings == NULL)
+    {
+      reply.error_number = ENOMEM;
+      send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+      return;
+    }
+
+  for(i = 0; i < n_strings; i++)
+    {
+      if((i == 2 + request->n_args) || (i == n_strings - 1))
+        continue;
+
+      if(cursor >= end)
+        {
+          reply.error_number = EINVAL;
+          goto out;
+        }
+
+      strings[i] = cursor;
+      cursor += strlen(cursor) + 1;
+    }
+
+  if(pipe2(error_pipe, O_CLOEXEC))
+    {
+      reply.error_number = errno;
+      goto out;
+    }
+
+  /* the child is the server's, not ours */
+  pid = syscall(SYS_clone, CLONE_PARENT|SIGCHLD, NULL, NULL, NULL, NULL);
+  if(pid == 0)
+    gksu_launcher_helper_exec(strings[0], strings[1], strings + 2,
+                              strings + 2 + request->n_args + 1,
+                              received, error_pipe[1]);
+  close(error_pipe[1]);
+
+  if(pid == -1)
+    reply.error_number = errno;
+  else
+    {
+      gint error_number;
+      gssize count;
+
+      /* nothing comes through if the exec worked */
+      do
+        count = read(error_pipe[0], &error_number, sizeof(error_number));
+      while((count == -1) && (errno == EINTR));
+
+      reply.pid = pid;
+      if(count == sizeof(error_number))
+        reply.error_number = error_number;
+    }
+  close(error_pipe[0]);
+
+ out:
+  free(strings);
+  send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+}
+
+/**
+ * gksu_launcher_helper_main:
+ * @fd: the helper's end of the socket pair
+ *
+ * The launcher helper's main loop: serves launch requests until the
+ * server goes away.
+ *
+ * Returns: the exit status for the helper
+ */
+gint gksu_launcher_helper_main(gint fd)
+{
+  static gchar buffer[HELPER_MAX_REQUEST];
+  gchar control[CMSG_SPACE(3 * sizeof(gint))];
+  gint null_fd;
+
+  signal(SIGPIPE, SIG_DFL);
+
+  /* keep 0, 1 and 2 taken, so that no fd we are given lands on one of
+   * the fds the child is to get it as */
+  do
+    null_fd = open("/dev/null", O_RDWR);
+  while((null_fd != -1) && (null_fd < 3));
+  if(null_fd != -1)
+    close(null_fd);
+
+  while(TRUE)
+    {
+      struct msghdr message;
+      struct cmsghdr *header;
+      struct iovec iov;
+      gint received[3] = { -1, -1, -1 };
+      gint passed[3];
+      gint n_passed = 0;
+      gssize length;
+      gint i;
+
+      iov.iov_base = buffer;
+      iov.iov_len = sizeof(buffer);
+      memset(&message, 0, sizeof(message));
+      message.msg_iov = &iov;
+      message.msg_iovlen = 1;
+      message.msg_control = control;
+      message.msg_controllen = sizeof(control);
+
+      length = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+      if(length == 0)
+        return 0;
+      if(length == -1)
+        {
+          if(errno == EINTR)
+            continue;
+          return 1;
+        }
+
+      for(header = CMSG_FIRSTHDR(&message); header != NULL;
+          header = CMSG_NXTHDR(&message, header))
+        if((header->cmsg_level == SOL_SOCKET) && (header->cmsg_type == SCM_RIGHTS))
+          {
+            n_passed = (header->cmsg_len - CMSG_LEN(0)) / sizeof(gint);
+            if(n_passed > 3)
+              n_passed = 3;
+            memcpy(passed, CMSG_DATA(header), n_passed * sizeof(gint));
+          }
+
+      if(length >= (gssize)sizeof(GksuLauncherRequest))
+        {
+          GksuLauncherRequest *request = (GksuLauncherRequest*)buffer;
+          gint next = 0;
+
+          for(i = 0; i < 3; i++)
+            if((request->fds & (1 << i)) && (next < n_passed))
+              received[i] = passed[next++];
+        }
+
+      gksu_launcher_helper_handle(fd, buffer, length, received);
+
+      for(i = 0; i < n_passed; i++)
+        close(passed[i]);
+    }
+}
+
+/*
+ * Sends the request for @task's child to the helper; its reply is
+ * dealt with by gksu_launcher_helper_reply_cb(), so the main loop
+ * goes on meanwhile. Returns FALSE, leaving @task alone, if the
+ * request never got to the helper, in which case the server should
+ * start the child itself.
+ */
+static gboolean gksu_launcher_spawn_with_helper(const gchar *working_directory,
+                                                gchar **argv, gchar **envp,
+                                                GTask *task)
+{
+  GksuLauncherSpawnData *data = g_task_get_task_data(task);
+  GksuLauncherRequest request = { 0, 0, 0 };
+  GString *packet;
+  GError *error = NULL;
+  gchar control[CMSG_SPACE(3 * sizeof(gint))];
+  gint passed[3];
+  gint n_passed = 0;
+  struct msghdr message;
+  struct iovec iov;
+  gchar *program;
+  gssize count;
+  gint fd;
+  gint i;
+
+  program = gksu_launcher_find_program(argv[0]);
+  if(program == NULL)
+    {
+      gksu_launcher_set_exec_error(&error, argv[0], ENOENT);
+      gksu_launcher_spawn_return(task, error);
+      return TRUE;
+    }
+
+  if(!gksu_launcher_make_pipes(data->parent_ends, data->pipes, &error))
+    {
+      g_free(program);
+      gksu_launcher_helper_done(task, error);
+      return TRUE;
+    }
+
+  for(fd = 0; fd < 3; fd++)
+    if(data->parent_ends[fd])
+      {
+        request.fds |= 1 << fd;
+        passed[n_passed++] = data->pipes[fd][CHILD_END(fd)];
+      }
+  request.n_args = g_strv_length(argv);
+  request.n_env = envp ? g_strv_length(envp) : 0;
+
+  packet = g_string_new_len((const gchar*)&request, sizeof(request));
+  g_string_append_len(packet, program, strlen(program) + 1);
+  g_free(program);
+  if(working_directory)
+    g_string_append(packet, working_directory);
+  g_string_append_c(packet, '\0');
+  for(i = 0; argv[i]; i++)
+    g_string_append_len(packet, argv[i], strlen(argv[i]) + 1);
+  for(i = 0; envp && envp[i]; i++)
+    g_string_append_len(packet, envp[i], strlen(envp[i]) + 1);
+
+  if(packet->len > HELPER_MAX_REQUEST)
+    {
+      g_string_free(packet, TRUE);
+      gksu_launcher_finish_pipes(data->parent_ends, data->pipes, FALSE);
+      return FALSE;
+    }
+
+  iov.iov_base = packet->str;
+  iov.iov_len = packet->len;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+
+  if(n_passed)
+    {
+      struct cmsghdr *header;
+
+      message.msg_control = control;
+      message.msg_controllen = CMSG_SPACE(n_passed * sizeof(gint));
+      header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(n_passed * sizeof(gint));
+      memcpy(CMSG_DATA(header), passed, n_passed * sizeof(gint));
+    }
+
+  /* a helper that is behind may leave no room in the socket for
+   * another request; we don't wait for it, the server starts the
+   * child itself instead */
+  do
+    count = sendmsg(helper_fd, &message, MSG_NOSIGNAL|MSG_DONTWAIT);
+  while((count == -1) && (errno == EINTR));
+  g_string_free(packet, TRUE);
+
+  if(count == -1)
+    {
+      gksu_launcher_finish_pipes(data->parent_ends, data->pipes, FALSE);
+      return FALSE;
+    }
+
+  /* from here on, the child may exist; the request is not retried */
+  g_queue_push_tail(&helper_pending, task);
+  if(helper_timeout_id == 0)
+    gksu_launcher_helper_restart_timeout();
+
+  return TRUE;
+}
+
+#else
+
+void gksu_launcher_start_helper(void)
+{
+  g_warning("The launcher helper is not supported on this system.");
+}
+
+gint gksu_launcher_helper_main(gint fd)
+{
+  return 1;
+}
+
+#endif
+
+#ifdef USE_POSIX_SPAWN
+
+static gboolean gksu_launcher_spawn_local(const gchar *working_directory,
+                                          gchar **argv, gchar **envp,
+                                          gint *parent_ends[3], gint pipes[3][2],
+                                          GPid *child_pid, GError **error)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  gchar *program;
+  pid_t pid;
+  gint result;
+  gint fd;
+
+  program = gksu_launcher_find_program(argv[0]);
+  if(program == NULL)
+    {
+      gksu_launcher_set_exec_error(error, argv[0], ENOENT);
+      return FALSE;
+    }
+
+  posix_spawn_file_actions_init(&actions);
+  posix_spawnattr_init(&attr);
+
+  for(fd = 0; fd < 3; fd++)
+    {
+      if(parent_ends[fd] == NULL)
+        posix_spawn_file_actions_addopen(&actions, fd, "/dev/null",
+                                         (fd == 0) ? O_RDONLY : O_WRONLY, 0);
+      else
+        posix_spawn_file_actions_adddup2(&actions, pipes[fd][CHILD_END(fd)], fd);
+    }
+
+  if(working_directory)
+    posix_spawn_file_actions_addchdir_np(&actions, working_directory);
+
+  /* whatever else the server has open, the bus connections included,
+   * stays with us */
+  posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+
+  /* the server ignores SIGPIPE, and ignored signals survive exec; the
+   * child should get the default behaviour */
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF|POSIX_SPAWN_SETSIGMASK);
+
+  result = posix_spawn(&pid, program, &actions, &attr, argv, envp);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  g_free(program);
+
+  if(result)
+    {
+      gksu_launcher_set_exec_error(error, argv[0], result);
+      return FALSE;
+    }
+
+  if(child_pid)
+    *child_pid = pid;
+
+  return TRUE;
+}
+
+#endif
+
+#if defined(USE_POSIX_SPAWN) || defined(USE_HELPER)
+
+gboolean gksu_launcher_spawn(const gchar *working_directory, gchar **argv, gchar **envp,
+                             gint *standard_input, gint *standard_output,
+                             gint *standard_error, GPid *child_pid, GError **error)
+{
+  gint *parent_ends[3] = { standard_input, standard_output, standard_error };
+  gint pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+  gboolean success = FALSE;
+
+  if(!gksu_launcher_make_pipes(parent_ends, pipes, error))
+    goto out;
+
+#ifdef USE_POSIX_SPAWN
+  success = gksu_launcher_spawn_local(working_directory, argv, envp,
+                                      parent_ends, pipes, child_pid, error);
+#else
+  {
+    GSpawnFlags spawn_flags = G_SPAWN_SEARCH_PATH|G_SPAWN_DO_NOT_REAP_CHILD;
+
+    /* the pipes we made go unused */
+    gksu_launcher_finish_pipes(parent_ends, pipes, FALSE);
+
+    if(standard_output == NULL)
+      spawn_flags |= G_SPAWN_STDOUT_TO_DEV_NULL;
+
+    if(standard_error == NULL)
+      spawn_flags |= G_SPAWN_STDERR_TO_DEV_NULL;
+
+    return g_spawn_async_with_pipes(working_directory, argv, envp,
+                                    spawn_flags, NULL, NULL, child_pid,
+                                    standard_input, standard_output, standard_error,
+                                    error);
+  }
+#endif
+
+ out:
+  gksu_launcher_finish_pipes(parent_ends, pipes, success);
+
+  return success;
+}
+
+#else
+
+gboolean gksu_launcher_spawn(const gchar *working_directory, gchar **argv, gchar **envp,
+                             gint *standard_input, gint *standard_output,
+                             gint *standard_error, GPid *child_pid, GError **error)
+{
+  GSpawnFlags spawn_flags = G_SPAWN_SEARCH_PATH|G_SPAWN_DO_NOT_REAP_CHILD;
+
+  /* a NULL stdin is /dev/null already */
+  if(standard_output == NULL)
+    spawn_flags |= G_SPAWN_STDOUT_TO_DEV_NULL;
+
+  if(standard_error == NULL)
+    spawn_flags |= G_SPAWN_STDERR_TO_DEV_NULL;
+
+  return g_spawn_async_with_pipes(working_directory, argv, envp,
+                                  spawn_flags, NULL, NULL, child_pid,
+                                  standard_input, standard_output, standard_error,
+                                  error);
+}
+
+#endif
+
+/**
+ * gksu_launcher_spawn_async:
+ *
+ * Starts a child as gksu_launcher_spawn() does, but without waiting
+ * on the launcher helper, if there is one, to say whether it could be
+ * started: @callback gets that from the main loop. @argv and @envp
+ * are no longer needed once this returns.
+ */
+void gksu_launcher_spawn_async(const gchar *working_directory, gchar **argv, gchar **envp,
+                               gboolean using_stdin, gboolean using_stdout,
+                               gboolean using_stderr, GAsyncReadyCallback callback,
+                               gpointer user_data)
+{
+  GksuLauncherSpawnData *data;
+  GError *error = NULL;
+  GTask *task;
+  gint fd;
+
+  task = g_task_new(NULL, NULL, callback, user_data);
+  g_task_set_source_tag(task, gksu_launcher_spawn_async);
+
+  data = g_slice_new0(GksuLauncherSpawnData);
+  data->name = g_strdup(argv[0]);
+  for(fd = 0; fd < 3; fd++)
+    {
+      data->ends[fd] = -1;
+      data->pipes[fd][0] = data->pipes[fd][1] = -1;
+    }
+  if(using_stdin)
+    data->parent_ends[0] = &(data->ends[0]);
+  if(using_stdout)
+    data->parent_ends[1] = &(data->ends[1]);
+  if(using_stderr)
+    data->parent_ends[2] = &(data->ends[2]);
+  g_task_set_task_data(task, data, (GDestroyNotify)gksu_launcher_spawn_data_free);
+
+#ifdef USE_HELPER
+  if((helper_fd != -1) &&
+     gksu_launcher_spawn_with_helper(working_directory, argv, envp, task))
+    return;
+#endif
+
+  gksu_launcher_spawn(working_directory, argv, envp, data->parent_ends[0],
+                      data->parent_ends[1], data->parent_ends[2], &(data->pid),
+                      &error);
+  gksu_launcher_spawn_return(task, error);
+}
+
+/**
+ * gksu_launcher_spawn_finish:
+ *
+ * Gets what gksu_launcher_spawn_async() was after: the child's pid
+ * and the parent's ends of the pipes that were asked for.
+ *
+ * Returns: %FALSE if @error is set, %TRUE if the child is running
+ */
+gboolean gksu_launcher_spawn_finish(GAsyncResult *result, gint *standard_input,
+                                    gint *standard_output, gint *standard_error,
+                                    GPid *child_pid, GError **error)
+{
+  GksuLauncherSpawnData *data;
+
+  g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+
+  if(!g_task_propagate_boolean(G_TASK(result), error))
+    return FALSE;
+
+  data = g_task_get_task_data(G_TASK(result));
+
+  if(standard_input)
+    *standard_input = data->ends[0];
+  if(standard_output)
+    *standard_output = data->ends[1];
+  if(standard_error)
+    *standard_error = data->ends[2];
+  if(child_pid)
+    *child_pid = data->pid;
+
+  return TRUE;
+}
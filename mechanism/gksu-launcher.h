@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+
+#ifndef __GKSU_LAUNCHER_H__
+#define __GKSU_LAUNCHER_H__ 1
+
+#include <glib.h>
+#include <gio/gio.h>
+
+/* the argument the server is run with to be the launcher helper */
+#define GKSU_LAUNCHER_HELPER_ARG "--launcher-helper"
+
+gboolean gksu_launcher_spawn(const gchar *working_directory, gchar **argv, gchar **envp,
+                             gint *standard_input, gint *standard_output,
+                             gint *standard_error, GPid *child_pid, GError **error);
+
+void gksu_launcher_spawn_async(const gchar *working_directory, gchar **argv, gchar **envp,
+                               gboolean using_stdin, gboolean using_stdout,
+                               gboolean using_stderr, GAsyncReadyCallback callback,
+                               gpointer user_data);
+
+gboolean gksu_launcher_spawn_finish(GAsyncResult *result, gint *standard_input,
+                                    gint *standard_output, gint *standard_error,
+                                    GPid *child_pid, GError **error);
+
+void gksu_launcher_start_helper(void);
+
+gint gksu_launcher_helper_main(gint fd);
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include "gksu-process-table.h"
+
+/*
+ * The server's processes, running or waiting to be waited for, live
+ * in the slots of this table. Slots are allocated in blocks which
+ * never move, so entries may be held on to, and freed slots are kept
+ * in a list to be reused first, so a server going through many short
+ * lived processes keeps using the same few slots.
+ *
+ * The handle given out for an entry, which is the cookie clients get,
+ * is 32 random bits from the kernel, as unguessable as the wire
+ * format allows, and unique among the entries in use; a hash table
+ * takes it to the entry's slot. A handle for a process that has been
+ * waited for only matches a new one if the random bits come out the
+ * same again.
+ */
+
+#define GKSU_PROCESS_TABLE_BLOCK_SIZE 64
+
+struct _GksuProcessTable {
+  /* of GKSU_PROCESS_TABLE_BLOCK_SIZE entries each */
+  GPtrArray *blocks;
+  guint n_slots;
+  guint n_used;
+
+  /* index + 1 of the first free slot, or 0 */
+  guint free_head;
+
+  /* handle -> index + 1, for the slots in use */
+  GHashTable *handles;
+};
+
+/*
+ * Random bits for a handle: from getrandom() where there is one, or
+ * else from /dev/urandom; GRand is only the last resort, as it is not
+ * meant to keep secrets.
+ */
+static guint32 gksu_process_table_random(void)
+{
+  static gint urandom = -1;
+  guint32 value;
+  gssize count;
+
+#ifdef HAVE_GETRANDOM
+  do
+    count = getrandom(&value, sizeof(value), 0);
+  while((count == -1) && (errno == EINTR));
+  if(count == sizeof(value))
+    return value;
+#endif
+
+  if(urandom == -1)
+    urandom = open("/dev/urandom", O_RDONLY|O_CLOEXEC);
+
+  if(urandom != -1)
+    {
+      do
+        count = read(urandom, &value, sizeof(value));
+      while((count == -1) && (errno == EINTR));
+      if(count == sizeof(value))
+        return value;
+    }
+
+  return g_random_int();
+}
+
+static GksuProcessEntry* gksu_process_table_slot(GksuProcessTable *self, guint index)
+{
+  GksuProcessEntry *block;
+
+  block = g_ptr_array_index(self->blocks, index / GKSU_PROCESS_TABLE_BLOCK_SIZE);
+  return &block[index % GKSU_PROCESS_TABLE_BLOCK_SIZE];
+}
+
+static void gksu_process_table_clear_entry(GksuProcessEntry *entry)
+{
+  if(entry->controller)
+    g_object_unref(entry->controller);
+  if(entry->process)
+    g_object_unref(entry->process);
+  g_free(entry->owner);
+  g_free(entry->pending_stdout);
+  g_free(entry->pending_stderr);
+
+  entry->controller = NULL;
+  entry->process = NULL;
+  entry->owner = NULL;
+  entry->pending_stdout = NULL;
+  entry->pending_stdout_length = 0;
+  entry->pending_stderr = NULL;
+  entry->pending_stderr_length = 0;
+  entry->status = 0;
+  entry->age = 0;
+  entry->state = GKSU_PROCESS_ENTRY_FREE;
+}
+
+GksuProcessTable* gksu_process_table_new(void)
+{
+  GksuProcessTable *self = g_slice_new0(GksuProcessTable);
+
+  self->blocks = g_ptr_array_new();
+  self->handles = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+  return self;
+}
+
+void gksu_process_table_free(GksuProcessTable *self)
+{
+  guint index;
+
+  for(index = 0; index < self->n_slots; index++)
+    gksu_process_table_clear_entry(gksu_process_table_slot(self, index));
+
+  g_ptr_array_foreach(self->blocks, (GFunc)g_free, NULL);
+  g_ptr_array_free(self->blocks, TRUE);
+  g_hash_table_destroy(self->handles);
+  g_slice_free(GksuProcessTable, self);
+}
+
+/*
+ * Takes a free slot, growing the table if there is none, and gives it
+ * a fresh handle; the entry is in the starting state until the
+ * process is actually running.
+ */
+GksuProcessEntry* gksu_process_table_add(GksuProcessTable *self)
+{
+  GksuProcessEntry *entry;
+  guint index;
+
+  if(self->free_head)
+    {
+      index = self->free_head - 1;
+      entry = gksu_process_table_slot(self, index);
+      self->free_head = entry->next_free;
+    }
+  else
+    {
+      if((self->n_slots % GKSU_PROCESS_TABLE_BLOCK_SIZE) == 0)
+        g_ptr_array_add(self->blocks,
+                        g_new0(GksuProcessEntry, GKSU_PROCESS_TABLE_BLOCK_SIZE));
+
+      index = self->n_slots++;
+      entry = gksu_process_table_slot(self, index);
+    }
+
+  /* 0 is never a handle */
+  do
+    entry->handle = gksu_process_table_random();
+  while((entry->handle == 0) ||
+        g_hash_table_lookup(self->handles, GUINT_TO_POINTER(entry->handle)));
+  g_hash_table_insert(self->handles, GUINT_TO_POINTER(entry->handle),
+                      GUINT_TO_POINTER(index + 1));
+
+  entry->index = index;
+  entry->state = GKSU_PROCESS_ENTRY_STARTING;
+  entry->next_free = 0;
+
+  self->n_used++;
+
+  return entry;
+}
+
+GksuProcessEntry* gksu_process_table_lookup(GksuProcessTable *self, guint32 handle)
+{
+  GksuProcessEntry *entry;
+  guint index;
+
+  index = GPOINTER_TO_UINT(g_hash_table_lookup(self->handles, GUINT_TO_POINTER(handle)));
+  if(index == 0)
+    return NULL;
+
+  entry = gksu_process_table_slot(self, index - 1);
+  if((entry->state == GKSU_PROCESS_ENTRY_FREE) || (entry->handle != handle))
+    return NULL;
+
+  return entry;
+}
+
+/*
+ * Frees @entry's slot, and drops what it holds.
+ */
+void gksu_process_table_remove(GksuProcessTable *self, GksuProcessEntry *entry)
+{
+  GksuController *controller = entry->controller;
+  GksuServerProcess *process = entry->process;
+
+  g_return_if_fail(entry->state != GKSU_PROCESS_ENTRY_FREE);
+
+  /* the slot is reusable before the objects go away, in case their
+   * finalization calls back into us */
+  entry->controller = NULL;
+  entry->process = NULL;
+  gksu_process_table_clear_entry(entry);
+  g_hash_table_remove(self->handles, GUINT_TO_POINTER(entry->handle));
+
+  entry->next_free = self->free_head;
+  self->free_head = entry->index + 1;
+  self->n_used--;
+
+  if(controller)
+    g_object_unref(controller);
+  if(process)
+    g_object_unref(process);
+}
+
+/*
+ * How many slots are in use.
+ */
+guint gksu_process_table_size(GksuProcessTable *self)
+{
+  return self->n_used;
+}
+
+/*
+ * Calls @func for each entry in use; @func may remove the entry it is
+ * given.
+ */
+void gksu_process_table_foreach(GksuProcessTable *self, GksuProcessTableFunc func,
+                                gpointer data)
+{
+  guint index;
+
+  for(index = 0; index < self->n_slots; index++)
+    {
+      GksuProcessEntry *entry = gksu_process_table_slot(self, index);
+
+      if(entry->state != GKSU_PROCESS_ENTRY_FREE)
+        func(entry, data);
+    }
+}
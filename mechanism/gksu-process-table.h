@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GKSU_PROCESS_TABLE_H__
+#define __GKSU_PROCESS_TABLE_H__ 1
+
+#include <glib.h>
+
+#include "gksu-controller.h"
+#include "gksu-server-process.h"
+
+typedef enum
+  {
+    GKSU_PROCESS_ENTRY_FREE,
+    GKSU_PROCESS_ENTRY_STARTING,
+    GKSU_PROCESS_ENTRY_RUNNING,
+    GKSU_PROCESS_ENTRY_ZOMBIE
+  } GksuProcessEntryState;
+
+/*
+ * One slot of the table: a process from its spawn until it is waited
+ * for. The table owns the references and strings in it, and drops
+ * them when the slot is freed.
+ */
+typedef struct {
+  guint32 handle;
+  GksuProcessEntryState state;
+  gchar *owner;
+
+  /* while starting or running */
+  GksuController *controller;
+
+  /* the process' D-Bus object, if it has one */
+  GksuServerProcess *process;
+
+  /* once exited, until waited for */
+  gint status;
+  gint age;
+  gchar *pending_stdout;
+  gsize pending_stdout_length;
+  gchar *pending_stderr;
+  gsize pending_stderr_length;
+
+  /* private; the slot's own index, and index + 1 of the next free
+   * slot */
+  guint index;
+  guint next_free;
+} GksuProcessEntry;
+
+typedef struct _GksuProcessTable GksuProcessTable;
+
+typedef void (*GksuProcessTableFunc) (GksuProcessEntry *entry, gpointer data);
+
+GksuProcessTable* gksu_process_table_new(void);
+
+void gksu_process_table_free(GksuProcessTable *self);
+
+GksuProcessEntry* gksu_process_table_add(GksuProcessTable *self);
+
+GksuProcessEntry* gksu_process_table_lookup(GksuProcessTable *self, guint32 handle);
+
+void gksu_process_table_remove(GksuProcessTable *self, GksuProcessEntry *entry);
+
+guint gksu_process_table_size(GksuProcessTable *self);
+
+void gksu_process_table_foreach(GksuProcessTable *self, GksuProcessTableFunc func,
+                                gpointer data);
+
+#endif
@@ -0,0 +1,605 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <glib-object.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include <gksu-dbus.h>
+
+#include "gksu-controller.h"
+#include "gksu-server.h"
+#include "gksu-server-process.h"
+
+/*
+ * A GksuServerProcess is the D-Bus face of one spawned process, at
+ * /org/gnome/Gksu/Process/<id>. Its methods are the cookie-taking
+ * methods of org.gnome.Gksu, bound to this process; the ids are not
+ * secret, so only the process' owner may call them. Once the owner
+ * has asked for it, it goes away as soon as the child exits, its
+ * Exited signal carrying all that was left to tell; otherwise it
+ * lives on after the child exits, until the process is waited for.
+ *
+ * The owner may also ask for a private channel: a D-Bus connection
+ * over a socketpair, on which the same object is exported, and over
+ * which its signals are then sent, keeping the bulk of the traffic
+ * away from the bus daemon.
+ */
+
+G_DEFINE_TYPE(GksuServerProcess, gksu_server_process, G_TYPE_OBJECT);
+
+struct _GksuServerProcessPrivate {
+  /* not a reference; the server outlives every process */
+  GksuServer *server;
+
+  /* only set while the child is running */
+  GksuController *controller;
+
+  /* the exported org.gnome.Gksu.Process, which also holds the
+   * properties */
+  GksuDBusGksuProcess *skeleton;
+
+  /* the system bus, and the private connection to the owner, if
+   * OpenChannel was called */
+  GDBusConnection *connection;
+  GDBusConnection *channel;
+
+  gchar *path;
+  gchar *owner;
+  guint32 cookie;
+
+  /* the owner asked for this object, and gets the notifications about
+   * the process through it instead of through /org/gnome/Gksu */
+  gboolean attached;
+
+  guint refresh_source_id;
+};
+
+#define GKSU_SERVER_PROCESS_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_SERVER_PROCESS, GksuServerProcessPrivate))
+
+/* how often BytesRelayed is brought up to date while the child runs;
+ * doing it on every read would mean a PropertiesChanged each time */
+#define BYTES_RELAYED_REFRESH_DELAY 1
+
+static void gksu_server_process_forget_controller(GksuServerProcess *self)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+
+  if(priv->refresh_source_id)
+    {
+      g_source_remove(priv->refresh_source_id);
+      priv->refresh_source_id = 0;
+    }
+
+  if(priv->controller)
+    {
+      g_object_remove_weak_pointer(G_OBJECT(priv->controller),
+                                   (gpointer*)&(priv->controller));
+      priv->controller = NULL;
+    }
+}
+
+static void gksu_server_process_channel_flushed_cb(GDBusConnection *channel,
+                                                   GAsyncResult *result,
+                                                   gpointer data)
+{
+  g_dbus_connection_flush_finish(channel, result, NULL);
+  g_dbus_connection_close(channel, NULL, NULL, NULL);
+  g_object_unref(channel);
+}
+
+static gboolean gksu_server_process_close_channel_cb(GDBusConnection *channel)
+{
+  g_dbus_connection_flush(channel, NULL,
+                          (GAsyncReadyCallback)gksu_server_process_channel_flushed_cb,
+                          NULL);
+  return FALSE;
+}
+
+static void gksu_server_process_drop_channel(GksuServerProcess *self)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+
+  if(priv->channel == NULL)
+    return;
+
+  g_signal_handlers_disconnect_matched(priv->channel, G_SIGNAL_MATCH_DATA,
+                                       0, 0, NULL, NULL, self);
+  if(priv->skeleton)
+    g_dbus_interface_skeleton_unexport_from_connection(G_DBUS_INTERFACE_SKELETON(priv->skeleton),
+                                                       priv->channel);
+
+  /* the reply to a Wait that got us here is only sent once we
+   * return, and must not be lost */
+  if(!g_dbus_connection_is_closed(priv->channel))
+    g_idle_add((GSourceFunc)gksu_server_process_close_channel_cb, priv->channel);
+  else
+    g_object_unref(priv->channel);
+
+  priv->channel = NULL;
+}
+
+static void gksu_server_process_dispose(GObject *object)
+{
+  GksuServerProcess *self = GKSU_SERVER_PROCESS(object);
+  GksuServerProcessPrivate *priv = self->priv;
+
+  gksu_server_process_forget_controller(self);
+  gksu_server_process_drop_channel(self);
+
+  if(priv->skeleton)
+    {
+      /* GDBus may still be holding the skeleton for a call that is
+       * being dispatched */
+      g_signal_handlers_disconnect_matched(priv->skeleton, G_SIGNAL_MATCH_DATA,
+                                           0, 0, NULL, NULL, self);
+      g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(priv->skeleton));
+      g_object_unref(priv->skeleton);
+      priv->skeleton = NULL;
+    }
+
+  if(priv->connection)
+    {
+      g_object_unref(priv->connection);
+      priv->connection = NULL;
+    }
+
+  G_OBJECT_CLASS(gksu_server_process_parent_class)->dispose(object);
+}
+
+static void gksu_server_process_finalize(GObject *object)
+{
+  GksuServerProcess *self = GKSU_SERVER_PROCESS(object);
+  GksuServerProcessPrivate *priv = self->priv;
+
+  g_free(priv->path);
+  g_free(priv->owner);
+
+  G_OBJECT_CLASS(gksu_server_process_parent_class)->finalize(object);
+}
+
+static void gksu_server_process_class_init(GksuServerProcessClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+  object_class->dispose = gksu_server_process_dispose;
+  object_class->finalize = gksu_server_process_finalize;
+
+  g_type_class_add_private(klass, sizeof(GksuServerProcessPrivate));
+}
+
+static void gksu_server_process_init(GksuServerProcess *self)
+{
+  self->priv = GKSU_SERVER_PROCESS_GET_PRIVATE(self);
+}
+
+/*
+ * The paths are easy to guess, unlike cookies, so only the name that
+ * spawned the process may call its methods; each handler starts by
+ * asking this, and returns right away if it replied with an error.
+ * Reading the properties is open to anyone the bus lets through.
+ * Whoever is at the other end of the private channel got it from the
+ * owner.
+ *
+ * This is not done from g-authorize-method, because having a handler
+ * there makes GDBus run each call in a thread of its own, and the
+ * calls of a single client, WriteInput and CloseFD for instance, could
+ * then overtake each other.
+ */
+static gboolean gksu_server_process_check_caller(GksuServerProcess *self,
+                                                 GDBusMethodInvocation *invocation)
+{
+  if((self->priv->channel != NULL) &&
+     (g_dbus_method_invocation_get_connection(invocation) == self->priv->channel))
+    return TRUE;
+
+  if(!g_strcmp0(g_dbus_method_invocation_get_sender(invocation), self->priv->owner))
+    return TRUE;
+
+  g_dbus_method_invocation_return_error_literal(invocation, G_DBUS_ERROR,
+                                                G_DBUS_ERROR_ACCESS_DENIED,
+                                                "Only the process' owner may do this.");
+  return FALSE;
+}
+
+static gboolean gksu_server_process_handle_read_output(GksuDBusGksuProcess *skeleton,
+                                                       GDBusMethodInvocation *invocation,
+                                                       gint fd, GksuServerProcess *self)
+{
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  gksu_server_read_output_bytes(self->priv->server, self->priv->cookie,
+                                fd, invocation);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_write_input(GksuDBusGksuProcess *skeleton,
+                                                       GDBusMethodInvocation *invocation,
+                                                       GVariant *data,
+                                                       GksuServerProcess *self)
+{
+  const gchar *bytes;
+  gsize length;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  bytes = g_variant_get_fixed_array(data, &length, 1);
+  gksu_server_write_input(self->priv->server, self->priv->cookie,
+                          bytes, length, invocation);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_start_streaming(GksuDBusGksuProcess *skeleton,
+                                                           GDBusMethodInvocation *invocation,
+                                                           GksuServerProcess *self)
+{
+  GError *error = NULL;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  gksu_server_start_streaming(self->priv->server, self->priv->cookie, &error);
+  gksu_server_complete_call(invocation, error);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_set_output_paused(GksuDBusGksuProcess *skeleton,
+                                                             GDBusMethodInvocation *invocation,
+                                                             gint fd, gboolean paused,
+                                                             GksuServerProcess *self)
+{
+  GError *error = NULL;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  gksu_server_set_output_paused(self->priv->server, self->priv->cookie,
+                                fd, paused, &error);
+  gksu_server_complete_call(invocation, error);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_set_io_weight(GksuDBusGksuProcess *skeleton,
+                                                         GDBusMethodInvocation *invocation,
+                                                         guint weight,
+                                                         GksuServerProcess *self)
+{
+  GError *error = NULL;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  gksu_server_set_io_weight(self->priv->server, self->priv->cookie,
+                            weight, &error);
+  gksu_server_complete_call(invocation, error);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_close_fd(GksuDBusGksuProcess *skeleton,
+                                                    GDBusMethodInvocation *invocation,
+                                                    gint fd, GksuServerProcess *self)
+{
+  GError *error = NULL;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  gksu_server_close_fd(self->priv->server, self->priv->cookie, fd, &error);
+  gksu_server_complete_call(invocation, error);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_send_signal(GksuDBusGksuProcess *skeleton,
+                                                       GDBusMethodInvocation *invocation,
+                                                       gint signum, GksuServerProcess *self)
+{
+  GError *error = NULL;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  gksu_server_send_signal(self->priv->server, self->priv->cookie, signum, &error);
+  gksu_server_complete_call(invocation, error);
+  return TRUE;
+}
+
+static gboolean gksu_server_process_handle_wait(GksuDBusGksuProcess *skeleton,
+                                                GDBusMethodInvocation *invocation,
+                                                GksuServerProcess *self)
+{
+  GError *error = NULL;
+  gint status;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  /* waiting makes the server drop us, so self is gone after this;
+   * the skeleton is kept alive by the signal emission */
+  if(!gksu_server_wait(self->priv->server, self->priv->cookie, &status, &error))
+    {
+      gksu_server_complete_call(invocation, error);
+      return TRUE;
+    }
+
+  gksu_dbus_gksu_process_complete_wait(skeleton, invocation, status);
+  return TRUE;
+}
+
+static void gksu_server_process_channel_closed_cb(GDBusConnection *channel,
+                                                 gboolean remote_peer_vanished,
+                                                 GError *error,
+                                                 GksuServerProcess *self)
+{
+  /* back to the bus, then */
+  gksu_server_process_drop_channel(self);
+}
+
+static void gksu_server_process_channel_ready_cb(GObject *source, GAsyncResult *result,
+                                                 GksuServerProcess *self)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+  GDBusConnection *channel;
+  GError *error = NULL;
+
+  channel = g_dbus_connection_new_finish(result, &error);
+  if(error)
+    {
+      g_warning("Unable to set up the private channel for %s: %s",
+                priv->path, error->message);
+      g_error_free(error);
+      g_object_unref(self);
+      return;
+    }
+
+  if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(priv->skeleton),
+                                       channel, priv->path, &error))
+    {
+      g_warning("Unable to export %s on the private channel: %s",
+                priv->path, error->message);
+      g_error_free(error);
+      g_dbus_connection_close(channel, NULL, NULL, NULL);
+      g_object_unref(channel);
+      g_object_unref(self);
+      return;
+    }
+
+  priv->channel = channel;
+  g_signal_connect(channel, "closed",
+                   G_CALLBACK(gksu_server_process_channel_closed_cb), self);
+
+  /* nothing the peer sent was looked at until now, so no call can
+   * have found the object missing */
+  g_dbus_connection_start_message_processing(channel);
+
+  g_object_unref(self);
+}
+
+/*
+ * Hands the owner one end of a socketpair, and speaks D-Bus, peer to
+ * peer, on the other. Authorization was done on the bus: only the
+ * owner gets this far.
+ */
+static gboolean gksu_server_process_handle_open_channel(GksuDBusGksuProcess *skeleton,
+                                                        GDBusMethodInvocation *invocation,
+                                                        GUnixFDList *in_fds,
+                                                        GksuServerProcess *self)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+  GSocket *socket;
+  GSocketConnection *stream;
+  GUnixFDList *fd_list;
+  GError *error = NULL;
+  gchar *guid;
+  gint sockets[2];
+  gint handle;
+
+  if(!gksu_server_process_check_caller(self, invocation))
+    return TRUE;
+
+  if(g_dbus_method_invocation_get_connection(invocation) != priv->connection)
+    {
+      g_dbus_method_invocation_return_error_literal(invocation, G_DBUS_ERROR,
+                                                    G_DBUS_ERROR_NOT_SUPPORTED,
+                                                    "Already on the private channel.");
+      return TRUE;
+    }
+
+  if(priv->channel)
+    {
+      g_dbus_method_invocation_return_error_literal(invocation, G_DBUS_ERROR,
+                                                    G_DBUS_ERROR_LIMITS_EXCEEDED,
+                                                    "The process already has a private channel.");
+      return TRUE;
+    }
+
+  if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1)
+    {
+      g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                            "socketpair: %s", g_strerror(errno));
+      return TRUE;
+    }
+
+  socket = g_socket_new_from_fd(sockets[0], &error);
+  if(socket == NULL)
+    {
+      close(sockets[0]);
+      close(sockets[1]);
+      gksu_server_complete_call(invocation, error);
+      return TRUE;
+    }
+
+  fd_list = g_unix_fd_list_new();
+  handle = g_unix_fd_list_append(fd_list, sockets[1], &error);
+  close(sockets[1]);
+  if(handle == -1)
+    {
+      g_object_unref(fd_list);
+      g_object_unref(socket);
+      gksu_server_complete_call(invocation, error);
+      return TRUE;
+    }
+
+  /* the handshake happens in GDBus' thread; incoming calls are held
+   * until the object has been exported there */
+  stream = g_socket_connection_factory_create_connection(socket);
+  guid = g_dbus_generate_guid();
+  g_dbus_connection_new(G_IO_STREAM(stream), guid,
+                        G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+                        G_DBUS_CONNECTION_FLAGS_DELAY_MESSAGE_PROCESSING,
+                        NULL, NULL,
+                        (GAsyncReadyCallback)gksu_server_process_channel_ready_cb,
+                        g_object_ref(self));
+  g_free(guid);
+  g_object_unref(stream);
+  g_object_unref(socket);
+
+  priv->attached = TRUE;
+
+  gksu_dbus_gksu_process_complete_open_channel(skeleton, invocation, fd_list, handle);
+  g_object_unref(fd_list);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_process_refresh_cb(GksuServerProcess *self)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+
+  /* the skeleton only tells about it if it changed */
+  if(priv->controller)
+    gksu_dbus_gksu_process_set_bytes_relayed(priv->skeleton,
+                                             gksu_controller_get_bytes_relayed(priv->controller));
+
+  return TRUE;
+}
+
+GksuServerProcess* gksu_server_process_new(GksuServer *server, GksuController *controller,
+                                           GDBusConnection *connection, guint id)
+{
+  GksuServerProcess *self = g_object_new(GKSU_TYPE_SERVER_PROCESS, NULL);
+  GksuServerProcessPrivate *priv = self->priv;
+  GError *error = NULL;
+
+  priv->server = server;
+  priv->controller = controller;
+  g_object_add_weak_pointer(G_OBJECT(controller), (gpointer*)&(priv->controller));
+
+  priv->path = g_strdup_printf(GKSU_SERVER_PROCESS_PATH_PREFIX "%u", id);
+  priv->owner = g_strdup(gksu_controller_get_owner(controller));
+  priv->cookie = gksu_controller_get_cookie(controller);
+  priv->connection = g_object_ref(connection);
+
+  priv->skeleton = gksu_dbus_gksu_process_skeleton_new();
+  gksu_dbus_gksu_process_set_pid(priv->skeleton, gksu_controller_get_pid(controller));
+  gksu_dbus_gksu_process_set_state(priv->skeleton, "running");
+
+  g_signal_connect(priv->skeleton, "handle-read-output",
+                   G_CALLBACK(gksu_server_process_handle_read_output), self);
+  g_signal_connect(priv->skeleton, "handle-write-input",
+                   G_CALLBACK(gksu_server_process_handle_write_input), self);
+  g_signal_connect(priv->skeleton, "handle-start-streaming",
+                   G_CALLBACK(gksu_server_process_handle_start_streaming), self);
+  g_signal_connect(priv->skeleton, "handle-set-output-paused",
+                   G_CALLBACK(gksu_server_process_handle_set_output_paused), self);
+  g_signal_connect(priv->skeleton, "handle-set-io-weight",
+                   G_CALLBACK(gksu_server_process_handle_set_io_weight), self);
+  g_signal_connect(priv->skeleton, "handle-close-fd",
+                   G_CALLBACK(gksu_server_process_handle_close_fd), self);
+  g_signal_connect(priv->skeleton, "handle-send-signal",
+                   G_CALLBACK(gksu_server_process_handle_send_signal), self);
+  g_signal_connect(priv->skeleton, "handle-wait",
+                   G_CALLBACK(gksu_server_process_handle_wait), self);
+  g_signal_connect(priv->skeleton, "handle-open-channel",
+                   G_CALLBACK(gksu_server_process_handle_open_channel), self);
+
+  if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(priv->skeleton),
+                                       connection, priv->path, &error))
+    {
+      g_warning("Unable to export %s: %s", priv->path, error->message);
+      g_error_free(error);
+    }
+
+  priv->refresh_source_id =
+    g_timeout_add_seconds(BYTES_RELAYED_REFRESH_DELAY,
+                          (GSourceFunc)gksu_server_process_refresh_cb, self);
+
+  return self;
+}
+
+const gchar* gksu_server_process_get_path(GksuServerProcess *self)
+{
+  return self->priv->path;
+}
+
+const gchar* gksu_server_process_get_owner(GksuServerProcess *self)
+{
+  return self->priv->owner;
+}
+
+void gksu_server_process_set_attached(GksuServerProcess *self)
+{
+  self->priv->attached = TRUE;
+}
+
+gboolean gksu_server_process_is_attached(GksuServerProcess *self)
+{
+  return self->priv->attached;
+}
+
+/*
+ * Sends one of org.gnome.Gksu.Process' signals to the owner: on the
+ * private channel if there is one, or else on the bus, addressed to
+ * the owner only. @parameters is consumed if floating.
+ */
+void gksu_server_process_emit_signal(GksuServerProcess *self, const gchar *name,
+                                     GVariant *parameters)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+
+  if(priv->channel)
+    g_dbus_connection_emit_signal(priv->channel, NULL, priv->path,
+                                  GKSU_SERVER_PROCESS_INTERFACE, name,
+                                  parameters, NULL);
+  else
+    g_dbus_connection_emit_signal(priv->connection, priv->owner, priv->path,
+                                  GKSU_SERVER_PROCESS_INTERFACE, name,
+                                  parameters, NULL);
+}
+
+/*
+ * Called when the child is gone; whatever we want to keep telling
+ * about it is taken from the controller now.
+ */
+void gksu_server_process_set_exited(GksuServerProcess *self, gint status)
+{
+  GksuServerProcessPrivate *priv = self->priv;
+
+  gksu_server_process_refresh_cb(self);
+  gksu_server_process_forget_controller(self);
+
+  gksu_dbus_gksu_process_set_exit_status(priv->skeleton, status);
+  gksu_dbus_gksu_process_set_state(priv->skeleton, "exited");
+}
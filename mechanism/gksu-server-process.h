@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2008 Gustavo Noronha Silva
+ *
+ * This file is part of the Gksu PolicyKit Mechanism.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.  You should have received
+ * a copy of the GNU General Public License along with this program;
+ * if not, write to the Free Software Foundation, Inc., 59 Temple
+ * Place, Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __GKSU_SERVER_PROCESS_H__
+#define __GKSU_SERVER_PROCESS_H__ 1
+
+#include <glib-object.h>
+#include <gio/gio.h>
+
+#include "gksu-controller.h"
+#include "gksu-server.h"
+
+#define GKSU_SERVER_PROCESS_INTERFACE "org.gnome.Gksu.Process"
+#define GKSU_SERVER_PROCESS_PATH_PREFIX "/org/gnome/Gksu/Process/"
+
+typedef struct _GksuServerProcessPrivate GksuServerProcessPrivate;
+
+typedef struct {
+  GObject parent;
+  GksuServerProcessPrivate *priv;
+} GksuServerProcess;
+
+typedef struct {
+  GObjectClass parent;
+} GksuServerProcessClass;
+
+GType gksu_server_process_get_type(void);
+
+#define GKSU_TYPE_SERVER_PROCESS (gksu_server_process_get_type())
+#define GKSU_SERVER_PROCESS(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GKSU_TYPE_SERVER_PROCESS, GksuServerProcess))
+#define GKSU_SERVER_PROCESS_GET_CLASS(object)  (G_TYPE_INSTANCE_GET_CLASS ((object), GKSU_TYPE_SERVER_PROCESS, GksuServerProcessClass))
+
+GksuServerProcess* gksu_server_process_new(GksuServer *server, GksuController *controller,
+                                           GDBusConnection *connection, guint id);
+
+const gchar* gksu_server_process_get_path(GksuServerProcess *self);
+const gchar* gksu_server_process_get_owner(GksuServerProcess *self);
+
+void gksu_server_process_set_attached(GksuServerProcess *self);
+gboolean gksu_server_process_is_attached(GksuServerProcess *self);
+
+void gksu_server_process_emit_signal(GksuServerProcess *self, const gchar *name,
+                                     GVariant *parameters);
+
+void gksu_server_process_set_exited(GksuServerProcess *self, gint status);
+
+#endif
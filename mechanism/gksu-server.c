@@ -19,42 +19,72 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <glib.h>
 #include <glib-object.h>
-#include <dbus/dbus-glib.h>
-#include <dbus/dbus-glib-lowlevel.h>
-#include <dbus/dbus.h>
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <polkit/polkit.h>
 
+#include <gksu-dbus.h>
 #include <gksu-error.h>
-#include <gksu-marshal.h>
 
+#include "gksu-auth-cache.h"
 #include "gksu-controller.h"
+#include "gksu-io-scheduler.h"
+#include "gksu-process-table.h"
 #include "gksu-server.h"
-#include "gksu-server-service-glue.h"
+#include "gksu-server-process.h"
 
 static void gksu_server_init(GksuServer *self);
 static void gksu_server_class_init(GksuServerClass *klass);
-DBusHandlerResult gksu_server_handle_dbus_message(DBusConnection *conn,
-                                                  DBusMessage *message,
-                                                  void *user_data);
 
 G_DEFINE_TYPE(GksuServer, gksu_server, G_TYPE_OBJECT);
 
 struct _GksuServerPrivate {
-  DBusGConnection *dbus;
+  GDBusConnection *connection;
+  guint name_owner_id;
+
+  /* org.gnome.Gksu and org.gnome.Gksu2, at /org/gnome/Gksu; we
+   * register them ourselves, see gksu_server_method_call() */
+  GksuDBusGksu *manager;
+  GksuDBusGksu2 *manager2;
+  guint manager_id;
+  guint manager2_id;
+
   PolkitAuthority *authority;
-  GHashTable *controllers;
-  GHashTable *zombies;
+
+  /* spawn requests waiting for PolicyKit's answer; like the rest of
+   * this, only touched from the main loop, where both the calls and
+   * PolicyKit's answers are dispatched */
+  guint pending_authorizations;
+
+  /* PolicyKit's recent yeses, by caller */
+  GksuAuthCache *auth_cache;
+
+  /* every process, from its spawn until it is waited for, by cookie */
+  GksuProcessTable *table;
 
   guint shutdown_source_id;
+
+  /* 0 means the controllers' default */
+  gsize read_budget;
+
+  /* decides whose streamed output is read next */
+  GksuIOScheduler *scheduler;
+
+  /* for the processes' D-Bus object paths */
+  guint next_process_id;
 };
 
+/* bytes of streamed output each process gets to read per round, for
+ * each unit of I/O weight, unless a read budget was given */
+#define IO_SCHEDULER_QUANTUM 65536
+
 #define GKSU_SERVER_GET_PRIVATE(obj) (G_TYPE_INSTANCE_GET_PRIVATE((obj), GKSU_TYPE_SERVER, GksuServerPrivate))
 
 enum {
-  PROCESS_EXITED,
-  OUTPUT_AVAILABLE,
   SHUTDOWN,
 
   LAST_SIGNAL
@@ -65,24 +95,67 @@ static guint signals[LAST_SIGNAL] = {0,};
 #define ZOMBIE_CHECK_DELAY 300
 #define ZOMBIE_AGE_THRESHOLD 10
 
-typedef struct {
-  gint status;
-  gint age;
+/* seconds PolicyKit's yes to a caller is trusted for, by default */
+#define AUTH_CACHE_TTL 60
+
+#define GKSU_SERVER_SPAWN_ACTION "org.gnome.gksu.spawn"
 
-  gchar *pending_stdout;
-  gsize pending_stdout_length;
+/* how many commands a single SpawnMany call may start */
+#define GKSU_SERVER_MAX_BATCH 256
 
-  gchar *pending_stderr;
-  gsize pending_stderr_length;
-} GksuZombie;
+/* so that clients get proper D-Bus error names, instead of GDBus'
+ * generic encoding of unknown GErrors */
+static const GDBusErrorEntry gksu_server_error_entries[] = {
+  { GKSU_ERROR_INVALID_VARIABLE, "org.gnome.Gksu.Error.InvalidVariable" },
+  { GKSU_ERROR_PREPARE_XAUTH_FAILED, "org.gnome.Gksu.Error.PrepareXauthFailed" },
+  { GKSU_ERROR_PROCESS_NOT_FOUND, "org.gnome.Gksu.Error.ProcessNotFound" },
+  { GKSU_ERROR_KILL, "org.gnome.Gksu.Error.Kill" },
+  { GKSU_ERROR_FD_NOT_AVAILABLE, "org.gnome.Gksu.Error.FDNotAvailable" }
+};
 
 static void gksu_server_dispose(GObject *object)
 {
   GksuServer *self = GKSU_SERVER(object);
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
 
+  if(priv->name_owner_id)
+    {
+      g_bus_unown_name(priv->name_owner_id);
+      priv->name_owner_id = 0;
+    }
+
+  if(priv->manager_id)
+    {
+      g_dbus_connection_unregister_object(priv->connection, priv->manager_id);
+      priv->manager_id = 0;
+    }
+
+  if(priv->manager)
+    {
+      g_signal_handlers_disconnect_matched(priv->manager, G_SIGNAL_MATCH_DATA,
+                                           0, 0, NULL, NULL, self);
+      g_object_unref(priv->manager);
+      priv->manager = NULL;
+    }
+
+  if(priv->manager2_id)
+    {
+      g_dbus_connection_unregister_object(priv->connection, priv->manager2_id);
+      priv->manager2_id = 0;
+    }
+
+  if(priv->manager2)
+    {
+      g_signal_handlers_disconnect_matched(priv->manager2, G_SIGNAL_MATCH_DATA,
+                                           0, 0, NULL, NULL, self);
+      g_object_unref(priv->manager2);
+      priv->manager2 = NULL;
+    }
+
   if(priv->authority)
     {
+      g_signal_handlers_disconnect_matched(priv->authority, G_SIGNAL_MATCH_DATA,
+                                           0, 0, NULL, NULL, self);
       g_object_unref(priv->authority);
       priv->authority = NULL;
     }
@@ -95,40 +168,21 @@ static void gksu_server_finalize(GObject *object)
   GksuServer *self = GKSU_SERVER(object);
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
 
-  g_hash_table_destroy(priv->controllers);
-  g_hash_table_destroy(priv->zombies);
+  gksu_process_table_free(priv->table);
+  g_object_unref(priv->scheduler);
+  g_object_unref(priv->auth_cache);
+  g_object_unref(priv->connection);
 
   G_OBJECT_CLASS(gksu_server_parent_class)->finalize(object);
 }
 
 static void gksu_server_class_init(GksuServerClass *klass)
 {
+  static volatile gsize error_quark = 0;
+
   G_OBJECT_CLASS(klass)->finalize = gksu_server_finalize;
   G_OBJECT_CLASS(klass)->dispose = gksu_server_dispose;
 
-  signals[PROCESS_EXITED] =
-    g_signal_new("process-exited",
-                 GKSU_TYPE_SERVER,
-                 G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
-                 0,
-                 NULL,
-                 NULL,
-                 g_cclosure_marshal_VOID__INT,
-                 G_TYPE_NONE, 1,
-                 G_TYPE_INT);
-
-  signals[OUTPUT_AVAILABLE] =
-    g_signal_new("output-available",
-                 GKSU_TYPE_SERVER,
-                 G_SIGNAL_RUN_LAST | G_SIGNAL_DETAILED,
-                 0,
-                 NULL,
-                 NULL,
-                 gksu_marshal_VOID__INT_INT,
-                 G_TYPE_NONE, 2,
-                 G_TYPE_INT,
-                 G_TYPE_INT);
-
   /* not a dbus signal; just to signal that we want to quit */
   signals[SHUTDOWN] =
     g_signal_new("shutdown",
@@ -140,162 +194,286 @@ static void gksu_server_class_init(GksuServerClass *klass)
                  g_cclosure_marshal_VOID__VOID,
                  G_TYPE_NONE, 0);
 
+  g_dbus_error_register_error_domain("gksu-error", &error_quark,
+                                     gksu_server_error_entries,
+                                     G_N_ELEMENTS(gksu_server_error_entries));
+
   g_type_class_add_private(klass, sizeof(GksuServerPrivate));
 }
 
+/*
+ * Finishes a call whose only answer, other than an error, is an empty
+ * reply; takes @error over.
+ */
+void gksu_server_complete_call(GDBusMethodInvocation *invocation, GError *error)
+{
+  if(error)
+    {
+      g_dbus_method_invocation_return_gerror(invocation, error);
+      g_error_free(error);
+      return;
+    }
+
+  g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+/*
+ * Sends one of org.gnome.Gksu's process-related signals to the
+ * process' owner only, instead of waking every client on the bus up
+ * for each event. @parameters is consumed if floating.
+ */
+static void gksu_server_send_to_owner(GksuServer *self, GksuController *controller,
+                                      const gchar *name, GVariant *parameters)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+
+  g_dbus_connection_emit_signal(priv->connection,
+                                gksu_controller_get_owner(controller),
+                                "/org/gnome/Gksu", "org.gnome.Gksu",
+                                name, parameters, NULL);
+}
+
+/*
+ * The controller of a process that is still running, or %NULL.
+ */
+static GksuController* gksu_server_lookup_controller(GksuServer *self, guint32 cookie)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GksuProcessEntry *entry = gksu_process_table_lookup(priv->table, cookie);
+
+  if((entry == NULL) || (entry->state != GKSU_PROCESS_ENTRY_RUNNING))
+    return NULL;
+
+  return entry->controller;
+}
+
+static GksuServerProcess* gksu_server_lookup_process(GksuServer *self, guint32 cookie)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GksuProcessEntry *entry = gksu_process_table_lookup(priv->table, cookie);
+
+  if(entry == NULL)
+    return NULL;
+
+  return entry->process;
+}
+
+/*
+ * Once the owner has asked for the process' object, notifications
+ * about it go there, so that they can be matched by path, or through
+ * the process' private channel if it has one; otherwise they go
+ * through /org/gnome/Gksu, as they always did.
+ */
+static GksuServerProcess* gksu_server_get_attached_process(GksuServer *self,
+                                                           GksuController *controller)
+{
+  GksuServerProcess *process;
+
+  process = gksu_server_lookup_process(self, gksu_controller_get_cookie(controller));
+  if((process == NULL) || !gksu_server_process_is_attached(process))
+    return NULL;
+
+  return process;
+}
+
+static void gksu_server_check_shutdown(GksuServer *self);
+
+/*
+ * Reads all the output the child left in @fd's pipe, as an 'ay'.
+ */
+static GVariant* gksu_server_remaining_output(GksuController *controller, gint fd)
+{
+  const gchar *data = NULL;
+  gsize length = 0;
+  gboolean using;
+
+  using = (fd == 1) ?
+    gksu_controller_is_using_stdout(controller) :
+    gksu_controller_is_using_stderr(controller);
+
+  if(using)
+    data = gksu_controller_read_output_direct(controller, fd, &length, TRUE);
+
+  if(data == NULL)
+    return g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, "", 0, 1);
+
+  return g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, data, length, 1);
+}
+
 static void gksu_server_process_exited_cb(GksuController *controller, gint status,
                                           GksuServer *self)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
-  GksuZombie *zombie = g_new(GksuZombie, 1);
+  GksuProcessEntry *entry;
+  GksuServerProcess *process;
+  GVariant *remaining_stdout;
   gint pid;
-  guint32 cookie;
   gsize length;
 
   pid = gksu_controller_get_pid(controller);
-  cookie = gksu_controller_get_cookie(controller);
-  g_hash_table_remove(priv->controllers, GINT_TO_POINTER(cookie));
+  entry = gksu_process_table_lookup(priv->table, gksu_controller_get_cookie(controller));
+  g_return_if_fail(entry != NULL);
+
+  /* when streaming, whatever output is left goes out before the
+   * exit notification */
+  gksu_io_scheduler_remove(priv->scheduler, controller);
+  gksu_controller_flush_stream(controller);
+
+  process = entry->process;
+  if(process)
+    gksu_server_process_set_exited(process, status);
+
+  /* an owner that listens to the process object gets the status and
+   * the rest of the output along with Exited, so there is nothing
+   * left to keep for a Wait */
+  if(process && gksu_server_process_is_attached(process))
+    {
+      /* the controller reuses its buffer, so stdout is copied before
+       * stderr is read */
+      remaining_stdout = gksu_server_remaining_output(controller, 1);
+      gksu_server_process_emit_signal(process, "Exited",
+                                      g_variant_new("(i@ay@ay)", status,
+                                                    remaining_stdout,
+                                                    gksu_server_remaining_output(controller, 2)));
+
+      gksu_process_table_remove(priv->table, entry);
+      gksu_server_check_shutdown(self);
+      return;
+    }
 
-  zombie->status = status;
-  zombie->age = 0;
+  entry->state = GKSU_PROCESS_ENTRY_ZOMBIE;
+  entry->status = status;
+  entry->age = 0;
 
   /* we might get a message for this, still, so we keep it */
   if(gksu_controller_is_using_stdout(controller))
     {
-      zombie->pending_stdout = gksu_controller_read_output(controller, 1, &length, TRUE);
-      zombie->pending_stdout_length = length;
+      entry->pending_stdout = gksu_controller_read_output(controller, 1, &length, TRUE);
+      entry->pending_stdout_length = length;
     }
-  else
-    zombie->pending_stdout = NULL;
 
   if(gksu_controller_is_using_stderr(controller))
     {
-      zombie->pending_stderr = gksu_controller_read_output(controller, 2, &length, TRUE);
-      zombie->pending_stderr_length = length;
+      entry->pending_stderr = gksu_controller_read_output(controller, 2, &length, TRUE);
+      entry->pending_stderr_length = length;
     }
-    zombie->pending_stderr = NULL;
 
-  g_hash_table_replace(priv->zombies, GINT_TO_POINTER(cookie), zombie);
+  gksu_server_send_to_owner(self, controller, "ProcessExited",
+                            g_variant_new("(i)", pid));
 
-  g_signal_emit(self, signals[PROCESS_EXITED], 0, pid);
+  /* nothing is asked of the controller anymore; its own reference
+   * goes once the emission is over */
+  entry->controller = NULL;
+  g_object_unref(controller);
 }
 
 static void gksu_server_output_available_cb(GksuController *controller, gint fd, GksuServer *self)
-{
-  gint pid;
-  pid = gksu_controller_get_pid(controller);
-  g_signal_emit(self, signals[OUTPUT_AVAILABLE], 0, pid, fd);
-}
-
-static gboolean gksu_server_handle_zombies(GksuServer *self)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GksuServerProcess *process;
 
-  GList *zombies = g_hash_table_get_keys(priv->zombies);
-  GksuZombie *zombie;
-  guint32 cookie;
-
-  while(zombies != NULL)
+  /* streamed output is read by us, when its turn comes */
+  if(gksu_controller_is_streaming(controller))
     {
-      cookie = GPOINTER_TO_INT(zombies->data);
-      zombie = (GksuZombie*)g_hash_table_lookup(priv->zombies, zombies->data);
-
-      if(zombie->age > ZOMBIE_AGE_THRESHOLD)
-        gksu_server_wait(self, cookie, NULL, NULL);
-      else
-        zombie->age++;
+      gksu_io_scheduler_add(priv->scheduler, controller, fd);
+      return;
+    }
 
-      zombies = zombies->next;
+  process = gksu_server_get_attached_process(self, controller);
+  if(process)
+    {
+      gksu_server_process_emit_signal(process, "OutputAvailable",
+                                      g_variant_new("(i)", fd));
+      return;
     }
 
-  return TRUE;
+  gksu_server_send_to_owner(self, controller, "OutputAvailable",
+                            g_variant_new("(ii)", gksu_controller_get_pid(controller), fd));
 }
 
-static void gksu_server_init(GksuServer *self)
+static void gksu_server_output_data_cb(GksuController *controller, gint fd,
+                                       GString *data, GksuServer *self)
 {
-  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
-
-  DBusConnection *connection;
-  DBusError dbus_error;
-  GError *error = NULL;
-
-  self->priv = priv;
-
-  /* Basic DBus setup */
-  priv->dbus = dbus_g_bus_get(DBUS_BUS_SYSTEM, &error);
-  if(error)
-    {
-      g_error(error->message);
-      exit(1);
-    }
-  connection = dbus_g_connection_get_connection(priv->dbus);
+  GksuServerProcess *process;
+  GVariant *bytes;
 
-  /* object exposure to DBus */
-  dbus_g_object_type_install_info(GKSU_TYPE_SERVER,
-				  &dbus_glib_gksu_server_object_info);
-
-  dbus_g_connection_register_g_object(priv->dbus,
-				      "/org/gnome/Gksu",
-				      G_OBJECT(self));
+  bytes = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, data->str, data->len, 1);
 
-  dbus_error_init(&dbus_error);
-  if(dbus_bus_request_name(connection,
-			   "org.gnome.Gksu",
-			   0, &dbus_error) == -1)
+  process = gksu_server_get_attached_process(self, controller);
+  if(process)
     {
-      g_error("Failed to get well-known name:\n %s: %s\n",
-	      dbus_error.name, dbus_error.message);
-      exit(1);
+      gksu_server_process_emit_signal(process, "OutputData",
+                                      g_variant_new("(i@ay)", fd, bytes));
+      return;
     }
 
-  /* Monitoring signals that are important for ourselves */
-  dbus_bus_add_match (connection,
-		      "type='signal'"
-		      ",interface='"DBUS_INTERFACE_DBUS"'"
-		      ",sender='"DBUS_SERVICE_DBUS"'"
-		      ",member='NameOwnerChanged'",
-		      &dbus_error);
+  gksu_server_send_to_owner(self, controller, "OutputData",
+                            g_variant_new("(ii@ay)", gksu_controller_get_pid(controller),
+                                          fd, bytes));
+}
 
-  dbus_bus_add_match (connection,
-		      "type='signal',sender='org.freedesktop.ConsoleKit'",
-		      &dbus_error);
+static void gksu_server_age_zombie(GksuProcessEntry *entry, GksuServer *self)
+{
+  if(entry->state != GKSU_PROCESS_ENTRY_ZOMBIE)
+    return;
 
-  /* PolicyKit setup */
-  priv->authority = polkit_authority_get();
+  if(entry->age > ZOMBIE_AGE_THRESHOLD)
+    gksu_server_wait(self, entry->handle, NULL, NULL);
+  else
+    entry->age++;
+}
 
-  /* Setup our main filter to handle the DBus messages */
-  dbus_connection_add_filter(connection, gksu_server_handle_dbus_message,
-			     (void*)self, NULL);
+static gboolean gksu_server_handle_zombies(GksuServer *self)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
 
-  /* "properties" */
-  priv->controllers = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_object_unref);
-  priv->zombies = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  gksu_process_table_foreach(priv->table,
+                             (GksuProcessTableFunc)gksu_server_age_zombie, self);
 
-  /* monitor zombies */
-  g_timeout_add_seconds(ZOMBIE_CHECK_DELAY,
-                        (GSourceFunc)gksu_server_handle_zombies,
-                        (gpointer)self);
+  return TRUE;
 }
 
 typedef struct {
   GksuServer *server;
-  GMainLoop *loop;
-  DBusConnection *connection;
-  DBusMessage *message;
-  gboolean authorized;
+  GDBusInterfaceSkeleton *interface;
+  GDBusMethodInvocation *invocation;
+
+  /* whether PolicyKit may ask the user this time */
+  gboolean interactive;
 } GksuServerDecisionData;
 
+static void gksu_server_check_authorization(GksuServerDecisionData *decision_data);
+
+/*
+ * Runs a call through the skeleton's generated dispatcher, which
+ * emits the handle-* signal. It takes our reference to the invocation
+ * over.
+ */
+static void gksu_server_dispatch_method(GDBusInterfaceSkeleton *interface,
+                                        GDBusMethodInvocation *invocation)
+{
+  GDBusInterfaceVTable *vtable = g_dbus_interface_skeleton_get_vtable(interface);
+
+  vtable->method_call(g_dbus_method_invocation_get_connection(invocation),
+                      g_dbus_method_invocation_get_sender(invocation),
+                      g_dbus_method_invocation_get_object_path(invocation),
+                      g_dbus_method_invocation_get_interface_name(invocation),
+                      g_dbus_method_invocation_get_method_name(invocation),
+                      g_dbus_method_invocation_get_parameters(invocation),
+                      invocation, interface);
+}
+
 static void gksu_server_check_authorization_cb(GObject *object,
                                                GAsyncResult *result,
                                                gpointer data)
 {
   PolkitAuthority *authority = POLKIT_AUTHORITY(object);
   GksuServerDecisionData *decision_data = (GksuServerDecisionData*)data;
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(decision_data->server);
   PolkitAuthorizationResult *auth_result;
   GError *error = NULL;
 
-  /* Quit the loop we ran from the handle message callback */
-  g_main_loop_quit(decision_data->loop);
+  priv->pending_authorizations--;
 
   /* Check if authorization has been given */
   auth_result = polkit_authority_check_authorization_finish(authority,
@@ -304,200 +482,671 @@ static void gksu_server_check_authorization_cb(GObject *object,
 
   if(error)
     {
-      DBusMessage *reply;
-
-      reply = dbus_message_new_error(decision_data->message,
-                                     DBUS_ERROR_FAILED,
-                                     error->message);
-      dbus_connection_send(decision_data->connection, reply, NULL);
-      dbus_message_unref(reply);
+      g_dbus_method_invocation_return_error_literal(decision_data->invocation,
+                                                    G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                                    error->message);
       g_clear_error(&error);
-      return;
     }
-
-  if(polkit_authorization_result_get_is_authorized(auth_result))
+  else if(polkit_authorization_result_get_is_authorized(auth_result))
+    {
+      /* a yes given without asking anybody will be given again, until
+       * something changes, which PolicyKit tells us about; after the
+       * user was asked, only if PolicyKit says it keeps the answer */
+      if(!decision_data->interactive ||
+         polkit_authorization_result_get_retains_authorization(auth_result))
+        gksu_auth_cache_insert(priv->auth_cache,
+                               g_dbus_method_invocation_get_sender(decision_data->invocation),
+                               GKSU_SERVER_SPAWN_ACTION);
+
+      gksu_server_dispatch_method(decision_data->interface, decision_data->invocation);
+    }
+  else if(!decision_data->interactive &&
+          polkit_authorization_result_get_is_challenge(auth_result))
     {
-      decision_data->authorized = TRUE;
+      /* ask again, this time letting PolicyKit ask the user */
+      g_object_unref(auth_result);
+      decision_data->interactive = TRUE;
+      gksu_server_check_authorization(decision_data);
       return;
     }
+  else
+    g_dbus_method_invocation_return_error_literal(decision_data->invocation,
+                                                  G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                                  "no");
 
-  {
-    DBusMessage *reply;
+  if(auth_result)
+    g_object_unref(auth_result);
 
-    reply = dbus_message_new_error(decision_data->message,
-                                   DBUS_ERROR_FAILED,
-                                   "no");
-    dbus_connection_send(decision_data->connection, reply, NULL);
-    dbus_message_unref(reply);
-  }
+  gksu_server_check_shutdown(decision_data->server);
+
+  g_object_unref(decision_data->interface);
+  g_object_unref(decision_data->server);
+  g_slice_free(GksuServerDecisionData, decision_data);
 }
 
-static PolkitSubject* gksu_server_get_subject_from_message(GksuServer *self,
-                                                           DBusMessage *message)
+/*
+ * Authorizations were granted or revoked, the policy was changed, or
+ * a temporary authorization expired; none of what we remember can be
+ * trusted anymore.
+ */
+static void gksu_server_authority_changed_cb(PolkitAuthority *authority,
+                                             GksuServer *self)
 {
-  const gchar *sender = NULL;
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
 
-  sender = dbus_message_get_sender(message);
+  gksu_auth_cache_invalidate(priv->auth_cache, NULL);
+}
+
+static gboolean gksu_server_is_method_spawn_related(GDBusMethodInvocation *invocation)
+{
+  const gchar *method = g_dbus_method_invocation_get_method_name(invocation);
 
-  return polkit_system_bus_name_new(sender);
+  return (!g_strcmp0(method, "Spawn") || !g_strcmp0(method, "SpawnWithFDs") ||
+          !g_strcmp0(method, "SpawnMany"));
 }
 
-static gboolean gksu_server_is_message_spawn_related(DBusMessage *message)
+/*
+ * Spawning needs PolicyKit's blessing, unless it was given to the same
+ * caller a moment ago. We don't wait for it: the call is run once
+ * PolicyKit answers, or gets an error. In the meantime everything
+ * else, other clients' requests included, goes on as usual.
+ */
+static void gksu_server_check_authorization(GksuServerDecisionData *decision_data)
 {
-  return (dbus_message_is_method_call(message, "org.gnome.Gksu", "Spawn"));
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(decision_data->server);
+  PolkitSubject *subject;
+
+  priv->pending_authorizations++;
+
+  subject = polkit_system_bus_name_new(g_dbus_method_invocation_get_sender(decision_data->invocation));
+  polkit_authority_check_authorization(priv->authority,
+                                       subject,
+                                       GKSU_SERVER_SPAWN_ACTION,
+                                       NULL,
+                                       decision_data->interactive ?
+                                       POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION :
+                                       POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE,
+                                       NULL,
+                                       gksu_server_check_authorization_cb,
+                                       decision_data);
+  g_object_unref(subject);
 }
 
-DBusHandlerResult gksu_server_handle_dbus_message(DBusConnection *conn,
-                                                  DBusMessage *message,
-                                                  void *user_data)
+/*
+ * Cookies are random, but only 32 bits, so on top of that calls that
+ * take one, which is always their first argument, are only let
+ * through from the process' owner. It is called from
+ * gksu_server_method_call(), on the main loop, like everything else
+ * that looks at the table.
+ */
+static gboolean gksu_server_check_owner(GksuServer *self,
+                                        GDBusMethodInvocation *invocation)
 {
-  GksuServer *self = GKSU_SERVER(user_data);
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GVariant *parameters = g_dbus_method_invocation_get_parameters(invocation);
+  GVariant *cookie;
+  GksuProcessEntry *entry;
 
-  DBusGConnection *dbus = priv->dbus;
-  DBusConnection *connection = dbus_g_connection_get_connection(dbus);
-  PolkitSubject *subject = NULL;
+  if(g_variant_n_children(parameters) == 0)
+    return TRUE;
 
-  if(gksu_server_is_message_spawn_related(message))
+  cookie = g_variant_get_child_value(parameters, 0);
+  if(!g_variant_is_of_type(cookie, G_VARIANT_TYPE_UINT32))
     {
-      DBusHandlerResult handler_result = DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-      GMainLoop *loop = g_main_loop_new(NULL, TRUE);
-      GksuServerDecisionData *decision_data = g_slice_new(GksuServerDecisionData);
+      g_variant_unref(cookie);
+      return TRUE;
+    }
+
+  entry = gksu_process_table_lookup(priv->table, g_variant_get_uint32(cookie));
+  g_variant_unref(cookie);
 
-      decision_data->server = self;
-      decision_data->connection = connection;
-      decision_data->message = message;
-      decision_data->authorized = FALSE;
-      decision_data->loop = loop;
+  /* unknown cookies get the handler's own error */
+  if((entry == NULL) ||
+     !g_strcmp0(entry->owner, g_dbus_method_invocation_get_sender(invocation)))
+    return TRUE;
 
-      subject = gksu_server_get_subject_from_message(self, message);
-      polkit_authority_check_authorization(priv->authority,
-                                           subject,
-                                           "org.gnome.gksu.spawn",
-                                           NULL,
-                                           POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION,
-                                           NULL,
-                                           gksu_server_check_authorization_cb,
-                                           decision_data);
+  g_dbus_method_invocation_return_error_literal(invocation, G_DBUS_ERROR,
+                                                G_DBUS_ERROR_ACCESS_DENIED,
+                                                "Only the process' owner may do this.");
+  return FALSE;
+}
 
-      /* Fake synchronicity, because we need to know the answer before
-       * giving D-Bus a reply.
-       */
-      g_main_loop_run(loop);
-      g_main_loop_unref(loop);
+/*
+ * Every call to /org/gnome/Gksu comes through here, on the main loop
+ * and in the order each caller sent them, before the skeletons see
+ * it. GDBus would give us a g-authorize-method signal for this, but
+ * only by running each call in a thread of its own, and out of order.
+ */
+static void gksu_server_method_call(GDBusConnection *connection,
+                                    const gchar *sender,
+                                    const gchar *object_path,
+                                    const gchar *interface_name,
+                                    const gchar *method_name,
+                                    GVariant *parameters,
+                                    GDBusMethodInvocation *invocation,
+                                    gpointer user_data)
+{
+  GksuServer *self = GKSU_SERVER(user_data);
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GDBusInterfaceSkeleton *interface;
+  GksuServerDecisionData *decision_data;
 
-      /* If the action was not authorized, an error message has
-       * already been sent, and we won't allow the spawn handler
-       * run
-       */
-      if(!decision_data->authorized)
-        handler_result = DBUS_HANDLER_RESULT_HANDLED;
+  if(!g_strcmp0(interface_name, "org.gnome.Gksu2"))
+    interface = G_DBUS_INTERFACE_SKELETON(priv->manager2);
+  else
+    interface = G_DBUS_INTERFACE_SKELETON(priv->manager);
 
-      g_slice_free(GksuServerDecisionData, decision_data);
-      g_object_unref(subject);
+  if(!gksu_server_is_method_spawn_related(invocation))
+    {
+      if(gksu_server_check_owner(self, invocation))
+        gksu_server_dispatch_method(interface, invocation);
+      return;
+    }
 
-      return handler_result;
+  if(gksu_auth_cache_lookup(priv->auth_cache, sender, GKSU_SERVER_SPAWN_ACTION))
+    {
+      gksu_server_dispatch_method(interface, invocation);
+      return;
     }
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  decision_data = g_slice_new(GksuServerDecisionData);
+  decision_data->server = g_object_ref(self);
+  decision_data->interface = g_object_ref(interface);
+  decision_data->invocation = invocation;
+
+  /* we first ask without letting PolicyKit bring a dialog up, so
+   * that we know whether the answer may be cached */
+  decision_data->interactive = FALSE;
+
+  gksu_server_check_authorization(decision_data);
 }
 
-gboolean gksu_server_spawn(GksuServer *self, gchar *cwd, gchar *xauth, gchar **args,
-                           GHashTable *environment, gboolean using_stdin, gboolean using_stdout,
-                           gboolean using_stderr, gint *pid, guint32 *cookie, GError **error)
+static const GDBusInterfaceVTable gksu_server_vtable = {
+  gksu_server_method_call,
+  NULL,
+  NULL
+};
+
+/*
+ * Builds the environment for a child out of an a{ss}; the variables
+ * in @overrides, if given, replace those in @variant.
+ */
+static GHashTable* gksu_server_environment_from_variant(GVariant *variant,
+                                                        GVariant *overrides)
 {
-  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GHashTable *environment;
+  GVariantIter iter;
+  const gchar *key;
+  const gchar *value;
 
-  GksuController *controller;
-  GError *internal_error = NULL;
-  guint32 random_number;
+  environment = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
 
-  controller = gksu_controller_new(cwd, args, priv->dbus);
+  g_variant_iter_init(&iter, variant);
+  while(g_variant_iter_next(&iter, "{&s&s}", &key, &value))
+    g_hash_table_replace(environment, g_strdup(key), g_strdup(value));
 
-  g_signal_connect(controller, "process-exited",
-                   G_CALLBACK(gksu_server_process_exited_cb),
-                   self);
+  if(overrides == NULL)
+    return environment;
 
-  g_signal_connect(controller, "output-available",
-                   G_CALLBACK(gksu_server_output_available_cb),
-                   self);
+  g_variant_iter_init(&iter, overrides);
+  while(g_variant_iter_next(&iter, "{&s&s}", &key, &value))
+    g_hash_table_replace(environment, g_strdup(key), g_strdup(value));
 
-  do
-    {
-      random_number = g_random_int();
-    } while (g_hash_table_lookup(priv->controllers, GINT_TO_POINTER(random_number)));
+  return environment;
+}
 
-  /* set the cookie for the controller to know, and also send it back
-   * to the caller */
-  gksu_controller_set_cookie(controller, random_number);
-  *cookie = random_number;
+/*
+ * Called from the main loop once a spawn is over: with the process'
+ * pid and cookie, or with @error set.
+ */
+typedef void (*GksuServerSpawnedFunc) (GksuServer *self, gint pid, guint32 cookie,
+                                       const GError *error, gpointer user_data);
 
-  gksu_controller_run(controller, environment, xauth,
-                      using_stdin, using_stdout, using_stderr,
-                      pid, &internal_error);
-  if(internal_error)
+typedef struct {
+  GksuServer *server;
+  guint32 cookie;
+  gboolean using_stdin;
+  gboolean using_stdout;
+  gboolean using_stderr;
+  GksuServerSpawnedFunc callback;
+  gpointer user_data;
+} GksuServerSpawnData;
+
+/*
+ * The end of a spawn, whether the child is running or @error is set;
+ * takes @error over.
+ */
+static void gksu_server_spawn_done(GksuController *controller, GksuServerSpawnData *spawn_data,
+                                   gint pid, GError *error)
+{
+  GksuServer *self = spawn_data->server;
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GksuProcessEntry *entry;
+
+  entry = gksu_process_table_lookup(priv->table, spawn_data->cookie);
+
+  if(error)
     {
       g_signal_handlers_disconnect_matched(controller,
                                            G_SIGNAL_MATCH_DATA,
                                            0, 0, NULL, NULL,
-                                           controller);
+                                           self);
+      gksu_process_table_remove(priv->table, entry);
+
+      /* there is no child whose exit would drop the controller's own
+       * reference */
       g_object_unref(controller);
 
-      g_propagate_error(error, internal_error);
-      return FALSE;
+      spawn_data->callback(self, 0, 0, error, spawn_data->user_data);
+      g_error_free(error);
     }
+  else
+    {
+      entry->state = GKSU_PROCESS_ENTRY_RUNNING;
+      entry->process = gksu_server_process_new(self, controller, priv->connection,
+                                               ++(priv->next_process_id));
 
-  g_object_ref(controller);
-  g_hash_table_replace(priv->controllers, GINT_TO_POINTER(random_number), controller);
+      spawn_data->callback(self, pid, spawn_data->cookie, NULL, spawn_data->user_data);
+    }
 
-  return TRUE;
+  g_object_unref(self);
+  g_slice_free(GksuServerSpawnData, spawn_data);
 }
 
-gboolean gksu_server_close_fd(GksuServer *self, guint32 cookie, gint fd, GError **error)
+static void gksu_server_spawn_ran_cb(GksuController *controller, GAsyncResult *result,
+                                     GksuServerSpawnData *spawn_data)
 {
-  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
-  GksuController *controller;
-  GError *internal_error = NULL;
+  GError *error = NULL;
+  gint pid = 0;
 
-  controller = g_hash_table_lookup(priv->controllers, GINT_TO_POINTER(cookie));
-  if(controller == NULL)
-    return FALSE;
+  gksu_controller_run_finish(controller, result, &pid, &error);
+  gksu_server_spawn_done(controller, spawn_data, pid, error);
+}
 
-  gksu_controller_close_fd(controller, fd, &internal_error);
-  if(internal_error)
+static void gksu_server_spawn_prepared_cb(GksuController *controller, GAsyncResult *result,
+                                          GksuServerSpawnData *spawn_data)
+{
+  GError *error = NULL;
+
+  if(!gksu_controller_prepare_finish(controller, result, &error))
     {
-      g_propagate_error(error, internal_error);
-      return FALSE;
+      gksu_server_spawn_done(controller, spawn_data, 0, error);
+      return;
     }
 
-  return TRUE;
+  /* with the launcher helper, the child is only known to be running
+   * once it says so, which we wait for from the main loop too */
+  gksu_controller_run_async(controller,
+                            spawn_data->using_stdin, spawn_data->using_stdout,
+                            spawn_data->using_stderr,
+                            (GAsyncReadyCallback)gksu_server_spawn_ran_cb,
+                            spawn_data);
 }
 
-static gboolean gksu_server_maybe_shutdown(GksuServer *self)
+/*
+ * Starts a process for @owner. The slow part, checking the
+ * environment and writing the X authority file, is done by the
+ * controller's worker threads, and the launcher helper's answer is
+ * waited for from the main loop, so this returns right away;
+ * @callback is called once the process is running, or has failed to
+ * start.
+ */
+static void gksu_server_spawn_real(GksuServer *self, const gchar *owner,
+                                   const gchar *cwd, const gchar *xauth,
+                                   const gchar *const *args, GHashTable *environment,
+                                   gboolean using_stdin, gboolean using_stdout,
+                                   gboolean using_stderr,
+                                   GksuServerSpawnedFunc callback, gpointer user_data)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
 
-  /* if the hash tables are still empty we can safely shutdown */
-  if((g_hash_table_size(priv->controllers)) == 0 &&
-     (g_hash_table_size(priv->zombies) == 0))
-    g_signal_emit(self, signals[SHUTDOWN], 0);
-  
-  return FALSE;
+  GksuProcessEntry *entry;
+  GksuController *controller;
+  GksuServerSpawnData *spawn_data;
+
+  entry = gksu_process_table_add(priv->table);
+
+  controller = gksu_controller_new(cwd, (gchar**)args);
+  gksu_controller_set_owner(controller, owner);
+  if(priv->read_budget)
+    gksu_controller_set_read_budget(controller, priv->read_budget);
+
+  g_signal_connect(controller, "process-exited",
+                   G_CALLBACK(gksu_server_process_exited_cb),
+                   self);
+
+  g_signal_connect(controller, "output-available",
+                   G_CALLBACK(gksu_server_output_available_cb),
+                   self);
+
+  g_signal_connect(controller, "output-data",
+                   G_CALLBACK(gksu_server_output_data_cb),
+                   self);
+
+  /* the reference we got is the controller's own, which it drops
+   * when the child exits; the slot has one of its own, and stays in
+   * the starting state, invisible to the other calls, until the
+   * fork */
+  entry->controller = g_object_ref(controller);
+  entry->owner = g_strdup(owner);
+
+  /* set the cookie for the controller to know; it is sent back to
+   * the caller once the process is running */
+  gksu_controller_set_cookie(controller, entry->handle);
+
+  spawn_data = g_slice_new(GksuServerSpawnData);
+  spawn_data->server = g_object_ref(self);
+  spawn_data->cookie = entry->handle;
+  spawn_data->using_stdin = using_stdin;
+  spawn_data->using_stdout = using_stdout;
+  spawn_data->using_stderr = using_stderr;
+  spawn_data->callback = callback;
+  spawn_data->user_data = user_data;
+
+  gksu_controller_prepare_async(controller, environment, xauth,
+                                (GAsyncReadyCallback)gksu_server_spawn_prepared_cb,
+                                spawn_data);
 }
 
-static void gksu_server_check_shutdown(GksuServer *self)
+static void gksu_server_spawned_cb(GksuServer *self, gint pid, guint32 cookie,
+                                   const GError *error,
+                                   GDBusMethodInvocation *invocation)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
 
-  /* we already have a maybe shutdown scheduled */
-  if(priv->shutdown_source_id)
+  if(error)
+    {
+      g_dbus_method_invocation_return_gerror(invocation, error);
+      return;
+    }
+
+  gksu_dbus_gksu_complete_spawn(priv->manager, invocation, pid, cookie);
+}
+
+static gboolean gksu_server_handle_spawn(GksuDBusGksu *manager,
+                                         GDBusMethodInvocation *invocation,
+                                         const gchar *cwd, const gchar *xauth,
+                                         const gchar *const *args, GVariant *environment,
+                                         gboolean using_stdin, gboolean using_stdout,
+                                         gboolean using_stderr, GksuServer *self)
+{
+  GHashTable *env;
+
+  env = gksu_server_environment_from_variant(environment, NULL);
+  gksu_server_spawn_real(self, g_dbus_method_invocation_get_sender(invocation),
+                         cwd, xauth, args, env,
+                         using_stdin, using_stdout, using_stderr,
+                         (GksuServerSpawnedFunc)gksu_server_spawned_cb, invocation);
+  g_hash_table_destroy(env);
+
+  return TRUE;
+}
+
+static void gksu_server_spawned_with_fds_cb(GksuServer *self, gint pid, guint32 cookie,
+                                            const GError *error,
+                                            GDBusMethodInvocation *invocation)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GksuController *controller;
+  GUnixFDList *fd_list;
+  GVariantBuilder fds;
+  GError *fd_error = NULL;
+  gint fd;
+
+  if(error)
+    {
+      g_dbus_method_invocation_return_gerror(invocation, error);
+      return;
+    }
+
+  controller = gksu_server_lookup_controller(self, cookie);
+
+  /* only the fds the caller asked for are sent, keyed by their
+   * standard number (0, 1 or 2) */
+  fd_list = g_unix_fd_list_new();
+  g_variant_builder_init(&fds, G_VARIANT_TYPE("a{ih}"));
+  for(fd = 0; (controller != NULL) && (fd < 3); fd++)
+    {
+      gint raw_fd = gksu_controller_steal_fd(controller, fd);
+      gint handle;
+
+      if(raw_fd == -1)
+        continue;
+
+      /* the list keeps a duplicate of the descriptor, so we close our
+       * copy */
+      handle = g_unix_fd_list_append(fd_list, raw_fd, &fd_error);
+      close(raw_fd);
+      if(handle == -1)
+        {
+          g_warning("Unable to pass fd %d of process %d: %s", fd, pid, fd_error->message);
+          g_clear_error(&fd_error);
+          continue;
+        }
+
+      g_variant_builder_add(&fds, "{ih}", fd, handle);
+    }
+
+  gksu_dbus_gksu_complete_spawn_with_fds(priv->manager, invocation, fd_list, pid, cookie,
+                                         g_variant_builder_end(&fds));
+  g_object_unref(fd_list);
+}
+
+static gboolean gksu_server_handle_spawn_with_fds(GksuDBusGksu *manager,
+                                                  GDBusMethodInvocation *invocation,
+                                                  GUnixFDList *in_fds,
+                                                  const gchar *cwd, const gchar *xauth,
+                                                  const gchar *const *args,
+                                                  GVariant *environment,
+                                                  gboolean using_stdin,
+                                                  gboolean using_stdout,
+                                                  gboolean using_stderr,
+                                                  GksuServer *self)
+{
+  GHashTable *env;
+
+  env = gksu_server_environment_from_variant(environment, NULL);
+  gksu_server_spawn_real(self, g_dbus_method_invocation_get_sender(invocation),
+                         cwd, xauth, args, env,
+                         using_stdin, using_stdout, using_stderr,
+                         (GksuServerSpawnedFunc)gksu_server_spawned_with_fds_cb,
+                         invocation);
+  g_hash_table_destroy(env);
+
+  return TRUE;
+}
+
+/*
+ * A SpawnMany call in progress; it is answered once every one of its
+ * commands has either started or failed, in the order they were given.
+ */
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  guint n_commands;
+  guint n_pending;
+  gint *pids;
+  guint32 *cookies;
+  gchar **messages;
+} GksuServerBatch;
+
+typedef struct {
+  GksuServerBatch *batch;
+  guint index;
+} GksuServerBatchItem;
+
+static void gksu_server_complete_batch(GksuServer *self, GksuServerBatch *batch)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  GVariantBuilder processes;
+  guint i;
+
+  g_variant_builder_init(&processes, G_VARIANT_TYPE("a(ius)"));
+  for(i = 0; i < batch->n_commands; i++)
+    g_variant_builder_add(&processes, "(ius)", batch->pids[i], batch->cookies[i],
+                          batch->messages[i] ? batch->messages[i] : "");
+
+  gksu_dbus_gksu_complete_spawn_many(priv->manager, batch->invocation,
+                                     g_variant_builder_end(&processes));
+
+  g_free(batch->pids);
+  g_free(batch->cookies);
+  g_strfreev(batch->messages);
+  g_slice_free(GksuServerBatch, batch);
+}
+
+static void gksu_server_batch_spawned_cb(GksuServer *self, gint pid, guint32 cookie,
+                                         const GError *error, GksuServerBatchItem *item)
+{
+  GksuServerBatch *batch = item->batch;
+
+  batch->pids[item->index] = pid;
+  batch->cookies[item->index] = cookie;
+  if(error)
+    batch->messages[item->index] = g_strdup(error->message);
+  g_slice_free(GksuServerBatchItem, item);
+
+  if(--(batch->n_pending) == 0)
+    gksu_server_complete_batch(self, batch);
+}
+
+/*
+ * Starts each of a batch of commands as Spawn would, for a single
+ * PolicyKit check and round trip. A command that fails does not stop
+ * the others; its entry has the error message instead.
+ */
+static gboolean gksu_server_handle_spawn_many(GksuDBusGksu *manager,
+                                              GDBusMethodInvocation *invocation,
+                                              const gchar *xauth, GVariant *environment,
+                                              GVariant *commands, GksuServer *self)
+{
+  const gchar *owner = g_dbus_method_invocation_get_sender(invocation);
+  GksuServerBatch *batch;
+  GVariantIter iter;
+  GVariant *overrides;
+  const gchar *cwd;
+  const gchar **args;
+  gboolean using_stdin, using_stdout, using_stderr;
+  guint index = 0;
+
+  if(g_variant_n_children(commands) > GKSU_SERVER_MAX_BATCH)
+    {
+      g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR,
+                                            G_DBUS_ERROR_LIMITS_EXCEEDED,
+                                            "No more than %d commands may be spawned at once.",
+                                            GKSU_SERVER_MAX_BATCH);
+      return TRUE;
+    }
+
+  batch = g_slice_new(GksuServerBatch);
+  batch->invocation = invocation;
+  batch->n_commands = g_variant_n_children(commands);
+  batch->pids = g_new0(gint, batch->n_commands);
+  batch->cookies = g_new0(guint32, batch->n_commands);
+  batch->messages = g_new0(gchar*, batch->n_commands + 1);
+
+  /* held until every command has been started, so that the answer
+   * isn't sent early by commands that fail right away */
+  batch->n_pending = batch->n_commands + 1;
+
+  g_variant_iter_init(&iter, commands);
+  while(g_variant_iter_next(&iter, "(&s^a&s@a{ss}bbb)", &cwd, &args, &overrides,
+                            &using_stdin, &using_stdout, &using_stderr))
+    {
+      GksuServerBatchItem *item;
+      GHashTable *env;
+
+      item = g_slice_new(GksuServerBatchItem);
+      item->batch = batch;
+      item->index = index++;
+
+      env = gksu_server_environment_from_variant(environment, overrides);
+      gksu_server_spawn_real(self, owner, cwd, xauth, (const gchar *const *)args, env,
+                             using_stdin, using_stdout, using_stderr,
+                             (GksuServerSpawnedFunc)gksu_server_batch_spawned_cb, item);
+
+      g_hash_table_destroy(env);
+      g_variant_unref(overrides);
+      g_free(args);
+    }
+
+  if(--(batch->n_pending) == 0)
+    gksu_server_complete_batch(self, batch);
+
+  return TRUE;
+}
+
+/*
+ * Gives the path of the process' own object; from then on the
+ * notifications about the process are sent from there.
+ */
+gboolean gksu_server_get_process(GksuServer *self, guint32 cookie, gchar **path,
+                                 GError **error)
+{
+  GksuServerProcess *process;
+
+  process = gksu_server_lookup_process(self, cookie);
+  if(process == NULL)
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
+      return FALSE;
+    }
+
+  gksu_server_process_set_attached(process);
+  *path = g_strdup(gksu_server_process_get_path(process));
+
+  return TRUE;
+}
+
+gboolean gksu_server_close_fd(GksuServer *self, guint32 cookie, gint fd, GError **error)
+{
+  GksuController *controller;
+  GError *internal_error = NULL;
+
+  controller = gksu_server_lookup_controller(self, cookie);
+  if(controller == NULL)
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
+      return FALSE;
+    }
+
+  gksu_controller_close_fd(controller, fd, &internal_error);
+  if(internal_error)
+    {
+      g_propagate_error(error, internal_error);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static gboolean gksu_server_maybe_shutdown(GksuServer *self)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+
+  /* if the process table is still empty, and nobody is waiting on
+   * PolicyKit, we can safely shutdown */
+  if((gksu_process_table_size(priv->table) == 0) &&
+     (priv->pending_authorizations == 0))
+    g_signal_emit(self, signals[SHUTDOWN], 0);
+
+  return FALSE;
+}
+
+static void gksu_server_check_shutdown(GksuServer *self)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+
+  /* we already have a maybe shutdown scheduled */
+  if(priv->shutdown_source_id)
     {
       g_source_remove(priv->shutdown_source_id);
       priv->shutdown_source_id = 0;
     }
 
-  if((g_hash_table_size(priv->controllers)) == 0 &&
-     (g_hash_table_size(priv->zombies) == 0))
+  if((gksu_process_table_size(priv->table) == 0) &&
+     (priv->pending_authorizations == 0))
     {
       priv->shutdown_source_id =
         g_timeout_add_seconds(10, (GSourceFunc)gksu_server_maybe_shutdown, (gpointer)self);
@@ -507,26 +1156,23 @@ static void gksu_server_check_shutdown(GksuServer *self)
 gboolean gksu_server_wait(GksuServer *self, guint32 cookie, gint *status, GError **error)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
-  GksuZombie *zombie = g_hash_table_lookup(priv->zombies, GINT_TO_POINTER(cookie));
+  GksuProcessEntry *entry = gksu_process_table_lookup(priv->table, cookie);
 
-  if(zombie != NULL)
+  if((entry != NULL) && (entry->state == GKSU_PROCESS_ENTRY_ZOMBIE))
     {
       /* this allows for being able to call this method locally and
          not caring about the return value */
       if(status != NULL)
-        *status = zombie->status;
-      g_free(zombie->pending_stdout);
-      zombie->pending_stdout_length = 0;
-      g_free(zombie->pending_stderr);
-      zombie->pending_stderr_length = 0;
-      g_hash_table_remove(priv->zombies, GINT_TO_POINTER(cookie));
+        *status = entry->status;
+      gksu_process_table_remove(priv->table, entry);
     }
   else
     {
       g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
                   "Process not found. Process has not been started by this server or "
                   "has already been waited for.");
-      *status = 0;
+      if(status != NULL)
+        *status = 0;
       return FALSE;
     }
 
@@ -535,35 +1181,43 @@ gboolean gksu_server_wait(GksuServer *self, guint32 cookie, gint *status, GError
   return TRUE;
 }
 
-gboolean gksu_server_read_output(GksuServer *self, guint32 cookie, gint fd,
-                                 gchar **data, gsize *length, GError **error)
+/*
+ * Common implementation for both versions of ReadOutput; the returned
+ * data may contain NUL bytes, so @length is what counts. The data
+ * belongs to the controller or zombie, and is only valid until the
+ * next read.
+ */
+static gboolean gksu_server_read_output_real(GksuServer *self, guint32 cookie, gint fd,
+                                             const gchar **data, gsize *length)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
-  GksuController *controller;
-  GksuZombie *zombie;
+  GksuProcessEntry *entry;
 
-  controller = g_hash_table_lookup(priv->controllers, GINT_TO_POINTER(cookie));
-  if(controller == NULL)
-    zombie = g_hash_table_lookup(priv->zombies, GINT_TO_POINTER(cookie));
-
-  if((controller == NULL) && (zombie == NULL))
+  entry = gksu_process_table_lookup(priv->table, cookie);
+  if(entry == NULL)
     return FALSE;
 
-  if(controller)
+  *data = NULL;
+  *length = 0;
+
+  if(entry->state == GKSU_PROCESS_ENTRY_RUNNING)
     {
-      *data = gksu_controller_read_output(controller, fd, length, FALSE);
+      /* the output is being pushed already; reading it here would
+       * deliver it out of order */
+      if(!gksu_controller_is_streaming(entry->controller))
+        *data = gksu_controller_read_output_direct(entry->controller, fd, length, FALSE);
     }
-  else
+  else if(entry->state == GKSU_PROCESS_ENTRY_ZOMBIE)
     {
       switch(fd)
         {
         case 1:
-          *data = g_strdup(zombie->pending_stdout);
-          *length = zombie->pending_stdout_length;
+          *data = entry->pending_stdout;
+          *length = entry->pending_stdout_length;
           break;
         case 2:
-          *data = g_strdup(zombie->pending_stderr);
-          *length = zombie->pending_stderr_length;
+          *data = entry->pending_stderr;
+          *length = entry->pending_stderr_length;
           break;
         }
     }
@@ -571,38 +1225,187 @@ gboolean gksu_server_read_output(GksuServer *self, guint32 cookie, gint fd,
   return TRUE;
 }
 
-gboolean gksu_server_write_input(GksuServer *self, guint32 cookie, gchar *data,
-                                 gsize length, GError **error)
+gboolean gksu_server_read_output(GksuServer *self, guint32 cookie, gint fd,
+                                 gchar **data, gsize *length, GError **error)
+{
+  const gchar *output;
+
+  if(!gksu_server_read_output_real(self, cookie, fd, &output, length))
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
+      return FALSE;
+    }
+
+  /* D-Bus strings can't be NULL, nor anything but UTF-8; binary
+   * output needs org.gnome.Gksu2 */
+  *data = g_strndup(output ? output : "", *length);
+  if(!g_utf8_validate(*data, -1, NULL))
+    {
+      g_free(*data);
+      *data = NULL;
+      g_set_error(error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                  "Output is not valid UTF-8; use org.gnome.Gksu2.ReadOutput.");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Answers with the output as a byte array; this is the reply of both
+ * org.gnome.Gksu2.ReadOutput and the process objects' ReadOutput.
+ */
+void gksu_server_read_output_bytes(GksuServer *self, guint32 cookie, gint fd,
+                                   GDBusMethodInvocation *invocation)
+{
+  const gchar *output;
+  gsize length;
+
+  if(!gksu_server_read_output_real(self, cookie, fd, &output, &length))
+    {
+      g_dbus_method_invocation_return_error_literal(invocation, GKSU_ERROR,
+                                                    GKSU_ERROR_PROCESS_NOT_FOUND,
+                                                    "Process not found.");
+      return;
+    }
+
+  if(output == NULL)
+    output = "";
+
+  g_dbus_method_invocation_return_value(invocation,
+                                        g_variant_new("(@ay)",
+                                                      g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE,
+                                                                                output, length, 1)));
+}
+
+/*
+ * @ttl is in seconds; 0 means PolicyKit is asked for every spawn.
+ */
+void gksu_server_set_auth_cache_ttl(GksuServer *self, guint ttl)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+
+  gksu_auth_cache_set_ttl(priv->auth_cache, ttl);
+}
+
+/*
+ * Makes the next spawn from @subject go to PolicyKit again.
+ */
+void gksu_server_forget_authorization(GksuServer *self, const gchar *subject)
 {
   GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+
+  gksu_auth_cache_invalidate(priv->auth_cache, subject);
+}
+
+void gksu_server_set_read_budget(GksuServer *self, gsize budget)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+  priv->read_budget = budget;
+  gksu_io_scheduler_set_quantum(priv->scheduler, budget);
+}
+
+gboolean gksu_server_start_streaming(GksuServer *self, guint32 cookie, GError **error)
+{
+  GksuController *controller;
+
+  controller = gksu_server_lookup_controller(self, cookie);
+  if(controller == NULL)
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
+      return FALSE;
+    }
+
+  gksu_controller_start_streaming(controller);
+
+  return TRUE;
+}
+
+/*
+ * The reply only goes out once the data has been accepted into the
+ * process' input queue; while that is full the reply is held by the
+ * controller, which keeps a fast client from making us buffer without
+ * limit for a child that reads slowly.
+ */
+void gksu_server_write_input(GksuServer *self, guint32 cookie, const gchar *data,
+                             gsize length, GDBusMethodInvocation *invocation)
+{
   GksuController *controller;
   GError *internal_error = NULL;
 
-  controller = g_hash_table_lookup(priv->controllers, GINT_TO_POINTER(cookie));
+  controller = gksu_server_lookup_controller(self, cookie);
   if(controller == NULL)
-    return FALSE;
+    {
+      g_dbus_method_invocation_return_error_literal(invocation, GKSU_ERROR,
+                                                    GKSU_ERROR_PROCESS_NOT_FOUND,
+                                                    "Process not found.");
+      return;
+    }
 
-  gksu_controller_write_input(controller, (const gchar*)data,
-                              (const gsize)length, &internal_error);
+  gksu_controller_write_input(controller, data, (const gsize)length, &internal_error);
   if(internal_error)
     {
-      g_propagate_error(error, internal_error);
+      gksu_server_complete_call(invocation, internal_error);
+      return;
+    }
+
+  if(gksu_controller_input_is_full(controller))
+    gksu_controller_defer_input_reply(controller, invocation);
+  else
+    g_dbus_method_invocation_return_value(invocation, NULL);
+}
+
+gboolean gksu_server_set_io_weight(GksuServer *self, guint32 cookie, guint weight,
+                                   GError **error)
+{
+  GksuController *controller;
+
+  controller = gksu_server_lookup_controller(self, cookie);
+  if(controller == NULL)
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
+      return FALSE;
+    }
+
+  gksu_controller_set_io_weight(controller, weight);
+
+  return TRUE;
+}
+
+gboolean gksu_server_set_output_paused(GksuServer *self, guint32 cookie, gint fd,
+                                       gboolean paused, GError **error)
+{
+  GksuController *controller;
+
+  controller = gksu_server_lookup_controller(self, cookie);
+  if(controller == NULL)
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
       return FALSE;
     }
 
+  gksu_controller_set_output_paused(controller, fd, paused);
+
   return TRUE;
 }
 
 gboolean gksu_server_send_signal(GksuServer *self, guint32 cookie, gint signum,
                                  GError **error)
 {
-  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
   GksuController *controller;
   GError *internal_error = NULL;
 
-  controller = g_hash_table_lookup(priv->controllers, GINT_TO_POINTER(cookie));
+  controller = gksu_server_lookup_controller(self, cookie);
   if(controller == NULL)
-    return FALSE;
+    {
+      g_set_error(error, GKSU_ERROR, GKSU_ERROR_PROCESS_NOT_FOUND,
+                  "Process not found.");
+      return FALSE;
+    }
 
   gksu_controller_send_signal(controller, signum, &internal_error);
   if(internal_error)
@@ -613,3 +1416,275 @@ gboolean gksu_server_send_signal(GksuServer *self, guint32 cookie, gint signum,
 
   return TRUE;
 }
+
+/* org.gnome.Gksu and org.gnome.Gksu2 method handlers; GDBus has
+ * unpacked the arguments already */
+
+static gboolean gksu_server_handle_forget_authorization(GksuDBusGksu *manager,
+                                                       GDBusMethodInvocation *invocation,
+                                                       GksuServer *self)
+{
+  gksu_server_forget_authorization(self, g_dbus_method_invocation_get_sender(invocation));
+  gksu_dbus_gksu_complete_forget_authorization(manager, invocation);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_get_process(GksuDBusGksu *manager,
+                                               GDBusMethodInvocation *invocation,
+                                               guint32 cookie, GksuServer *self)
+{
+  GError *error = NULL;
+  gchar *path;
+
+  if(!gksu_server_get_process(self, cookie, &path, &error))
+    {
+      gksu_server_complete_call(invocation, error);
+      return TRUE;
+    }
+
+  gksu_dbus_gksu_complete_get_process(manager, invocation, path);
+  g_free(path);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_read_output(GksuDBusGksu *manager,
+                                               GDBusMethodInvocation *invocation,
+                                               guint32 cookie, gint fd, GksuServer *self)
+{
+  GError *error = NULL;
+  gchar *data;
+  gsize length;
+
+  if(!gksu_server_read_output(self, cookie, fd, &data, &length, &error))
+    {
+      gksu_server_complete_call(invocation, error);
+      return TRUE;
+    }
+
+  gksu_dbus_gksu_complete_read_output(manager, invocation, data, length);
+  g_free(data);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_start_streaming(GksuDBusGksu *manager,
+                                                   GDBusMethodInvocation *invocation,
+                                                   guint32 cookie, GksuServer *self)
+{
+  GError *error = NULL;
+
+  gksu_server_start_streaming(self, cookie, &error);
+  gksu_server_complete_call(invocation, error);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_set_output_paused(GksuDBusGksu *manager,
+                                                     GDBusMethodInvocation *invocation,
+                                                     guint32 cookie, gint fd,
+                                                     gboolean paused, GksuServer *self)
+{
+  GError *error = NULL;
+
+  gksu_server_set_output_paused(self, cookie, fd, paused, &error);
+  gksu_server_complete_call(invocation, error);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_set_io_weight(GksuDBusGksu *manager,
+                                                 GDBusMethodInvocation *invocation,
+                                                 guint32 cookie, guint weight,
+                                                 GksuServer *self)
+{
+  GError *error = NULL;
+
+  gksu_server_set_io_weight(self, cookie, weight, &error);
+  gksu_server_complete_call(invocation, error);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_write_input(GksuDBusGksu *manager,
+                                               GDBusMethodInvocation *invocation,
+                                               guint32 cookie, const gchar *data,
+                                               guint64 length, GksuServer *self)
+{
+  /* the string can't carry more than itself */
+  gksu_server_write_input(self, cookie, data, MIN(length, strlen(data)), invocation);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_close_fd(GksuDBusGksu *manager,
+                                            GDBusMethodInvocation *invocation,
+                                            guint32 cookie, gint fd, GksuServer *self)
+{
+  GError *error = NULL;
+
+  gksu_server_close_fd(self, cookie, fd, &error);
+  gksu_server_complete_call(invocation, error);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_send_signal(GksuDBusGksu *manager,
+                                               GDBusMethodInvocation *invocation,
+                                               guint32 cookie, gint signum,
+                                               GksuServer *self)
+{
+  GError *error = NULL;
+
+  gksu_server_send_signal(self, cookie, signum, &error);
+  gksu_server_complete_call(invocation, error);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_wait(GksuDBusGksu *manager,
+                                        GDBusMethodInvocation *invocation,
+                                        guint32 cookie, GksuServer *self)
+{
+  GError *error = NULL;
+  gint status;
+
+  if(!gksu_server_wait(self, cookie, &status, &error))
+    {
+      gksu_server_complete_call(invocation, error);
+      return TRUE;
+    }
+
+  gksu_dbus_gksu_complete_wait(manager, invocation, status);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_read_output_bytes(GksuDBusGksu2 *manager,
+                                                     GDBusMethodInvocation *invocation,
+                                                     guint32 cookie, gint fd,
+                                                     GksuServer *self)
+{
+  gksu_server_read_output_bytes(self, cookie, fd, invocation);
+
+  return TRUE;
+}
+
+static gboolean gksu_server_handle_write_input_bytes(GksuDBusGksu2 *manager,
+                                                     GDBusMethodInvocation *invocation,
+                                                     guint32 cookie, GVariant *data,
+                                                     GksuServer *self)
+{
+  const gchar *bytes;
+  gsize length;
+
+  /* points right into the message; the controller copies it */
+  bytes = g_variant_get_fixed_array(data, &length, 1);
+  gksu_server_write_input(self, cookie, bytes, length, invocation);
+
+  return TRUE;
+}
+
+static void gksu_server_name_lost_cb(GDBusConnection *connection, const gchar *name,
+                                     GksuServer *self)
+{
+  g_error("Failed to get well-known name %s\n", name);
+  exit(1);
+}
+
+static void gksu_server_init(GksuServer *self)
+{
+  GksuServerPrivate *priv = GKSU_SERVER_GET_PRIVATE(self);
+
+  GError *error = NULL;
+
+  self->priv = priv;
+
+  /* "properties" */
+  priv->table = gksu_process_table_new();
+
+  priv->scheduler = gksu_io_scheduler_new(IO_SCHEDULER_QUANTUM);
+
+  /* PolicyKit setup */
+  priv->authority = polkit_authority_get();
+  priv->auth_cache = gksu_auth_cache_new(AUTH_CACHE_TTL);
+
+  g_signal_connect(priv->authority, "changed",
+                   G_CALLBACK(gksu_server_authority_changed_cb), self);
+
+  /* Basic DBus setup; GDBus reads and writes the messages in its own
+   * thread, and hands the calls to objects registered from here over
+   * to our main loop */
+  priv->connection = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+  if(error)
+    {
+      g_error("%s", error->message);
+      exit(1);
+    }
+
+  /* object exposure to DBus */
+  priv->manager = gksu_dbus_gksu_skeleton_new();
+  g_signal_connect(priv->manager, "handle-spawn",
+                   G_CALLBACK(gksu_server_handle_spawn), self);
+  g_signal_connect(priv->manager, "handle-spawn-with-fds",
+                   G_CALLBACK(gksu_server_handle_spawn_with_fds), self);
+  g_signal_connect(priv->manager, "handle-spawn-many",
+                   G_CALLBACK(gksu_server_handle_spawn_many), self);
+  g_signal_connect(priv->manager, "handle-forget-authorization",
+                   G_CALLBACK(gksu_server_handle_forget_authorization), self);
+  g_signal_connect(priv->manager, "handle-get-process",
+                   G_CALLBACK(gksu_server_handle_get_process), self);
+  g_signal_connect(priv->manager, "handle-read-output",
+                   G_CALLBACK(gksu_server_handle_read_output), self);
+  g_signal_connect(priv->manager, "handle-start-streaming",
+                   G_CALLBACK(gksu_server_handle_start_streaming), self);
+  g_signal_connect(priv->manager, "handle-set-output-paused",
+                   G_CALLBACK(gksu_server_handle_set_output_paused), self);
+  g_signal_connect(priv->manager, "handle-set-io-weight",
+                   G_CALLBACK(gksu_server_handle_set_io_weight), self);
+  g_signal_connect(priv->manager, "handle-write-input",
+                   G_CALLBACK(gksu_server_handle_write_input), self);
+  g_signal_connect(priv->manager, "handle-close-fd",
+                   G_CALLBACK(gksu_server_handle_close_fd), self);
+  g_signal_connect(priv->manager, "handle-send-signal",
+                   G_CALLBACK(gksu_server_handle_send_signal), self);
+  g_signal_connect(priv->manager, "handle-wait",
+                   G_CALLBACK(gksu_server_handle_wait), self);
+
+  priv->manager2 = gksu_dbus_gksu2_skeleton_new();
+  g_signal_connect(priv->manager2, "handle-read-output",
+                   G_CALLBACK(gksu_server_handle_read_output_bytes), self);
+  g_signal_connect(priv->manager2, "handle-write-input",
+                   G_CALLBACK(gksu_server_handle_write_input_bytes), self);
+
+  /* the skeletons' own interface info, which their dispatcher
+   * relies on; neither interface has properties, and the signals are
+   * sent by hand, so exporting the skeletons would buy us nothing */
+  priv->manager_id =
+    g_dbus_connection_register_object(priv->connection, "/org/gnome/Gksu",
+                                      g_dbus_interface_skeleton_get_info(G_DBUS_INTERFACE_SKELETON(priv->manager)),
+                                      &gksu_server_vtable, self, NULL, &error);
+  if(priv->manager_id)
+    priv->manager2_id =
+      g_dbus_connection_register_object(priv->connection, "/org/gnome/Gksu",
+                                        g_dbus_interface_skeleton_get_info(G_DBUS_INTERFACE_SKELETON(priv->manager2)),
+                                        &gksu_server_vtable, self, NULL, &error);
+  if(priv->manager2_id == 0)
+    {
+      g_error("%s", error->message);
+      exit(1);
+    }
+
+  priv->name_owner_id = g_bus_own_name_on_connection(priv->connection,
+                                                     "org.gnome.Gksu",
+                                                     G_BUS_NAME_OWNER_FLAGS_NONE,
+                                                     NULL,
+                                                     (GBusNameLostCallback)gksu_server_name_lost_cb,
+                                                     self, NULL);
+
+  /* monitor zombies */
+  g_timeout_add_seconds(ZOMBIE_CHECK_DELAY,
+                        (GSourceFunc)gksu_server_handle_zombies,
+                        (gpointer)self);
+}
@@ -21,7 +21,7 @@
 #define __GKSU_SERVER_H__ 1
 
 #include <glib-object.h>
-#include <dbus/dbus-glib.h>
+#include <gio/gio.h>
 #include <polkit/polkit.h>
 
 typedef struct _GksuServerPrivate GksuServerPrivate;
@@ -41,13 +41,23 @@ GType gksu_server_get_type(void);
 #define GKSU_SERVER(object) (G_TYPE_CHECK_INSTANCE_CAST ((object), GKSU_TYPE_SERVER, GksuServer))
 #define GKSU_SERVER_GET_CLASS(object)  (G_TYPE_INSTANCE_GET_CLASS ((object), GKSU_TYPE_SERVER, GksuServerClass))
 
-gboolean gksu_server_spawn(GksuServer *self, gchar *cwd, gchar *xauth, gchar **args,
-                           GHashTable *environment, gboolean using_stdin, gboolean using_stdout,
-                           gboolean using_stderr, gint *pid, guint32 *cookie, GError **error);
+void gksu_server_set_read_budget(GksuServer *self, gsize budget);
+
+void gksu_server_set_auth_cache_ttl(GksuServer *self, guint ttl);
+
+void gksu_server_forget_authorization(GksuServer *self, const gchar *subject);
+
+void gksu_server_complete_call(GDBusMethodInvocation *invocation, GError *error);
+
+gboolean gksu_server_get_process(GksuServer *self, guint32 cookie, gchar **path, GError **error);
 gboolean gksu_server_close_fd(GksuServer *self, guint32 cookie, gint fd, GError **error);
 gboolean gksu_server_read_output(GksuServer *self, guint32 cookie, gint fd, gchar **data, gsize *length, GError **error);
+void gksu_server_read_output_bytes(GksuServer *self, guint32 cookie, gint fd, GDBusMethodInvocation *invocation);
 gboolean gksu_server_wait(GksuServer *self, guint32 cookie, gint *status, GError **error);
-gboolean gksu_server_write_input(GksuServer *self, guint32 cookie, gchar *data, gsize length, GError **error);
+gboolean gksu_server_start_streaming(GksuServer *self, guint32 cookie, GError **error);
+void gksu_server_write_input(GksuServer *self, guint32 cookie, const gchar *data, gsize length, GDBusMethodInvocation *invocation);
+gboolean gksu_server_set_io_weight(GksuServer *self, guint32 cookie, guint weight, GError **error);
+gboolean gksu_server_set_output_paused(GksuServer *self, guint32 cookie, gint fd, gboolean paused, GError **error);
 gboolean gksu_server_send_signal(GksuServer *self, guint32 cookie, gint signum, GError **error);
 
 #endif
@@ -20,8 +20,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 
 #include "gksu-server.h"
+#include "gksu-launcher.h"
+
+static gint read_budget = 0;
+static gint auth_cache_ttl = -1;
+static gboolean prefork_launcher = FALSE;
+
+static GOptionEntry entries[] =
+{
+  { "read-budget", 0, 0, G_OPTION_ARG_INT, &read_budget,
+    "How many bytes of output to read from a child in one go, before "
+    "serving others (default: 262144; 65536 per round when streaming)", "BYTES" },
+  { "auth-cache-ttl", 0, 0, G_OPTION_ARG_INT, &auth_cache_ttl,
+    "For how long to trust PolicyKit's answer to a client, when PolicyKit "
+    "would give it again without asking (default: 60; 0 to always ask)", "SECONDS" },
+  { "prefork-launcher", 0, 0, G_OPTION_ARG_NONE, &prefork_launcher,
+    "Start children from a small helper process, started along with the "
+    "server, instead of from the server itself", NULL },
+  { NULL }
+};
 
 void server_shutdown_cb(GksuServer *server, GMainLoop *loop)
 {
@@ -30,13 +50,42 @@ void server_shutdown_cb(GksuServer *server, GMainLoop *loop)
 
 int main (int argc, char ** argv)
 {
+  GOptionContext *context;
   GMainLoop *loop;
   GksuServer *server;
+  GError *error = NULL;
+
+  /* we are the launcher helper, started by another gksu-server */
+  if((argc == 2) && !strcmp(argv[1], GKSU_LAUNCHER_HELPER_ARG))
+    return gksu_launcher_helper_main(3);
 
   g_type_init ();
+
+  context = g_option_context_new("- Gksu PolicyKit mechanism");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if(!g_option_context_parse(context, &argc, &argv, &error))
+    {
+      g_warning("%s", error->message);
+      g_error_free(error);
+      return 1;
+    }
+  g_option_context_free(context);
   
+  /* a child closing its stdin while we have input queued for it
+   * should only fail that write */
+  signal(SIGPIPE, SIG_IGN);
+
+  /* before the server has a bus connection and the rest of its state */
+  if(prefork_launcher)
+    gksu_launcher_start_helper();
+
   loop = g_main_loop_new(NULL, TRUE);
   server = g_object_new(GKSU_TYPE_SERVER, NULL);
+
+  if(read_budget > 0)
+    gksu_server_set_read_budget(server, read_budget);
+  if(auth_cache_ttl >= 0)
+    gksu_server_set_auth_cache_ttl(server, auth_cache_ttl);
   g_signal_connect(G_OBJECT(server), "shutdown",
                    G_CALLBACK(server_shutdown_cb), (gpointer)loop);
   g_main_loop_run(loop);